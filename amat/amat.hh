@@ -4,6 +4,7 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <util/delay.h>
 #include <stdio.h>
 
 // Set up test machinery before including anything from amat. {{{
@@ -62,6 +63,12 @@
 
 // The clock must be defined after timer1.
 #include "parts/clock.hh"
+// The step generator and software PWM use a 16 bit counter.
+#include "parts/stepper.hh"
+#include "parts/softpwm.hh"
+// The storage drivers use the Spi interface.
+#include "parts/spiflash.hh"
+#include "parts/sdcard.hh"
 // Every mcu has info support. It must be included last (but before the second test.hh), so do it here.
 #include "parts/info.hh"
 // At the end, include test.hh a second time; it defines some variables then.
@@ -40,6 +40,7 @@
 
 // Adc {{{
 #define _AVR_NUM_ADC_PINS 8
+#define _AVR_HAVE_ADC_MUX5
 #define _AVR_HAVE_REF_2_56V
 #define PIN_ADC0 GPIO_MAKE_PIN(PF, 0)
 #define PIN_ADC1 GPIO_MAKE_PIN(PF, 1)
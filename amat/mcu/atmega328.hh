@@ -38,6 +38,12 @@
 
 // Adc {{{
 #define _AVR_NUM_ADC_PINS 8
+#define _AVR_HAVE_ADC_TEMP
+// Temperature sensor reading at 0 °C and °C per step in 1/256 units; typical values from the datasheet.
+#define _AVR_ADC_TEMP_OFFSET 287
+#define _AVR_ADC_TEMP_GAIN 238
+// REFS value for the temperature sensor.
+#define _AVR_ADC_TEMP_REF 3
 // Use ids that are not digital pins for adc6 and adc7, because they are not shared with digital pins.
 #define PIN_ADC0 GPIO_MAKE_PIN(PC, 0)
 #define PIN_ADC1 GPIO_MAKE_PIN(PC, 1)
@@ -25,6 +25,13 @@
 
 // Adc {{{
 #define _AVR_NUM_ADC_PINS 14
+#define _AVR_HAVE_ADC_MUX5
+#define _AVR_HAVE_ADC_TEMP
+// Temperature sensor reading at 0 °C and °C per step in 1/256 units. These are rough estimates; calibration is needed.
+#define _AVR_ADC_TEMP_OFFSET 110
+#define _AVR_ADC_TEMP_GAIN 640
+// REFS value for the temperature sensor (this is the 2.56 V reference on this part).
+#define _AVR_ADC_TEMP_REF 3
 // Use ids that are not digital pins for adc6 and adc7, because they are not shared with digital pins.
 #define PIN_ADC0 GPIO_MAKE_PIN(PF, 0)
 #define PIN_ADC1 GPIO_MAKE_PIN(PF, 1)
@@ -31,6 +31,8 @@
 #define PIN_DI GPIO_MAKE_PIN(PB, 5)
 #define PIN_DO GPIO_MAKE_PIN(PB, 6)
 #define PIN_USCK GPIO_MAKE_PIN(PB, 7)
+// Pin change interrupt for DI, used to find the start bit for UART input.
+#define _AVR_USI_DI_PCINT 5
 // }}}
 
 // Pcint {{{
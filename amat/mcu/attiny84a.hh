@@ -19,6 +19,14 @@
 
 // Adc {{{
 #define _AVR_NUM_ADC_PINS 8
+#define _AVR_HAVE_ADC_TEMP
+// Temperature sensor reading at 0 °C and °C per step in 1/256 units; typical values from the datasheet.
+#define _AVR_ADC_TEMP_OFFSET 275
+#define _AVR_ADC_TEMP_GAIN 256
+// REFS value for the temperature sensor.
+#define _AVR_ADC_TEMP_REF 2
+// REFS value for Vcc as reference.
+#define _AVR_ADC_VCC_REF 0
 #define PIN_ADC0 GPIO_MAKE_PIN(PA, 0)
 #define PIN_ADC1 GPIO_MAKE_PIN(PA, 1)
 #define PIN_ADC2 GPIO_MAKE_PIN(PA, 2)
@@ -183,6 +191,8 @@ enum Source {
 #define PIN_DI GPIO_MAKE_PIN(PA, 6)
 #define PIN_DO GPIO_MAKE_PIN(PA, 5)
 #define PIN_USCK GPIO_MAKE_PIN(PA, 4)
+// Pin change interrupt for DI, used to find the start bit for UART input.
+#define _AVR_USI_DI_PCINT 6
 // }}}
 
 // Pcint {{{
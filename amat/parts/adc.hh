@@ -1,5 +1,21 @@
 // Analog to digital converter
 
+// Options:
+// ADC_MAX_CLOCK
+// ADC_SCAN_SIZE
+// ADC_SCAN_CHANNELS
+// ADC_SAMPLE_RATE
+// ADC_SAMPLE_COUNTER
+// CALL_adc_samples
+// ADC_ENABLE_OVERSAMPLE
+// ADC_OVERSAMPLE_DITHER_PIN
+// CALL_adc_oversample
+// ADC_ENABLE_SLEEP
+// ADC_REF_SETTLE
+// ADC_CALIBRATION_ADDRESS
+// ADC_WINDOW_CHANNELS
+// CALL_adc_window
+
 /** @file
 # Analog to digital converter.
 
@@ -27,6 +43,99 @@ ISR(ADC_vect) {
 }
 ```
 
+To measure several inputs, the scan sequencer can be used. It converts a list
+of channels in free running mode from the ADC interrupt and stores every
+complete scan as a frame in a buffer. It is enabled by defining
+ADC_SCAN_SIZE to the number of frames in the buffer. The library then defines
+ISR(ADC_vect).
+```
+#define ADC_SCAN_SIZE 4
+#define DBG_ENABLE
+#include <amat.hh>
+
+static Adc::ScanChannel const channels[] = {
+	{Adc::SRC_A0, Adc::REF_AVCC},
+	{Adc::SRC_A1, Adc::REF_AVCC},
+	{Adc::SRC_1V1, Adc::REF_AVCC}
+};
+
+void setup() {
+	Adc::scan_start(channels, 3);
+}
+
+void loop() {
+	if (Adc::scan_available() == 0)
+		return;
+	uint16_t const *frame = Adc::scan_frame();
+	dbg("* * *", frame[0], frame[1], frame[2]);
+	Adc::scan_pop();
+}
+```
+
+For sampling a single channel at an exact rate, define ADC_SAMPLE_RATE. A
+compare match of counter 0 or 1 (ADC_SAMPLE_COUNTER) then triggers the
+conversions, so there is no software jitter. The results are written to a
+double buffer; while one half is being filled, the other can be processed.
+```
+#define ADC_SAMPLE_RATE 8000
+#define CALL_adc_samples
+#include <amat.hh>
+
+static uint16_t buffer[64];
+
+void setup() {
+	Adc::sample_at(Adc::SRC_A0, buffer, 64);
+}
+
+void adc_samples(uint16_t *data, uint16_t count) {
+	// Called from the interrupt whenever 32 new samples are available.
+}
+```
+
+With ADC_ENABLE_OVERSAMPLE defined, 4ⁿ conversions can be added up in the
+interrupt handler and scaled down to a result with n extra bits of
+resolution. This only works if there is some noise on the input; if the
+signal is too clean, ADC_OVERSAMPLE_DITHER_PIN can be used to add a small
+ramp to it.
+```
+#define ADC_ENABLE_OVERSAMPLE
+#define DBG_ENABLE
+#include <amat.hh>
+
+void setup() {
+	sei();
+	// 12 bit result, measured while the CPU sleeps.
+	uint16_t value = Adc::oversample_sleep(Adc::SRC_A0, 2);
+	dbg("*", value);
+}
+```
+
+To watch inputs for leaving a range, define ADC_WINDOW_CHANNELS. The inputs are
+converted continuously and checked against their limits in the interrupt
+handler. The callback is only called when an input crosses a limit. It runs up
+to two conversions after the crossing with one input, and later with more; for
+a reaction within one conversion, use Comparator::window().
+```
+#define ADC_WINDOW_CHANNELS 2
+#define CALL_adc_window
+#include <amat.hh>
+
+// Source, reference, low limit, high limit, hysteresis.
+static Adc::WindowChannel const channels[] = {
+	{Adc::SRC_A0, Adc::REF_AVCC, 0, 800, 20},
+	{Adc::SRC_A1, Adc::REF_AVCC, 300, 700, 10}
+};
+
+void setup() {
+	Adc::window_start(channels, 2);
+}
+
+void adc_window(uint8_t channel, uint8_t state, uint16_t value) {
+	if (channel == 0 && state == Adc::WINDOW_ABOVE)
+		Gpio::write(GPIO_MAKE_PIN(PD, 4), false);	// Overcurrent: switch off the load.
+}
+```
+
 @author Bas Wijnen <wijnen@debian.org>
 */
 
@@ -37,6 +146,118 @@ ISR(ADC_vect) {
 #define _AVR_HAVE_REF_2_56V
 #endif
 
+#ifndef ADC_MAX_CLOCK
+/// Highest ADC clock frequency that the prescaler may select.
+/**
+ * Full resolution requires at most 200 kHz. Faster clocks give more samples
+ * per second at reduced accuracy; the hardware supports up to 1 MHz.
+ */
+#define ADC_MAX_CLOCK 200000
+#endif
+
+#ifndef ADC_REF_SETTLE
+/// Number of conversions that are discarded after the reference voltage has changed.
+/**
+ * The external capacitor on AREF needs time to charge to the new reference.
+ * The default of 32 conversions is about 2 ms at 200 kHz.
+ */
+#define ADC_REF_SETTLE 32
+#endif
+
+/// @cond
+#ifndef _AVR_ADC_VCC_REF
+// REFS value for Vcc as reference.
+#define _AVR_ADC_VCC_REF 1
+#endif
+/// @endcond
+
+#ifdef ADC_SCAN_SIZE
+#ifndef ADC_SCAN_CHANNELS
+/// Maximum number of channels in a scan frame.
+#define ADC_SCAN_CHANNELS 8
+#endif
+#endif
+
+#ifdef ADC_SAMPLE_RATE
+#ifndef ADC_SAMPLE_COUNTER
+/// Counter that triggers sampling. Default: 1. Must be 0 or 1.
+#define ADC_SAMPLE_COUNTER 1
+#endif
+
+/// @cond
+#define _AVR_ADC_SAMPLE_MAX (ADC_SAMPLE_COUNTER == 0 ? 0x100UL : 0x10000UL)
+#define _AVR_ADC_SAMPLE_TICKS (uint32_t(F_CPU) / uint32_t(ADC_SAMPLE_RATE))
+// Smallest prescaler that makes TOP fit in the counter.
+#define _AVR_ADC_SAMPLE_DIVIDER ( \
+	_AVR_ADC_SAMPLE_TICKS <= _AVR_ADC_SAMPLE_MAX ? 1 : \
+	_AVR_ADC_SAMPLE_TICKS / 8 <= _AVR_ADC_SAMPLE_MAX ? 8 : \
+	_AVR_ADC_SAMPLE_TICKS / 64 <= _AVR_ADC_SAMPLE_MAX ? 64 : \
+	_AVR_ADC_SAMPLE_TICKS / 256 <= _AVR_ADC_SAMPLE_MAX ? 256 : 1024)
+// Clock select bits; they are the same for counters 0 and 1.
+#define _AVR_ADC_SAMPLE_CS ( \
+	_AVR_ADC_SAMPLE_DIVIDER == 1 ? 1 : \
+	_AVR_ADC_SAMPLE_DIVIDER == 8 ? 2 : \
+	_AVR_ADC_SAMPLE_DIVIDER == 64 ? 3 : \
+	_AVR_ADC_SAMPLE_DIVIDER == 256 ? 4 : 5)
+/// @endcond
+
+/// Value that is used for TOP of the sample counter.
+#define ADC_SAMPLE_TOP ((uint32_t(F_CPU) + uint32_t(ADC_SAMPLE_RATE) * _AVR_ADC_SAMPLE_DIVIDER / 2) / (uint32_t(ADC_SAMPLE_RATE) * _AVR_ADC_SAMPLE_DIVIDER) - 1)
+/// Sample rate that is actually used, which can differ from ADC_SAMPLE_RATE due to rounding.
+#define ADC_SAMPLE_ACTUAL_RATE (uint32_t(F_CPU) / (_AVR_ADC_SAMPLE_DIVIDER * (ADC_SAMPLE_TOP + 1)))
+
+#if ADC_SAMPLE_COUNTER == 0
+#ifdef SYSTEM_CLOCK0_ENABLE
+#error "Counter 0 is used for the system clock and can not trigger ADC sampling"
+#endif
+#elif ADC_SAMPLE_COUNTER == 1
+#if defined(SYSTEM_CLOCK1_ENABLE_CAPT) || defined(SYSTEM_CLOCK1_ENABLE_COMPA) || defined(CAPTURE1_SIZE) || defined(PWM1_FREQUENCY) \
+	|| (defined(STEPPER_AXES) && (!defined(STEPPER_COUNTER) || STEPPER_COUNTER == 1)) \
+	|| (defined(SOFTPWM_CHANNELS) && (!defined(SOFTPWM_COUNTER) || SOFTPWM_COUNTER == 1))
+#error "Counter 1 is already in use and can not trigger ADC sampling"
+#endif
+#else
+#error "ADC_SAMPLE_COUNTER must be 0 or 1"
+#endif
+
+/// @cond
+#ifdef CALL_adc_samples
+static void adc_samples(uint16_t *data, uint16_t count);
+#endif
+/// @endcond
+#endif
+
+#ifdef ADC_WINDOW_CHANNELS
+/// @cond
+#ifdef CALL_adc_window
+static void adc_window(uint8_t channel, uint8_t state, uint16_t value);
+#endif
+/// @endcond
+#endif
+
+#ifdef ADC_ENABLE_OVERSAMPLE
+/// @cond
+#ifdef CALL_adc_oversample
+static void adc_oversample(uint16_t value);
+#endif
+/// @endcond
+#endif
+
+/// @cond
+#if defined(PRR0)
+#define _AVR_ADC_PRR PRR0
+#elif defined(PRR)
+#define _AVR_ADC_PRR PRR
+#endif
+
+#if defined(ADC_SCAN_SIZE) || defined(ADC_SAMPLE_RATE) || defined(ADC_ENABLE_OVERSAMPLE) || defined(ADC_ENABLE_SLEEP) || defined(ADC_WINDOW_CHANNELS)
+#define _AVR_ADC_ISR
+#ifdef AVR_TEST_ADC
+#error "The ADC interrupt is used by the library and can not be used for testing the ADC"
+#endif
+#endif
+/// @endcond
+
 /// @cond
 // Find number of pins and build pin id array for test. {{{
 #ifdef PIN_ADC15
@@ -409,7 +630,24 @@ uint8_t adc_pin_list[ADC_NUM_PINS] = {
 /// Analog to Digital Converter
 namespace Adc {
 	/// @cond
-	uint8_t const _ps = (F_CPU < 200000 * 2 ? 1 : F_CPU < 200000 * 4 ? 2 : F_CPU < 200000 * 8 ? 3 : F_CPU < 200000 * 16 ? 4 : F_CPU < 200000 * 32 ? 5 : F_CPU < 200000 * 64 ? 6 : 7) << ADPS0;
+	uint8_t const _ps = (F_CPU <= ADC_MAX_CLOCK * 2UL ? 1 : F_CPU <= ADC_MAX_CLOCK * 4UL ? 2 : F_CPU <= ADC_MAX_CLOCK * 8UL ? 3 : F_CPU <= ADC_MAX_CLOCK * 16UL ? 4 : F_CPU <= ADC_MAX_CLOCK * 32UL ? 5 : F_CPU <= ADC_MAX_CLOCK * 64UL ? 6 : 7) << ADPS0;
+	// Bits in ADCSRB that are not changed when setting the trigger.
+#ifdef _AVR_HAVE_ADC_MUX5
+	uint8_t const _adcsrb_keep = _BV(ACME) | _BV(MUX5);
+#else
+	uint8_t const _adcsrb_keep = _BV(ACME);
+#endif
+#ifdef _AVR_ADC_ISR
+	// Feature that handles the ADC interrupt.
+	enum _IsrMode {
+		_ISR_NONE,
+		_ISR_SCAN,
+		_ISR_SAMPLE,
+		_ISR_OVERSAMPLE,
+		_ISR_WINDOW
+	};
+	static volatile uint8_t _isr_mode;
+#endif
 	/// @endcond
 
 	enum Source;	// defined in the mcu definition.
@@ -480,7 +718,13 @@ namespace Adc {
 	 * available) REF_2_56V. The last two are internal voltage references.
 	 */
 	static inline void set_source(Source target = SRC_A0, Ref ref = REF_AVCC) { // {{{
+#ifdef _AVR_HAVE_ADC_MUX5
+		// The highest mux bit is not in ADMUX.
+		ADCSRB = (ADCSRB & ~_BV(MUX5)) | (target & 0x20 ? _BV(MUX5) : 0);
+		ADMUX = (ADMUX & _BV(ADLAR)) | (ref << REFS0) | ((target & 0x1f) << MUX0);
+#else
 		ADMUX = (ADMUX & _BV(ADLAR)) | (ref << REFS0) | (target << MUX0);
+#endif
 	} // }}}
 
 	/// Left- (or right-) adjust measurement result.
@@ -521,18 +765,60 @@ namespace Adc {
 		return read();
 	} // }}}
 
+#if (defined(ADC_ENABLE_SLEEP) && defined(SLEEP_MODE_ADC)) || defined(DOXYGEN)
+	/// Do a single measurement in ADC noise reduction sleep mode and return the result.
+	/**
+	 * The CPU sleeps during the conversion, which removes most digital
+	 * noise and saves power. If another interrupt wakes the CPU before
+	 * the conversion is complete, it goes back to sleep.
+	 *
+	 * In this sleep mode the I/O clock is stopped, so the synchronous
+	 * counters and the serial interfaces are already halted. Modules that
+	 * keep running, such as an asynchronous counter 2, can be stopped as
+	 * well by passing their power reduction bits in gate. They are
+	 * enabled again when the conversion is complete.
+	 *
+	 * This is only available if ADC_ENABLE_SLEEP is defined; the library
+	 * then defines ISR(ADC_vect). Interrupts are enabled while it runs.
+	 *
+	 * @param gate Bits to set in PRR (PRR0 on parts that have two registers) during the conversion.
+	 */
+	static inline uint16_t single_sleep(uint8_t gate = 0) { // {{{
+		_isr_mode = _ISR_NONE;
+		ADCSRA = _BV(ADEN) | _BV(ADIF) | _BV(ADIE) | _ps;
+#ifdef _AVR_ADC_PRR
+		uint8_t prr = _AVR_ADC_PRR;
+		_AVR_ADC_PRR = prr | (gate & ~_BV(PRADC));
+#else
+		(void)&gate;
+#endif
+		uint8_t sreg = SREG;
+		sei();
+		// Start the conversion before sleeping, so a pending
+		// interrupt that wakes the CPU right away can't prevent it.
+		ADCSRA |= _BV(ADSC);
+		while (ADCSRA & _BV(ADSC))
+			Sleep::adc_noise_reduction();
+		SREG = sreg;
+#ifdef _AVR_ADC_PRR
+		_AVR_ADC_PRR = prr;
+#endif
+		return read(false);
+	} // }}}
+#endif
+
 	/// Set the ADC for automatic measuring.
 	/**
 	 * Autmatic triggering stops when single(), stop() or disable() is called.
 	 */
 	static inline void continuous(Trigger trigger) { // {{{
 		if (trigger == TRIGGER_FREE) {
-			ADCSRB = (ADCSRB & _BV(ACME)) | (trigger << ADTS0);
+			ADCSRB = (ADCSRB & _adcsrb_keep) | (trigger << ADTS0);
 			ADCSRA = _BV(ADEN) | _BV(ADSC) | _BV(ADATE) | _BV(ADIF) | _ps | (ADCSRA & _BV(ADIE));
 		}
 		else {
 			ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIF) | _ps | (ADCSRA & _BV(ADIE));
-			ADCSRB = (ADCSRB & _BV(ACME)) | (trigger << ADTS0);
+			ADCSRB = (ADCSRB & _adcsrb_keep) | (trigger << ADTS0);
 		}
 	} // }}}
 
@@ -575,8 +861,830 @@ namespace Adc {
 	/// Enable power to the ADC.
 	static inline void on() { PRR0 &= ~_BV(PRADC); }
 #endif
+
+	// Calibrated measurements. {{{
+
+	/// @cond
+	// Measure source against ref, after the result has settled.
+	static inline uint16_t _settled(Source source, Ref ref) { // {{{
+		bool ref_changed = !(ADCSRA & _BV(ADEN)) || ((ADMUX >> REFS0) & 3) != ref;
+		left_adjust(false);
+		set_source(source, ref);
+		// After a change of reference, the capacitor on AREF needs to
+		// charge. After a change of input, the sample and hold
+		// capacitor needs to settle; for the bandgap and temperature
+		// inputs, this takes longer than a single conversion.
+		for (uint8_t i = 0; i < (ref_changed ? ADC_REF_SETTLE : 1); ++i)
+			single_block();
+		uint16_t value = single_block();
+		for (uint8_t i = 0; i < 16; ++i) {
+			uint16_t next = single_block();
+			uint16_t diff = next > value ? next - value : value - next;
+			value = next;
+			if (diff <= 1)
+				break;
+		}
+		return value;
+	} // }}}
+#ifdef ADC_CALIBRATION_ADDRESS
+	// Offsets in the calibration block.
+	enum _Calibration {
+		_CAL_BANDGAP = 0,
+		_CAL_TEMP_OFFSET = 2,
+		_CAL_TEMP_GAIN = 4
+	};
+	static inline uint16_t _cal_read(uint8_t offset) { // {{{
+		return Eeprom::read(ADC_CALIBRATION_ADDRESS + offset) | (Eeprom::read(ADC_CALIBRATION_ADDRESS + offset + 1) << 8);
+	} // }}}
+	static inline void _cal_write(uint8_t offset, uint16_t value) { // {{{
+		Eeprom::write(ADC_CALIBRATION_ADDRESS + offset, value & 0xff);
+		Eeprom::write(ADC_CALIBRATION_ADDRESS + offset + 1, value >> 8);
+	} // }}}
+#endif
+	/// @endcond
+
+#ifdef DOXYGEN
+	/// Define this to read calibration constants from EEPROM.
+	/**
+	 * The value is the EEPROM address of a 6 byte block. It holds three
+	 * little endian 16 bit values: the bandgap voltage in mV, the
+	 * temperature sensor reading at 0 °C, and the temperature change per
+	 * step in 1/256 °C. A value of 0xffff (erased EEPROM) means that the
+	 * default for the device is used.
+	 */
+#define ADC_CALIBRATION_ADDRESS
+#endif
+
+	/// Get the voltage of the internal bandgap reference in mV.
+	/**
+	 * This is the calibrated value if ADC_CALIBRATION_ADDRESS is defined and
+	 * it has been set, otherwise the nominal 1100 mV. The actual voltage
+	 * differs by up to 10% between devices.
+	 */
+	static inline uint16_t bandgap_mv() { // {{{
+#ifdef ADC_CALIBRATION_ADDRESS
+		uint16_t mv = _cal_read(_CAL_BANDGAP);
+		if (mv != 0xffff)
+			return mv;
+#endif
+		return 1100;
+	} // }}}
+
+	/// Measure the supply voltage in mV.
+	/**
+	 * This measures the bandgap reference against Vcc, so it does not need
+	 * any external components. The ADC must not be in use by anything
+	 * else. The source, reference and adjustment are changed; when the
+	 * reference changes, ADC_REF_SETTLE conversions are discarded first.
+	 *
+	 * No floating point operations are used.
+	 */
+	static inline uint16_t vcc_mv() { // {{{
+		uint16_t raw = _settled(SRC_1V1, Ref(_AVR_ADC_VCC_REF));
+		if (raw == 0)
+			return 0xffff;
+		return (uint32_t(bandgap_mv()) * 1024 + raw / 2) / raw;
+	} // }}}
+
+#if defined(ADC_CALIBRATION_ADDRESS) || defined(DOXYGEN)
+	/// Calibrate the bandgap voltage from a known supply voltage.
+	/**
+	 * Measure the bandgap with the supply at actual_mv (measured with a
+	 * good voltmeter) and store the result in EEPROM. After this,
+	 * vcc_mv() returns accurate values for this device.
+	 *
+	 * This is only available if ADC_CALIBRATION_ADDRESS is defined.
+	 */
+	static inline void calibrate_vcc(uint16_t actual_mv) { // {{{
+		uint16_t raw = _settled(SRC_1V1, Ref(_AVR_ADC_VCC_REF));
+		_cal_write(_CAL_BANDGAP, (uint32_t(raw) * actual_mv + 512) >> 10);
+	} // }}}
+#endif
+
+#if defined(_AVR_HAVE_ADC_TEMP) || defined(DOXYGEN)
+	/// Get the raw reading of the internal temperature sensor.
+	/**
+	 * This selects the internal reference that the sensor requires and
+	 * waits for it to settle, like vcc_mv().
+	 */
+	static inline uint16_t temperature_raw() { // {{{
+		return _settled(SRC_TEMP, Ref(_AVR_ADC_TEMP_REF));
+	} // }}}
+
+	/// @cond
+	static inline int16_t _temp_offset() { // {{{
+#ifdef ADC_CALIBRATION_ADDRESS
+		uint16_t offset = _cal_read(_CAL_TEMP_OFFSET);
+		if (offset != 0xffff)
+			return offset;
+#endif
+		return _AVR_ADC_TEMP_OFFSET;
+	} // }}}
+	static inline uint16_t _temp_gain() { // {{{
+#ifdef ADC_CALIBRATION_ADDRESS
+		uint16_t gain = _cal_read(_CAL_TEMP_GAIN);
+		if (gain != 0xffff)
+			return gain;
+#endif
+		return _AVR_ADC_TEMP_GAIN;
+	} // }}}
+	/// @endcond
+
+	/// Measure the chip temperature in °C.
+	/**
+	 * Without calibration, the result is based on typical values and may
+	 * be more than 10 °C off. Use calibrate_temperature() or
+	 * set_temperature_calibration() to store constants for this device in
+	 * EEPROM.
+	 *
+	 * No floating point operations are used.
+	 */
+	static inline int16_t temperature_c() { // {{{
+		int16_t raw = temperature_raw();
+		return (int32_t(raw - _temp_offset()) * _temp_gain() + 128) >> 8;
+	} // }}}
+
+#if defined(ADC_CALIBRATION_ADDRESS) || defined(DOXYGEN)
+	/// Store temperature calibration constants in EEPROM.
+	/**
+	 * @param offset The raw sensor value at 0 °C.
+	 * @param gain The temperature change per step, in 1/256 °C.
+	 *
+	 * This is only available if ADC_CALIBRATION_ADDRESS is defined.
+	 */
+	static inline void set_temperature_calibration(int16_t offset, uint16_t gain) { // {{{
+		_cal_write(_CAL_TEMP_OFFSET, offset);
+		_cal_write(_CAL_TEMP_GAIN, gain);
+	} // }}}
+
+	/// Calibrate the temperature sensor from one known temperature.
+	/**
+	 * The chip must be at actual_c, for example after it has been off for
+	 * a while at a known room temperature. The offset is computed from
+	 * the current gain and stored in EEPROM.
+	 *
+	 * This is only available if ADC_CALIBRATION_ADDRESS is defined.
+	 */
+	static inline void calibrate_temperature(int16_t actual_c) { // {{{
+		int16_t raw = temperature_raw();
+		_cal_write(_CAL_TEMP_OFFSET, raw - int16_t((int32_t(actual_c) * 256) / _temp_gain()));
+	} // }}}
+#endif
+#endif
+	// }}}
+
+#if defined(ADC_SCAN_SIZE) || defined(DOXYGEN)
+	// Scan sequencer. {{{
+
+	/// One entry in the channel list of a scan.
+	struct ScanChannel {
+		/// Input to measure.
+		Source source;
+		/// Reference voltage for this input.
+		Ref ref;
+	};
+
+/// @cond
+	static_assert(ADC_SCAN_SIZE > 0 && ADC_SCAN_SIZE < 0xff, "ADC_SCAN_SIZE must be between 1 and 254");
+	static_assert(ADC_SCAN_CHANNELS > 0 && ADC_SCAN_CHANNELS < 0x80, "ADC_SCAN_CHANNELS must be between 1 and 127");
+	// Set in a conversion index if its result must be ignored.
+	uint8_t const _SCAN_DISCARD = 0x80;
+	static ScanChannel const *_scan_channels;
+	static uint8_t _scan_num;
+	// In free running mode, the next conversion has already started
+	// when the interrupt fires, so a new mux setting is used for the
+	// conversion after that.
+	static uint8_t _scan_running;
+	static uint8_t _scan_queued;
+	// One frame more than the size, so the frame that is being filled
+	// never overlaps a frame that is waiting to be read.
+	static uint16_t _scan_buffer[ADC_SCAN_SIZE + 1][ADC_SCAN_CHANNELS];
+	static volatile uint8_t _scan_head;
+	static volatile uint8_t _scan_used;
+	static volatile uint8_t _scan_lost;
+
+	static inline void _scan_mux(uint8_t entry) { // {{{
+		ScanChannel const &channel = _scan_channels[entry & ~_SCAN_DISCARD];
+		set_source(channel.source, channel.ref);
+	} // }}}
+
+	// Return the conversion that follows entry.
+	static inline uint8_t _scan_next(uint8_t entry) { // {{{
+		uint8_t index = entry & ~_SCAN_DISCARD;
+		// The first conversion after a reference change is not
+		// reliable, so the same channel is converted again.
+		if (entry & _SCAN_DISCARD)
+			return index;
+		uint8_t next = index + 1 < _scan_num ? index + 1 : 0;
+		if (_scan_channels[next].ref != _scan_channels[index].ref)
+			return next | _SCAN_DISCARD;
+		return next;
+	} // }}}
+
+	static inline void _scan_isr(uint16_t value) { // {{{
+		uint8_t done = _scan_running;
+		_scan_running = _scan_queued;
+		_scan_queued = _scan_next(_scan_queued);
+		_scan_mux(_scan_queued);
+		if (done & _SCAN_DISCARD)
+			return;
+		uint8_t slot = _scan_head + _scan_used;
+		if (slot > ADC_SCAN_SIZE)
+			slot -= ADC_SCAN_SIZE + 1;
+		_scan_buffer[slot][done] = value;
+		if (done != _scan_num - 1)
+			return;
+		// Frame is complete.
+		if (_scan_used < ADC_SCAN_SIZE)
+			++_scan_used;
+		else if (_scan_lost < 0xff)
+			++_scan_lost;
+	} // }}}
+/// @endcond
+
+	/// Start scanning a list of channels.
+	/**
+	 * The channels are converted in order, repeatedly, until scan_stop
+	 * is called. Every complete pass is stored as a frame of num values,
+	 * in the same order as the channel list. The list is not copied; it
+	 * must stay valid while the scan is running.
+	 *
+	 * The converter runs in free running mode, so every conversion takes
+	 * 13 ADC clock cycles. When the reference changes between two
+	 * channels, the first conversion with the new reference is discarded,
+	 * which costs one extra conversion. Keep channels with the same
+	 * reference together to avoid this. If the AREF pin has a large
+	 * capacitor, a single conversion is not enough for it to settle and
+	 * all channels should use the same reference.
+	 *
+	 * To get more than 9600 conversions per second at 16 MHz, define
+	 * ADC_MAX_CLOCK to a higher value.
+	 *
+	 * @param channels List of channels to scan.
+	 * @param num Number of channels, at most ADC_SCAN_CHANNELS.
+	 */
+	static inline void scan_start(ScanChannel const *channels, uint8_t num) { // {{{
+		stop();
+		_scan_channels = channels;
+		_scan_num = num;
+		_scan_head = 0;
+		_scan_used = 0;
+		_scan_lost = 0;
+		// The mux must not be changed right after the first conversion
+		// is started, so the first channel is queued twice. The first
+		// conversion is discarded, because the reference may have
+		// changed.
+		_scan_running = _SCAN_DISCARD;
+		_scan_queued = _SCAN_DISCARD;
+		_scan_mux(0);
+		_isr_mode = _ISR_SCAN;
+		enable_int();
+		continuous(TRIGGER_FREE);
+	} // }}}
+
+	/// Stop scanning.
+	/**
+	 * Frames that are in the buffer can still be read.
+	 */
+	static inline void scan_stop() { // {{{
+		stop();
+		_isr_mode = _ISR_NONE;
+	} // }}}
+
+	/// Return the number of complete frames in the buffer.
+	static inline uint8_t scan_available() { return _scan_used; }
+
+	/// Return the oldest frame in the buffer.
+	/**
+	 * This must only be called if scan_available returns nonzero. The
+	 * data stays valid until scan_pop is called.
+	 */
+	static inline uint16_t const *scan_frame() { return _scan_buffer[_scan_head]; }
+
+	/// Remove the oldest frame from the buffer.
+	static inline void scan_pop() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		if (_scan_used > 0) {
+			_scan_head = _scan_head < ADC_SCAN_SIZE ? _scan_head + 1 : 0;
+			--_scan_used;
+		}
+		SREG = sreg;
+	} // }}}
+
+	/// Remove all frames from the buffer.
+	static inline void scan_clear() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_scan_head = 0;
+		_scan_used = 0;
+		SREG = sreg;
+	} // }}}
+
+	/// Return and reset the number of frames that were dropped because the buffer was full.
+	/**
+	 * This saturates at 255.
+	 */
+	static inline uint8_t scan_lost() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		uint8_t ret = _scan_lost;
+		_scan_lost = 0;
+		SREG = sreg;
+		return ret;
+	} // }}}
+
+	// }}}
+#endif
+
+#if defined(ADC_SAMPLE_RATE) || defined(DOXYGEN)
+	// Timed sampling. {{{
+
+/// @cond
+	static_assert(ADC_SAMPLE_TOP >= 1 && ADC_SAMPLE_TOP < _AVR_ADC_SAMPLE_MAX, "ADC_SAMPLE_RATE can not be reached with this counter");
+	// An auto triggered conversion takes 13.5 ADC clock cycles.
+	static_assert(uint32_t(ADC_SAMPLE_RATE) * (27UL << (_ps >> ADPS0)) <= 2 * uint32_t(F_CPU), "ADC_SAMPLE_RATE is faster than the ADC; define ADC_MAX_CLOCK to a higher value");
+	static uint16_t *_sample_buffer;
+	static uint16_t _sample_size;
+	static uint16_t _sample_pos;
+#ifndef CALL_adc_samples
+	// Bit 0 is set when the first half is full, bit 1 for the second half.
+	static volatile uint8_t _sample_ready;
+	static uint8_t _sample_next;
+	static volatile uint8_t _sample_lost;
+#endif
+
+	static inline void _sample_isr(uint16_t value) { // {{{
+		// The trigger is the rising edge of the compare match flag,
+		// so the flag must be cleared for the next sample.
+#if ADC_SAMPLE_COUNTER == 0
+		TIFR0 = _BV(OCF0A);
+#else
+		TIFR1 = _BV(OCF1B);
+#endif
+		_sample_buffer[_sample_pos++] = value;
+		uint16_t half = _sample_size >> 1;
+		uint8_t done;
+		if (_sample_pos == half)
+			done = 0;
+		else if (_sample_pos == _sample_size) {
+			_sample_pos = 0;
+			done = 1;
+		}
+		else
+			return;
+#ifdef CALL_adc_samples
+		adc_samples(&_sample_buffer[done ? half : 0], half);
+#else
+		if ((_sample_ready & _BV(done)) && _sample_lost < 0xff)
+			++_sample_lost;
+		_sample_ready |= _BV(done);
+#endif
+	} // }}}
+/// @endcond
+
+	/// Start sampling one channel at ADC_SAMPLE_RATE.
+	/**
+	 * The counter that is selected with ADC_SAMPLE_COUNTER is set to CTC
+	 * mode with a TOP value that is computed at compile time, and its
+	 * compare match triggers the conversions.
+	 *
+	 * The buffer is used as a double buffer. When a half is full, the
+	 * ADC continues with the other half. If CALL_adc_samples is defined,
+	 * adc_samples() is called from the interrupt with the half that has
+	 * just been filled. It must finish before the other half is full.
+	 * Otherwise, sample_get and sample_release must be used to read the
+	 * data.
+	 *
+	 * @param source Input to measure.
+	 * @param buffer Buffer for the samples. It must stay valid until sample_stop is called.
+	 * @param size Number of samples in the buffer. This should be even.
+	 * @param ref Reference voltage.
+	 */
+	static inline void sample_at(Source source, uint16_t *buffer, uint16_t size, Ref ref = REF_AVCC) { // {{{
+		stop();
+		_sample_buffer = buffer;
+		_sample_size = size & ~1;
+		_sample_pos = 0;
+#ifndef CALL_adc_samples
+		_sample_ready = 0;
+		_sample_next = 0;
+		_sample_lost = 0;
+#endif
+		set_source(source, ref);
+#if ADC_SAMPLE_COUNTER == 0
+		TCCR0B = 0;
+		TCCR0A = _BV(WGM01);
+		TCNT0 = 0;
+		OCR0A = ADC_SAMPLE_TOP;
+		TIFR0 = _BV(OCF0A);
+		_isr_mode = _ISR_SAMPLE;
+		enable_int();
+		continuous(TRIGGER_OC0A);
+		TCCR0B = _AVR_ADC_SAMPLE_CS << CS00;
+#else
+		TCCR1B = 0;
+		TCCR1A = 0;
+		TCNT1H = 0;
+		TCNT1L = 0;
+		OCR1AH = ADC_SAMPLE_TOP >> 8;
+		OCR1AL = ADC_SAMPLE_TOP & 0xff;
+		// Compare match B triggers the ADC; it matches at the same
+		// time as A, which resets the counter.
+		OCR1BH = ADC_SAMPLE_TOP >> 8;
+		OCR1BL = ADC_SAMPLE_TOP & 0xff;
+		TIFR1 = _BV(OCF1B);
+		_isr_mode = _ISR_SAMPLE;
+		enable_int();
+		continuous(TRIGGER_OC1B);
+		TCCR1B = _BV(WGM12) | (_AVR_ADC_SAMPLE_CS << CS10);
+#endif
+	} // }}}
+
+	/// Stop sampling.
+	static inline void sample_stop() { // {{{
+#if ADC_SAMPLE_COUNTER == 0
+		TCCR0B = 0;
+#else
+		TCCR1B = 0;
+#endif
+		stop();
+		_isr_mode = _ISR_NONE;
+	} // }}}
+
+#if !defined(CALL_adc_samples) || defined(DOXYGEN)
+	/// Return the oldest half of the buffer that is full, or NULL if there is none.
+	/**
+	 * The returned data contains half the size of the buffer. It must be
+	 * released with sample_release before the ADC needs it again. This
+	 * is only available if CALL_adc_samples is not defined.
+	 */
+	static inline uint16_t *sample_get() { // {{{
+		if (!(_sample_ready & _BV(_sample_next)))
+			return NULL;
+		return &_sample_buffer[_sample_next ? _sample_size >> 1 : 0];
+	} // }}}
+
+	/// Release the data that was returned by sample_get.
+	static inline void sample_release() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_sample_ready &= ~_BV(_sample_next);
+		SREG = sreg;
+		_sample_next ^= 1;
+	} // }}}
+
+	/// Return and reset the number of times a half was filled before it was released.
+	/**
+	 * This saturates at 255.
+	 */
+	static inline uint8_t sample_lost() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		uint8_t ret = _sample_lost;
+		_sample_lost = 0;
+		SREG = sreg;
+		return ret;
+	} // }}}
+#endif
+
+	// }}}
+#endif
+
+#if defined(ADC_ENABLE_OVERSAMPLE) || defined(DOXYGEN)
+	// Oversampling. {{{
+
+/// @cond
+	static uint32_t _os_sum;
+	static uint16_t _os_count;
+	static uint16_t _os_target;
+	static uint8_t _os_bits;
+	static bool _os_repeat;
+	static bool _os_sleep;
+	static bool _os_discard;
+	static volatile uint16_t _os_result;
+	static volatile bool _os_ready;
+
+	static inline void _os_isr(uint16_t value) { // {{{
+		// The first conversion after changing the reference is not reliable.
+		if (_os_discard) {
+			_os_discard = false;
+			return;
+		}
+		_os_sum += value;
+		++_os_count;
+#ifdef ADC_OVERSAMPLE_DITHER_PIN
+		// Pin is high during the first half of the block and low during
+		// the second half, so the offset is the same for every block.
+		if (_os_count == _os_target >> 1)
+			Gpio::write(ADC_OVERSAMPLE_DITHER_PIN, false);
+#endif
+		if (_os_count < _os_target)
+			return;
+		_os_result = _os_sum >> _os_bits;
+		_os_sum = 0;
+		_os_count = 0;
+		_os_ready = true;
+#ifdef ADC_OVERSAMPLE_DITHER_PIN
+		Gpio::write(ADC_OVERSAMPLE_DITHER_PIN, true);
+#endif
+		if (!_os_repeat) {
+			// In sleep mode, a conversion only starts when the CPU
+			// sleeps. oversample_sleep() may go to sleep once more
+			// after this, so the interrupt must stay enabled to wake
+			// it up; it stops the ADC itself.
+			if (!_os_sleep)
+				stop();
+			_isr_mode = _ISR_NONE;
+		}
+#ifdef CALL_adc_oversample
+		adc_oversample(_os_result);
+#endif
+	} // }}}
+
+	static inline void _os_setup(Source source, uint8_t bits, Ref ref, bool repeat) { // {{{
+		stop();
+		_os_discard = ((ADMUX >> REFS0) & 3) != ref;
+		set_source(source, ref);
+		if (bits > 6)
+			bits = 6;
+		_os_bits = bits;
+		_os_target = 1 << (2 * bits);
+		_os_sum = 0;
+		_os_count = 0;
+		_os_repeat = repeat;
+		_os_sleep = false;
+		_os_ready = false;
+#ifdef ADC_OVERSAMPLE_DITHER_PIN
+		Gpio::write(ADC_OVERSAMPLE_DITHER_PIN, true);
+#endif
+		_isr_mode = _ISR_OVERSAMPLE;
+	} // }}}
+/// @endcond
+
+	/// Start an oversampled measurement.
+	/**
+	 * The ADC runs in free running mode and the interrupt adds up
+	 * 4<sup>bits</sup> conversions. The result has 10 + bits bits. When it
+	 * is complete, oversample_ready returns true and, if
+	 * CALL_adc_oversample is defined, adc_oversample() is called from the
+	 * interrupt.
+	 *
+	 * At the default ADC clock, one extra bit takes 0.4 ms and six extra
+	 * bits take 430 ms.
+	 *
+	 * @param source Input to measure.
+	 * @param bits Number of extra bits, at most 6. Larger values are used as 6.
+	 * @param ref Reference voltage.
+	 * @param repeat Start a new measurement when one is complete, until oversample_stop is called.
+	 */
+	static inline void oversample_start(Source source, uint8_t bits, Ref ref = REF_AVCC, bool repeat = false) { // {{{
+		_os_setup(source, bits, ref, repeat);
+		enable_int();
+		continuous(TRIGGER_FREE);
+	} // }}}
+
+	/// Stop an oversampled measurement.
+	static inline void oversample_stop() { // {{{
+		stop();
+		_isr_mode = _ISR_NONE;
+	} // }}}
+
+	/// Check if a new oversampled result is available.
+	static inline bool oversample_ready() { return _os_ready; }
+
+	/// Return the last oversampled result and mark it as read.
+	static inline uint16_t oversample_read() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		uint16_t ret = _os_result;
+		_os_ready = false;
+		SREG = sreg;
+		return ret;
+	} // }}}
+
+#if defined(SLEEP_MODE_ADC) || defined(DOXYGEN)
+	/// Do an oversampled measurement in ADC noise reduction sleep mode.
+	/**
+	 * Every conversion is started by putting the CPU to sleep, which
+	 * removes most digital noise. Other interrupts can wake the CPU; it
+	 * then goes back to sleep until the measurement is complete.
+	 *
+	 * This enables interrupts while it runs.
+	 *
+	 * @param source Input to measure.
+	 * @param bits Number of extra bits, at most 6. Larger values are used as 6.
+	 * @param ref Reference voltage.
+	 * @return Result with 10 + bits bits.
+	 */
+	static inline uint16_t oversample_sleep(Source source, uint8_t bits, Ref ref = REF_AVCC) { // {{{
+		_os_setup(source, bits, ref, false);
+		_os_sleep = true;
+		// Single conversion mode: entering sleep starts a conversion.
+		ADCSRA = _BV(ADEN) | _BV(ADIF) | _BV(ADIE) | _ps;
+		uint8_t sreg = SREG;
+		sei();
+		// If the last conversion completes between the check and
+		// the sleep, the sleep starts one more conversion. The
+		// interrupt is still enabled, so that one wakes the CPU.
+		while (!_os_ready)
+			Sleep::adc_noise_reduction();
+		SREG = sreg;
+		stop();
+		return oversample_read();
+	} // }}}
+#endif
+
+	// }}}
+#endif
+
+#if defined(ADC_WINDOW_CHANNELS) || defined(DOXYGEN)
+	// Window watchdog. {{{
+
+	/// Position of a watched input relative to its window.
+	enum WindowState {
+		/// Below the low limit.
+		WINDOW_BELOW,
+		/// Between the limits.
+		WINDOW_INSIDE,
+		/// Above the high limit.
+		WINDOW_ABOVE,
+		/// No valid conversion yet.
+		WINDOW_UNKNOWN = 0xff
+	};
+
+	/// One entry in the channel list of the window watchdog.
+	struct WindowChannel {
+		/// Input to watch.
+		Source source;
+		/// Reference voltage for this input.
+		Ref ref;
+		/// The input is below the window when it is less than this.
+		uint16_t low;
+		/// The input is above the window when it is more than this.
+		uint16_t high;
+		/// Distance that the input must move back into the window before it is inside again.
+		uint16_t hysteresis;
+	};
+
+/// @cond
+	static_assert(ADC_WINDOW_CHANNELS > 0 && ADC_WINDOW_CHANNELS < 0x80, "ADC_WINDOW_CHANNELS must be between 1 and 127");
+	// Set in a conversion index if its result must be ignored.
+	uint8_t const _WINDOW_DISCARD = 0x80;
+	static WindowChannel const *_window_channels;
+	static uint8_t _window_num;
+	// Pipeline of conversions, as for the scan sequencer.
+	static uint8_t _window_running;
+	static uint8_t _window_queued;
+	static volatile uint8_t _window_state[ADC_WINDOW_CHANNELS];
+
+	static inline void _window_mux(uint8_t entry) { // {{{
+		WindowChannel const &channel = _window_channels[entry & ~_WINDOW_DISCARD];
+		set_source(channel.source, channel.ref);
+	} // }}}
+
+	// Return the conversion that follows entry.
+	static inline uint8_t _window_next(uint8_t entry) { // {{{
+		uint8_t index = entry & ~_WINDOW_DISCARD;
+		if (entry & _WINDOW_DISCARD)
+			return index;
+		uint8_t next = index + 1 < _window_num ? index + 1 : 0;
+		if (_window_channels[next].ref != _window_channels[index].ref)
+			return next | _WINDOW_DISCARD;
+		return next;
+	} // }}}
+
+	static inline void _window_isr(uint16_t value) { // {{{
+		uint8_t done = _window_running;
+		_window_running = _window_queued;
+		_window_queued = _window_next(_window_queued);
+		if (_window_num > 1)
+			_window_mux(_window_queued);
+		if (done & _WINDOW_DISCARD)
+			return;
+		WindowChannel const &channel = _window_channels[done];
+		uint8_t old_state = _window_state[done];
+		uint8_t state;
+		if (old_state == WINDOW_BELOW && value < channel.low + channel.hysteresis)
+			state = WINDOW_BELOW;
+		else if (old_state == WINDOW_ABOVE && value + channel.hysteresis > channel.high)
+			state = WINDOW_ABOVE;
+		else if (value < channel.low)
+			state = WINDOW_BELOW;
+		else if (value > channel.high)
+			state = WINDOW_ABOVE;
+		else
+			state = WINDOW_INSIDE;
+		if (state == old_state)
+			return;
+		_window_state[done] = state;
+		// The first result is only reported if it is outside the window.
+		if (old_state == WINDOW_UNKNOWN && state == WINDOW_INSIDE)
+			return;
+#ifdef CALL_adc_window
+		adc_window(done, state, value);
+#endif
+	} // }}}
+/// @endcond
+
+	/// Start watching a list of inputs.
+	/**
+	 * The inputs are converted in order, repeatedly, in free running mode.
+	 * Every result is compared to the limits of its channel in the
+	 * interrupt handler. When an input leaves its window or returns into
+	 * it, its state changes and, if CALL_adc_window is defined,
+	 * adc_window(channel, state, value) is called from the interrupt.
+	 * When the first result of an input is outside the window, this is
+	 * reported as well.
+	 *
+	 * To avoid repeated calls for a noisy input near a limit, an input that
+	 * is below the window must rise to low + hysteresis before it is
+	 * inside again, and an input that is above the window must fall to
+	 * high - hysteresis.
+	 *
+	 * This does not react within one conversion. With a single channel,
+	 * the delay between a crossing and the callback is up to two
+	 * conversions, because the next conversion has already started when a
+	 * result is checked. With more channels, every channel is checked once
+	 * per pass, so the delay is up to one pass plus one conversion. As for
+	 * scan_start, changing the reference between channels costs an extra
+	 * conversion. The list is not copied; it must stay valid while the
+	 * watchdog is running.
+	 *
+	 * Only Comparator::window() reacts faster than one conversion; use it
+	 * when a single input must be watched with a short reaction time.
+	 *
+	 * @param channels List of channels to watch.
+	 * @param num Number of channels, from 1 to ADC_WINDOW_CHANNELS.
+	 * @return false if num is out of range; nothing is started then.
+	 */
+	static inline bool window_start(WindowChannel const *channels, uint8_t num) { // {{{
+		if (num == 0 || num > ADC_WINDOW_CHANNELS)
+			return false;
+		stop();
+		_window_channels = channels;
+		_window_num = num;
+		for (uint8_t i = 0; i < num; ++i)
+			_window_state[i] = WINDOW_UNKNOWN;
+		// The first channel is queued twice and its first conversion is
+		// discarded, as for scan_start.
+		_window_running = _WINDOW_DISCARD;
+		_window_queued = _WINDOW_DISCARD;
+		_window_mux(0);
+		_isr_mode = _ISR_WINDOW;
+		enable_int();
+		continuous(TRIGGER_FREE);
+		return true;
+	} // }}}
+
+	/// Stop watching.
+	static inline void window_stop() { // {{{
+		stop();
+		_isr_mode = _ISR_NONE;
+	} // }}}
+
+	/// Return the current WindowState of a channel.
+	static inline uint8_t window_state(uint8_t channel) { return _window_state[channel]; }
+
+	// }}}
+#endif
 }
 
+/// @cond
+#if defined(_AVR_ADC_ISR) && !defined(DOXYGEN)
+ISR(ADC_vect) {
+	uint16_t value = Adc::read(false);
+	// Without an active feature (as for single_sleep), the interrupt
+	// only wakes up the CPU.
+	(void)&value;
+	switch (Adc::_isr_mode) {
+#ifdef ADC_SCAN_SIZE
+	case Adc::_ISR_SCAN:
+		Adc::_scan_isr(value);
+		break;
+#endif
+#ifdef ADC_SAMPLE_RATE
+	case Adc::_ISR_SAMPLE:
+		Adc::_sample_isr(value);
+		break;
+#endif
+#ifdef ADC_ENABLE_OVERSAMPLE
+	case Adc::_ISR_OVERSAMPLE:
+		Adc::_os_isr(value);
+		break;
+#endif
+#ifdef ADC_WINDOW_CHANNELS
+	case Adc::_ISR_WINDOW:
+		Adc::_window_isr(value);
+		break;
+#endif
+	default:
+		break;
+	}
+}
+#endif
+/// @endcond
+
 #ifdef AVR_TEST_ADC // {{{
 
 #if AVR_TEST_INDEX == 0
@@ -375,13 +375,13 @@ static inline void packet_buffer_end();
 		return (size); \
 	} /* }}} */ \
 	static inline uint8_t name ## _packets_available() { /* {{{ */ \
-		return (name ## _last_packet - name ## _first_packet + ((num_packets) + 2)) % ((num_packets) + 2) - 2; \
+		return (name ## _last_packet - name ## _first_packet + ((num_packets) + 2)) % ((num_packets) + 2); \
 	} /* }}} */ \
 	static inline uint8_t name ## _packet_length() { /* {{{ For reading. */ \
 		return (name ## _head[(name ## _first_packet + 1) % ((num_packets) + 2)] - name ## _head[name ## _first_packet] + (size)) % (size); \
 	} /* }}} */ \
 	static inline uint8_t name ## _buffer_available() { /* {{{ For writing */ \
-		return (size) - (name ## _head[name ## _first_packet] - name ## _head[(name ## _last_packet + 1) % ((num_packets) + 2)] + (size)) % (size) - 1; \
+		return (size) - (name ## _head[(name ## _last_packet + 1) % ((num_packets) + 2)] - name ## _head[name ## _first_packet] + (size)) % (size) - 1; \
 	} /* }}} */ \
 	static inline uint8_t name ## _read(uint8_t pos = 0) { /* {{{ */ \
 		return name ## _buffer[(name ## _head[name ## _first_packet] + pos) % (size)]; \
@@ -430,7 +430,7 @@ static inline void packet_buffer_end();
 		return ret; \
 	} /* }}} */ \
 	static inline void name ## _partial_pop(uint8_t n) { /* {{{ Done some reading. */ \
-		name ## _head[name ## _first_packet] = (name ## _head[name ## _first_packet] + n) % ((num_packets) + 2); \
+		name ## _head[name ## _first_packet] = (name ## _head[name ## _first_packet] + n) % (size); \
 	} /* }}} */ \
 	static inline void name ## _pop() { /* {{{ Done reading. */ \
 		name ## _first_packet = (name ## _first_packet + 1) % ((num_packets) + 2); \
@@ -3,6 +3,9 @@
 #ifndef _AVR_COMPARATOR_HH
 #define _AVR_COMPARATOR_HH
 
+// Options:
+// COMPARATOR_ENABLE_WINDOW
+
 /** @file
 @author Bas Wijnen <wijnen@debian.org>
 # Analog Comparator
@@ -38,6 +41,25 @@ ISR(TIMER1_CAPT_vect) {
 }
 ```
 
+With COMPARATOR_ENABLE_WINDOW defined, the comparator can be used as a fast
+path for the ADC window watchdog. It compares one ADC input against the bandgap
+and calls adc_window() within a few clock cycles of a crossing.
+```
+#define ADC_WINDOW_CHANNELS 1
+#define CALL_adc_window
+#define COMPARATOR_ENABLE_WINDOW
+#include <amat.hh>
+
+void setup() {
+	Comparator::window(Adc::SRC_A0);
+}
+
+void adc_window(uint8_t channel, uint8_t state, uint16_t value) {
+	// channel is Comparator::WINDOW_CHANNEL and value is 0.
+	Gpio::write(GPIO_MAKE_PIN(PD, 4), state != Adc::WINDOW_ABOVE);
+}
+```
+
 @author Bas Wijnen <wijnen@debian.org>
 */
 
@@ -55,6 +77,15 @@ ISR(TIMER1_CAPT_vect) {
 #define DIDR1 DIDR
 #endif
 
+#ifdef COMPARATOR_ENABLE_WINDOW
+#if !defined(_AVR_ADC_HH) || !defined(ADC_WINDOW_CHANNELS) || !defined(CALL_adc_window)
+#error "COMPARATOR_ENABLE_WINDOW requires ADC_WINDOW_CHANNELS and CALL_adc_window"
+#endif
+#ifdef AVR_TEST_COMPARATOR
+#error "The comparator interrupt is used by the library and can not be used for testing the comparator"
+#endif
+#endif
+
 /// @endcond
 
 #ifdef DOXYGEN
@@ -159,8 +190,52 @@ namespace Comparator {
 
 	/// Clear the interrupt flag.
 	static inline void clear_interrupt() { ACSR |= _BV(ACI); }
+
+#if defined(COMPARATOR_ENABLE_WINDOW) || defined(DOXYGEN)
+	/// Channel number that is passed to adc_window() for comparator events.
+	uint8_t const WINDOW_CHANNEL = 0xff;
+
+	/// Watch a single ADC input with the comparator.
+	/**
+	 * The input is compared to the bandgap voltage, or to AIN0 if
+	 * use_bandgap is false. Every crossing calls adc_window() from the
+	 * interrupt, with WINDOW_CHANNEL as channel, Adc::WINDOW_BELOW or
+	 * Adc::WINDOW_ABOVE as state and 0 as value.
+	 *
+	 * This reacts within a few clock cycles, where Adc::window_start()
+	 * needs up to two conversions or more, but there is
+	 * only one limit and the comparator has no hysteresis; a noisy input
+	 * near the limit can cause many calls. The comparator uses the ADC
+	 * multiplexer, so the ADC is stopped by this function.
+	 *
+	 * This is only available if COMPARATOR_ENABLE_WINDOW is defined; the
+	 * library then defines ISR(ANALOG_COMP_vect).
+	 */
+	static inline void window(Adc::Source source, bool use_bandgap = true) { // {{{
+		Adc::window_stop();
+		bandgap(use_bandgap);
+		enable_adc(source);
+		enable(TOGGLE, !use_bandgap);
+		enable_interrupt();
+	} // }}}
+
+	/// Stop watching the input.
+	static inline void window_stop() { // {{{
+		disable_interrupt();
+		disable();
+	} // }}}
+#endif
 }
 
+/// @cond
+#if defined(COMPARATOR_ENABLE_WINDOW) && !defined(DOXYGEN)
+ISR(ANALOG_COMP_vect) {
+	// The output is high when the reference is above the watched input.
+	adc_window(Comparator::WINDOW_CHANNEL, Comparator::read() ? Adc::WINDOW_BELOW : Adc::WINDOW_ABOVE, 0);
+}
+#endif
+/// @endcond
+
 #ifdef AVR_TEST_COMPARATOR // {{{
 
 #if AVR_TEST_INDEX == 0
@@ -7,6 +7,15 @@
 // SYSTEM_CLOCK1_DIVIDER
 // SYSTEM_CLOCK1_TICKS_PER_UNIT
 // SYSTEM_CLOCK1_TYPE
+// CAPTURE1_SIZE
+// CAPTURE1_ENABLE_DUTY
+// CAPTURE1_ENABLE_NOISE_CANCEL
+// CAPTURE1_DIVIDER
+// PWM1_FREQUENCY
+// PWM1_RESOLUTION
+// PWM1_ENABLE_FAST
+// PWM1_ENABLE_PHASE_CORRECT
+// PWM1_DIVIDER
 
 #ifndef _AVR_COUNTER1_HH
 #define _AVR_COUNTER1_HH
@@ -1415,6 +1424,724 @@ ISR(TIMER5_COMPA_vect) {
 #define _AVR_SYSTEM_CLOCK_HAVE_DEFAULT
 #endif
 
+#endif
+	// }}}
+#endif
+	/// @endcond
+
+	//
+
+	/// @name Input capture 1
+	/// @{
+
+// Input capture measurement engine for counter 1. {{{
+// Features:
+// - record timestamps of edges on ICPn in a ring buffer from the interrupt
+// - extend the 16 bit capture value to 32 bits using the overflow interrupt
+// - period, frequency, high time and duty cycle queries for the main loop
+
+#ifdef DOXYGEN
+/// Number of timestamps that are kept for Counter 1 input capture; defining this enables the capture engine.
+/**
+ * The counter runs in normal mode and is not usable for other purposes while
+ * this is enabled. It can not be combined with a system clock on the same
+ * counter. The maximum value is 127.
+ *
+ * When the buffer is full, the oldest timestamp is overwritten, so the
+ * queries always use the newest data.
+ */
+#define CAPTURE1_SIZE
+/// Capture both edges, so the high time and duty cycle can be computed.
+/**
+ * The edge select is switched in the interrupt handler, which takes about 100
+ * clock cycles, so both the high and the low part of the signal must be
+ * longer than that; at 16 MHz, this means at least about 7 µs each. When the
+ * next edge comes before the edge select was switched, it is missed. That is
+ * counted by capture_lost1(), and the buffer is emptied, so the high time and
+ * duty cycle are never computed from different periods.
+ */
+#define CAPTURE1_ENABLE_DUTY
+/// Enable the noise canceler of the input capture unit. This delays captures by 4 clock cycles.
+#define CAPTURE1_ENABLE_NOISE_CANCEL
+/// Clock prescaler for input capture on counter 1. Must be one of the values in Counter::Source1.
+/**
+ * With the default of 1, timestamps wrap after 2**32 clock cycles, which is
+ * over four minutes at 16 MHz. Signals that are slower than that need a
+ * larger prescaler.
+ */
+#define CAPTURE1_DIVIDER 1
+/// Number of counter ticks per second for input capture on counter 1.
+#define CAPTURE1_TICKS_PER_SECOND (F_CPU / CAPTURE1_DIVIDER)
+
+	/// Return the number of timestamps that are available in the buffer.
+	static inline uint8_t capture_available1();
+
+	/// Remove and return the oldest timestamp from the buffer.
+	/**
+	 * Timestamps are in counter ticks. If no timestamp is available, 0 is
+	 * returned.
+	 */
+	static inline uint32_t capture_pop1();
+
+	/// Remove all timestamps from the buffer.
+	static inline void capture_clear1();
+
+	/// Return and reset the number of timestamps that were overwritten or missed.
+	/**
+	 * This counts timestamps that were overwritten before they were popped,
+	 * and edges that came too fast for the interrupt handler: without
+	 * CAPTURE1_ENABLE_DUTY, an edge that was captured before the handler
+	 * for the previous one was done; with it, an edge that came before the
+	 * edge select was switched. This saturates at 255.
+	 */
+	static inline uint8_t capture_lost1();
+
+	/// Return the current time, in the same units as the timestamps.
+	/**
+	 * This can be used to detect that a signal has stopped, by comparing
+	 * it to the newest timestamp.
+	 */
+	static inline uint32_t capture_now1();
+
+	/// Return the newest timestamp, or 0 if there is none. It is not removed from the buffer.
+	static inline uint32_t capture_last1();
+
+	/// Return the average period of the signal over the last periods periods, in counter ticks.
+	/**
+	 * If not enough edges have been captured, 0 is returned.
+	 *
+	 * Averaging costs no extra time: it is a single subtraction and
+	 * division over the requested range. The number of periods must be
+	 * smaller than CAPTURE1_SIZE (or half that if CAPTURE1_ENABLE_DUTY is
+	 * defined).
+	 */
+	static inline uint32_t capture_period1(uint8_t periods = 1);
+
+	/// Return the average frequency of the signal over the last periods periods, in Hz.
+	/**
+	 * If not enough edges have been captured, 0 is returned. For sub-Hz
+	 * signals, use capture_period1() and CAPTURE1_TICKS_PER_SECOND.
+	 */
+	static inline uint32_t capture_frequency1(uint8_t periods = 1);
+
+	/// Return the length of the last complete high pulse, in counter ticks.
+	/**
+	 * This is only available if CAPTURE1_ENABLE_DUTY is defined. If not
+	 * enough edges have been captured, 0 is returned.
+	 */
+	static inline uint32_t capture_high1();
+
+	/// Return the duty cycle of the last complete period, as a fraction of 65536.
+	/**
+	 * This is only available if CAPTURE1_ENABLE_DUTY is defined. If not
+	 * enough edges have been captured, 0 is returned.
+	 */
+	static inline uint16_t capture_duty1();
+
+#else
+
+/// @cond
+#define _AVR_CAPTURE(N) \
+	static volatile uint32_t capture ## N ## _buffer[CAPTURE ## N ## _SIZE]; \
+	static volatile uint8_t capture ## N ## _head = 0; \
+	static volatile uint8_t capture ## N ## _used = 0; \
+	static volatile uint8_t capture ## N ## _lost_count = 0; \
+	static volatile uint16_t capture ## N ## _ovf = 0; \
+	static volatile bool capture ## N ## _rising = false; \
+	/* Get the k-th newest timestamp. Interrupts must be disabled and k must be smaller than used. */ \
+	static inline uint32_t capture ## N ## _get(uint8_t k) { \
+		uint16_t i = uint16_t(capture ## N ## _head) + CAPTURE ## N ## _SIZE - 1 - k; \
+		if (i >= CAPTURE ## N ## _SIZE) \
+			i -= CAPTURE ## N ## _SIZE; \
+		return capture ## N ## _buffer[i]; \
+	} \
+	/* Difference between the k-th and l-th newest timestamps, or 0 if l is not available. */ \
+	static inline uint32_t capture ## N ## _diff(uint8_t k, uint16_t l) { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint32_t ret = 0; \
+		if (l < capture ## N ## _used) \
+			ret = capture ## N ## _get(k) - capture ## N ## _get(l); \
+		SREG = sreg; \
+		return ret; \
+	} \
+	static inline uint8_t capture_available ## N() { return capture ## N ## _used; } \
+	static inline uint32_t capture_pop ## N() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint32_t ret = 0; \
+		if (capture ## N ## _used > 0) { \
+			--capture ## N ## _used; \
+			ret = capture ## N ## _get(capture ## N ## _used); \
+		} \
+		SREG = sreg; \
+		return ret; \
+	} \
+	static inline void capture_clear ## N() { capture ## N ## _used = 0; } \
+	static inline uint8_t capture_lost ## N() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint8_t ret = capture ## N ## _lost_count; \
+		capture ## N ## _lost_count = 0; \
+		SREG = sreg; \
+		return ret; \
+	} \
+	static inline uint32_t capture_now ## N() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint16_t t = read ## N(); \
+		uint16_t ovf = capture ## N ## _ovf; \
+		if (has_ovf ## N() && t < 0x8000) \
+			++ovf; \
+		SREG = sreg; \
+		return uint32_t(ovf) << 16 | t; \
+	} \
+	static inline uint32_t capture_last ## N() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint32_t ret = capture ## N ## _used > 0 ? capture ## N ## _get(0) : 0; \
+		SREG = sreg; \
+		return ret; \
+	} \
+	static inline uint32_t capture_period ## N(uint8_t periods = 1) { \
+		if (periods == 0) \
+			return 0; \
+		return capture ## N ## _diff(0, uint16_t(periods) << _AVR_CAPTURE ## N ## _DUTY) / periods; \
+	} \
+	static inline uint32_t capture_frequency ## N(uint8_t periods = 1) { \
+		uint32_t period = capture_period ## N(periods); \
+		if (period == 0) \
+			return 0; \
+		return (uint32_t(F_CPU / CAPTURE ## N ## _DIVIDER) + period / 2) / period; \
+	} \
+	_AVR_CAPTURE_DUTY_ ## N
+
+#define _AVR_CAPTURE_DUTY_FUNCTIONS(N) \
+	static inline uint32_t capture_high ## N() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		/* If the newest edge is rising, the last complete pulse ended one edge earlier. */ \
+		uint8_t k = capture ## N ## _rising ? 1 : 0; \
+		uint32_t ret = 0; \
+		if (k + 1 < capture ## N ## _used) \
+			ret = capture ## N ## _get(k) - capture ## N ## _get(k + 1); \
+		SREG = sreg; \
+		return ret; \
+	} \
+	static inline uint16_t capture_duty ## N() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint8_t k = capture ## N ## _rising ? 1 : 0; \
+		uint32_t high = 0; \
+		uint32_t period = 0; \
+		if (k + 2 < capture ## N ## _used) { \
+			high = capture ## N ## _get(k) - capture ## N ## _get(k + 1); \
+			period = capture ## N ## _get(k) - capture ## N ## _get(k + 2); \
+		} \
+		SREG = sreg; \
+		if (period == 0) \
+			return 0; \
+		/* Scale down so the division fits in 32 bits. */ \
+		while (period >= 0x10000) { \
+			period >>= 1; \
+			high >>= 1; \
+		} \
+		uint32_t ret = (high << 16) / period; \
+		return ret > 0xffff ? 0xffff : ret; \
+	}
+
+#define _AVR_CAPTURE_ISRS(N) \
+ISR(TIMER ## N ## _CAPT_vect) { \
+	uint16_t icr = Counter::get_icr ## N(); \
+	uint16_t ovf = Counter::capture ## N ## _ovf; \
+	/* The capture interrupt has priority over the overflow interrupt. If an overflow is pending, it belongs before this capture if the captured value is small. */ \
+	if (Counter::has_ovf ## N() && icr < 0x8000) \
+		++ovf; \
+	if (_AVR_CAPTURE ## N ## _DUTY) { \
+		bool rising = TCCR ## N ## B & _BV(ICES ## N); \
+		TCCR ## N ## B ^= _BV(ICES ## N); \
+		/* Changing the edge may set the flag. */ \
+		TIFR ## N = _BV(ICF ## N); \
+		if (Gpio::read(PIN_ICP ## N) != rising) { \
+			/* The next edge came before the edge select was changed, so it was missed. Wait for this edge again and drop the buffer, so the queries don't mix periods. */ \
+			TCCR ## N ## B ^= _BV(ICES ## N); \
+			TIFR ## N = _BV(ICF ## N); \
+			Counter::capture ## N ## _used = 0; \
+			if (Counter::capture ## N ## _lost_count < 0xff) \
+				++Counter::capture ## N ## _lost_count; \
+			return; \
+		} \
+		Counter::capture ## N ## _rising = rising; \
+	} \
+	uint8_t head = Counter::capture ## N ## _head; \
+	Counter::capture ## N ## _buffer[head] = uint32_t(ovf) << 16 | icr; \
+	if (++head >= CAPTURE ## N ## _SIZE) \
+		head = 0; \
+	Counter::capture ## N ## _head = head; \
+	if (Counter::capture ## N ## _used < CAPTURE ## N ## _SIZE) \
+		++Counter::capture ## N ## _used; \
+	else if (Counter::capture ## N ## _lost_count < 0xff) \
+		++Counter::capture ## N ## _lost_count; \
+	/* If the next edge was already captured, the edges come faster than this handler runs, so they are being lost. */ \
+	if (!_AVR_CAPTURE ## N ## _DUTY && Counter::has_capt ## N() && Counter::capture ## N ## _lost_count < 0xff) \
+		++Counter::capture ## N ## _lost_count; \
+} \
+ISR(TIMER ## N ## _OVF_vect) { \
+	++Counter::capture ## N ## _ovf; \
+}
+
+#define _AVR_CAPTURE_SETUP(N) \
+	Counter::enable ## N(static_cast <Counter::Source ## N>(COUNTER1_DIV_TO_SOURCE(CAPTURE ## N ## _DIVIDER)), Counter::m ## N ## _normal); \
+	Counter::setup_capt ## N(true, _AVR_CAPTURE ## N ## _NOISE_CANCEL); \
+	Counter::clear_ints ## N(); \
+	Counter::enable_ovf ## N(); \
+	Counter::enable_capt ## N();
+/// @endcond
+
+#endif
+
+#if defined(CAPTURE1_SIZE) && !defined(DOXYGEN)
+#if defined(SYSTEM_CLOCK1_ENABLE_CAPT) || defined(SYSTEM_CLOCK1_ENABLE_COMPA)
+#error "Input capture and system clock can not both use counter 1"
+#endif
+/// @cond
+#ifndef CAPTURE1_DIVIDER
+#define CAPTURE1_DIVIDER 1
+#endif
+#define CAPTURE1_TICKS_PER_SECOND (F_CPU / CAPTURE1_DIVIDER)
+#ifdef CAPTURE1_ENABLE_DUTY
+#define _AVR_CAPTURE1_DUTY 1
+#define _AVR_CAPTURE_DUTY_1 _AVR_CAPTURE_DUTY_FUNCTIONS(1)
+#else
+#define _AVR_CAPTURE1_DUTY 0
+#define _AVR_CAPTURE_DUTY_1
+#endif
+#ifdef CAPTURE1_ENABLE_NOISE_CANCEL
+#define _AVR_CAPTURE1_NOISE_CANCEL true
+#else
+#define _AVR_CAPTURE1_NOISE_CANCEL false
+#endif
+#define _AVR_SETUP_COUNTER1 _AVR_CAPTURE_SETUP(1)
+	_AVR_CAPTURE(1)
+	_AVR_CAPTURE_ISRS(1)
+/// @endcond
+#endif
+	// }}}
+
+	/// @}
+
+	/// @cond
+#ifdef TCNT3L
+// Input capture for counter 3. {{{
+#ifdef CAPTURE3_SIZE
+#if defined(SYSTEM_CLOCK3_ENABLE_CAPT) || defined(SYSTEM_CLOCK3_ENABLE_COMPA)
+#error "Input capture and system clock can not both use counter 3"
+#endif
+#ifndef CAPTURE3_DIVIDER
+#define CAPTURE3_DIVIDER 1
+#endif
+#define CAPTURE3_TICKS_PER_SECOND (F_CPU / CAPTURE3_DIVIDER)
+#ifdef CAPTURE3_ENABLE_DUTY
+#define _AVR_CAPTURE3_DUTY 1
+#define _AVR_CAPTURE_DUTY_3 _AVR_CAPTURE_DUTY_FUNCTIONS(3)
+#else
+#define _AVR_CAPTURE3_DUTY 0
+#define _AVR_CAPTURE_DUTY_3
+#endif
+#ifdef CAPTURE3_ENABLE_NOISE_CANCEL
+#define _AVR_CAPTURE3_NOISE_CANCEL true
+#else
+#define _AVR_CAPTURE3_NOISE_CANCEL false
+#endif
+#define _AVR_SETUP_COUNTER3 _AVR_CAPTURE_SETUP(3)
+	_AVR_CAPTURE(3)
+	_AVR_CAPTURE_ISRS(3)
+#endif
+	// }}}
+#endif
+
+#if (defined(TCNT4L) && !defined(TCCR4E))
+// Input capture for counter 4. {{{
+#ifdef CAPTURE4_SIZE
+#if defined(SYSTEM_CLOCK4_ENABLE_CAPT) || defined(SYSTEM_CLOCK4_ENABLE_COMPA)
+#error "Input capture and system clock can not both use counter 4"
+#endif
+#ifndef CAPTURE4_DIVIDER
+#define CAPTURE4_DIVIDER 1
+#endif
+#define CAPTURE4_TICKS_PER_SECOND (F_CPU / CAPTURE4_DIVIDER)
+#ifdef CAPTURE4_ENABLE_DUTY
+#define _AVR_CAPTURE4_DUTY 1
+#define _AVR_CAPTURE_DUTY_4 _AVR_CAPTURE_DUTY_FUNCTIONS(4)
+#else
+#define _AVR_CAPTURE4_DUTY 0
+#define _AVR_CAPTURE_DUTY_4
+#endif
+#ifdef CAPTURE4_ENABLE_NOISE_CANCEL
+#define _AVR_CAPTURE4_NOISE_CANCEL true
+#else
+#define _AVR_CAPTURE4_NOISE_CANCEL false
+#endif
+#define _AVR_SETUP_COUNTER4 _AVR_CAPTURE_SETUP(4)
+	_AVR_CAPTURE(4)
+	_AVR_CAPTURE_ISRS(4)
+#endif
+	// }}}
+#endif
+
+#ifdef TCNT5L
+// Input capture for counter 5. {{{
+#ifdef CAPTURE5_SIZE
+#if defined(SYSTEM_CLOCK5_ENABLE_CAPT) || defined(SYSTEM_CLOCK5_ENABLE_COMPA)
+#error "Input capture and system clock can not both use counter 5"
+#endif
+#ifndef CAPTURE5_DIVIDER
+#define CAPTURE5_DIVIDER 1
+#endif
+#define CAPTURE5_TICKS_PER_SECOND (F_CPU / CAPTURE5_DIVIDER)
+#ifdef CAPTURE5_ENABLE_DUTY
+#define _AVR_CAPTURE5_DUTY 1
+#define _AVR_CAPTURE_DUTY_5 _AVR_CAPTURE_DUTY_FUNCTIONS(5)
+#else
+#define _AVR_CAPTURE5_DUTY 0
+#define _AVR_CAPTURE_DUTY_5
+#endif
+#ifdef CAPTURE5_ENABLE_NOISE_CANCEL
+#define _AVR_CAPTURE5_NOISE_CANCEL true
+#else
+#define _AVR_CAPTURE5_NOISE_CANCEL false
+#endif
+#define _AVR_SETUP_COUNTER5 _AVR_CAPTURE_SETUP(5)
+	_AVR_CAPTURE(5)
+	_AVR_CAPTURE_ISRS(5)
+#endif
+	// }}}
+#endif
+	/// @endcond
+
+	//
+
+	/// @name PWM 1
+	/// @{
+
+// Glitch free PWM service for counter 1. {{{
+// Features:
+// - mode, prescaler and TOP are computed at compile time from frequency and resolution
+// - duty cycle updates are double buffered in hardware, so they never produce runt pulses
+// - all OCnx channels of the counter are supported
+
+#ifdef DOXYGEN
+/// PWM frequency in Hz for Counter 1; defining this enables the PWM service.
+/**
+ * The counter uses ICR1 as TOP, so it can not be combined with input
+ * capture or a system clock on the same counter.
+ *
+ * The prescaler and TOP are chosen at compile time to give the highest
+ * possible resolution. If the requested resolution can be reached in phase
+ * and frequency correct mode, that mode is used, because it generates
+ * symmetric pulses and updates the duty cycle at BOTTOM. Otherwise fast PWM
+ * is used, which doubles the resolution and updates the duty cycle at TOP.
+ *
+ * In both modes the OCR registers are double buffered by the hardware, so
+ * a new duty cycle is only applied at the start of a new period.
+ */
+#define PWM1_FREQUENCY
+/// Minimum PWM resolution in bits for Counter 1. Default: 8, maximum 15.
+/**
+ * A static_assert fails if this resolution can not be reached at the
+ * requested frequency.
+ */
+#define PWM1_RESOLUTION 8
+/// Force fast PWM mode for Counter 1.
+#define PWM1_ENABLE_FAST
+/// Force phase and frequency correct PWM mode for Counter 1.
+#define PWM1_ENABLE_PHASE_CORRECT
+/// Prescaler for PWM on Counter 1: 1, 8, 64, 256 or 1024.
+/**
+ * By default the smallest prescaler for which TOP fits in 16 bits is used,
+ * which gives the highest resolution. Define this to use a larger one, for
+ * example to share the prescaler setting with other code. A static_assert
+ * fails if TOP does not fit in 16 bits with this prescaler.
+ */
+#define PWM1_DIVIDER
+/// The TOP value that was selected for PWM on Counter 1.
+#define PWM1_TOP
+/// The frequency that is actually generated, in Hz.
+#define PWM1_ACTUAL_FREQUENCY
+/// Duty cycle value for 100%: 1 << PWM1_RESOLUTION.
+#define PWM1_MAX
+
+	/// Set duty cycle for channel OC1A.
+	/**
+	 * The range is 0 (always low) through PWM1_MAX (always high). The
+	 * value is scaled to the selected TOP. The new value is used from the
+	 * next period on.
+	 *
+	 * Note that in fast PWM mode a duty cycle of 0 results in a spike of
+	 * one counter tick per period; use pwm_disable1a() to avoid that.
+	 */
+	static inline void pwm_set1a(uint16_t duty);
+
+	/// Set OCR1A directly, range 0 through PWM1_TOP. The new value is used from the next period on.
+	static inline void pwm_set_raw1a(uint16_t value);
+
+	/// Set OC1A to output and connect it to the PWM signal with the given duty cycle.
+	static inline void pwm_enable1a(uint16_t duty = 0);
+
+	/// Disconnect OC1A from the PWM signal; the pin is driven low.
+	static inline void pwm_disable1a();
+
+	/// Set duty cycle for channel OC1B. @sa pwm_set1a()
+	static inline void pwm_set1b(uint16_t duty);
+
+	/// Set OCR1B directly. @sa pwm_set_raw1a()
+	static inline void pwm_set_raw1b(uint16_t value);
+
+	/// Set OC1B to output and connect it to the PWM signal with the given duty cycle.
+	static inline void pwm_enable1b(uint16_t duty = 0);
+
+	/// Disconnect OC1B from the PWM signal; the pin is driven low.
+	static inline void pwm_disable1b();
+
+	/// Set duty cycle for channel OC1C. @sa pwm_set1a()
+	static inline void pwm_set1c(uint16_t duty);
+
+	/// Set OCR1C directly. @sa pwm_set_raw1a()
+	static inline void pwm_set_raw1c(uint16_t value);
+
+	/// Set OC1C to output and connect it to the PWM signal with the given duty cycle.
+	static inline void pwm_enable1c(uint16_t duty = 0);
+
+	/// Disconnect OC1C from the PWM signal; the pin is driven low.
+	static inline void pwm_disable1c();
+
+#else
+
+/// @cond
+#define _AVR_PWM_OCR(N, p, P) \
+	static inline void pwm_set_raw ## N ## p(uint16_t value) { \
+		/* The 16 bit register write uses the shared TEMP register, so it must not be interrupted. */ \
+		uint8_t sreg = SREG; \
+		cli(); \
+		set_ocr ## N ## p(value); \
+		SREG = sreg; \
+	} \
+	static inline void pwm_set ## N ## p(uint16_t duty) { \
+		uint32_t value = (uint32_t(duty) * (PWM ## N ## _TOP + _AVR_PWM ## N ## _FAST)) >> PWM ## N ## _RESOLUTION; \
+		pwm_set_raw ## N ## p(value > PWM ## N ## _TOP ? PWM ## N ## _TOP : value); \
+	} \
+	static inline void pwm_enable ## N ## p(uint16_t duty = 0) { \
+		pwm_set ## N ## p(duty); \
+		Gpio::write(PIN_OC ## N ## P, false); \
+		enable_oc ## N ## p(2); \
+	} \
+	static inline void pwm_disable ## N ## p() { \
+		disable_oc ## N ## p(); \
+	}
+
+#define _AVR_PWM(N) \
+	static_assert(PWM ## N ## _RESOLUTION <= 15, "PWM resolution must be at most 15 bits"); \
+	static_assert(_AVR_PWM ## N ## _TICKS / 1024 < 0x10000, "PWM frequency is too low"); \
+	static_assert(PWM ## N ## _DIVIDER == 1 || PWM ## N ## _DIVIDER == 8 || PWM ## N ## _DIVIDER == 64 || PWM ## N ## _DIVIDER == 256 || PWM ## N ## _DIVIDER == 1024, "PWM divider must be 1, 8, 64, 256 or 1024"); \
+	static_assert(_AVR_PWM ## N ## _TICKS / PWM ## N ## _DIVIDER <= 0xffffUL + _AVR_PWM ## N ## _FAST, "PWM divider is too small for this frequency"); \
+	static_assert(PWM ## N ## _TOP + _AVR_PWM ## N ## _FAST >= (1UL << PWM ## N ## _RESOLUTION), "PWM resolution can not be reached at this frequency"); \
+	_AVR_PWM ## N ## _A \
+	_AVR_PWM ## N ## _B \
+	_AVR_PWM ## N ## _C
+
+// Clock ticks per period at prescaler 1.
+#define _AVR_PWM_TICKS(N) (uint32_t(F_CPU) / (uint32_t(PWM ## N ## _FREQUENCY) * (_AVR_PWM ## N ## _FAST ? 1 : 2)))
+// Smallest prescaler that makes TOP fit in 16 bits.
+#define _AVR_PWM_DIVIDER(N) ( \
+	_AVR_PWM ## N ## _TICKS < 0x10000 ? 1 : \
+	_AVR_PWM ## N ## _TICKS / 8 < 0x10000 ? 8 : \
+	_AVR_PWM ## N ## _TICKS / 64 < 0x10000 ? 64 : \
+	_AVR_PWM ## N ## _TICKS / 256 < 0x10000 ? 256 : \
+	1024)
+#define _AVR_PWM_TOP(N) (_AVR_PWM ## N ## _TICKS / PWM ## N ## _DIVIDER - _AVR_PWM ## N ## _FAST)
+#define _AVR_PWM_ACTUAL_FREQUENCY(N) (uint32_t(F_CPU) / (uint32_t(PWM ## N ## _DIVIDER) * (_AVR_PWM ## N ## _FAST ? PWM ## N ## _TOP + 1 : 2 * PWM ## N ## _TOP)))
+
+#define _AVR_PWM_SETUP(N) \
+	Counter::set_icr ## N(PWM ## N ## _TOP); \
+	Counter::enable ## N(static_cast <Counter::Source ## N>(COUNTER1_DIV_TO_SOURCE(PWM ## N ## _DIVIDER)), _AVR_PWM ## N ## _FAST ? Counter::m ## N ## _pwm_fast_icr : Counter::m ## N ## _pwm_pfc_icr);
+/// @endcond
+
+#endif
+
+#if defined(PWM1_FREQUENCY) && !defined(DOXYGEN)
+#if defined(SYSTEM_CLOCK1_ENABLE_CAPT) || defined(SYSTEM_CLOCK1_ENABLE_COMPA) || defined(CAPTURE1_SIZE)
+#error "PWM can not be combined with input capture or a system clock on counter 1"
+#endif
+/// @cond
+#ifndef PWM1_RESOLUTION
+#define PWM1_RESOLUTION 8
+#endif
+#define PWM1_MAX (1UL << PWM1_RESOLUTION)
+#if defined(PWM1_ENABLE_FAST)
+#define _AVR_PWM1_FAST 1
+#elif defined(PWM1_ENABLE_PHASE_CORRECT)
+#define _AVR_PWM1_FAST 0
+#else
+#define _AVR_PWM1_FAST (uint32_t(F_CPU) / 2 / uint32_t(PWM1_FREQUENCY) >= PWM1_MAX ? 0 : 1)
+#endif
+#define _AVR_PWM1_TICKS _AVR_PWM_TICKS(1)
+#ifndef PWM1_DIVIDER
+#define PWM1_DIVIDER _AVR_PWM_DIVIDER(1)
+#endif
+#define PWM1_TOP _AVR_PWM_TOP(1)
+#define PWM1_ACTUAL_FREQUENCY _AVR_PWM_ACTUAL_FREQUENCY(1)
+#if defined(OCR1AL) && defined(PIN_OC1A)
+#define _AVR_PWM1_A _AVR_PWM_OCR(1, a, A)
+#else
+#define _AVR_PWM1_A
+#endif
+#if defined(OCR1BL) && defined(PIN_OC1B)
+#define _AVR_PWM1_B _AVR_PWM_OCR(1, b, B)
+#else
+#define _AVR_PWM1_B
+#endif
+#if defined(OCR1CL) && defined(PIN_OC1C)
+#define _AVR_PWM1_C _AVR_PWM_OCR(1, c, C)
+#else
+#define _AVR_PWM1_C
+#endif
+#define _AVR_SETUP_COUNTER1 _AVR_PWM_SETUP(1)
+	_AVR_PWM(1)
+/// @endcond
+#endif
+	// }}}
+
+	/// @}
+
+	/// @cond
+#ifdef TCNT3L
+// PWM for counter 3. {{{
+#if defined(PWM3_FREQUENCY)
+#if defined(SYSTEM_CLOCK3_ENABLE_CAPT) || defined(SYSTEM_CLOCK3_ENABLE_COMPA) || defined(CAPTURE3_SIZE)
+#error "PWM can not be combined with input capture or a system clock on counter 3"
+#endif
+#ifndef PWM3_RESOLUTION
+#define PWM3_RESOLUTION 8
+#endif
+#define PWM3_MAX (1UL << PWM3_RESOLUTION)
+#if defined(PWM3_ENABLE_FAST)
+#define _AVR_PWM3_FAST 1
+#elif defined(PWM3_ENABLE_PHASE_CORRECT)
+#define _AVR_PWM3_FAST 0
+#else
+#define _AVR_PWM3_FAST (uint32_t(F_CPU) / 2 / uint32_t(PWM3_FREQUENCY) >= PWM3_MAX ? 0 : 1)
+#endif
+#define _AVR_PWM3_TICKS _AVR_PWM_TICKS(3)
+#ifndef PWM3_DIVIDER
+#define PWM3_DIVIDER _AVR_PWM_DIVIDER(3)
+#endif
+#define PWM3_TOP _AVR_PWM_TOP(3)
+#define PWM3_ACTUAL_FREQUENCY _AVR_PWM_ACTUAL_FREQUENCY(3)
+#if defined(OCR3AL) && defined(PIN_OC3A)
+#define _AVR_PWM3_A _AVR_PWM_OCR(3, a, A)
+#else
+#define _AVR_PWM3_A
+#endif
+#if defined(OCR3BL) && defined(PIN_OC3B)
+#define _AVR_PWM3_B _AVR_PWM_OCR(3, b, B)
+#else
+#define _AVR_PWM3_B
+#endif
+#if defined(OCR3CL) && defined(PIN_OC3C)
+#define _AVR_PWM3_C _AVR_PWM_OCR(3, c, C)
+#else
+#define _AVR_PWM3_C
+#endif
+#define _AVR_SETUP_COUNTER3 _AVR_PWM_SETUP(3)
+	_AVR_PWM(3)
+#endif
+	// }}}
+#endif
+
+#if (defined(TCNT4L) && !defined(TCCR4E))
+// PWM for counter 4. {{{
+#if defined(PWM4_FREQUENCY)
+#if defined(SYSTEM_CLOCK4_ENABLE_CAPT) || defined(SYSTEM_CLOCK4_ENABLE_COMPA) || defined(CAPTURE4_SIZE)
+#error "PWM can not be combined with input capture or a system clock on counter 4"
+#endif
+#ifndef PWM4_RESOLUTION
+#define PWM4_RESOLUTION 8
+#endif
+#define PWM4_MAX (1UL << PWM4_RESOLUTION)
+#if defined(PWM4_ENABLE_FAST)
+#define _AVR_PWM4_FAST 1
+#elif defined(PWM4_ENABLE_PHASE_CORRECT)
+#define _AVR_PWM4_FAST 0
+#else
+#define _AVR_PWM4_FAST (uint32_t(F_CPU) / 2 / uint32_t(PWM4_FREQUENCY) >= PWM4_MAX ? 0 : 1)
+#endif
+#define _AVR_PWM4_TICKS _AVR_PWM_TICKS(4)
+#ifndef PWM4_DIVIDER
+#define PWM4_DIVIDER _AVR_PWM_DIVIDER(4)
+#endif
+#define PWM4_TOP _AVR_PWM_TOP(4)
+#define PWM4_ACTUAL_FREQUENCY _AVR_PWM_ACTUAL_FREQUENCY(4)
+#if defined(OCR4AL) && defined(PIN_OC4A)
+#define _AVR_PWM4_A _AVR_PWM_OCR(4, a, A)
+#else
+#define _AVR_PWM4_A
+#endif
+#if defined(OCR4BL) && defined(PIN_OC4B)
+#define _AVR_PWM4_B _AVR_PWM_OCR(4, b, B)
+#else
+#define _AVR_PWM4_B
+#endif
+#if defined(OCR4CL) && defined(PIN_OC4C)
+#define _AVR_PWM4_C _AVR_PWM_OCR(4, c, C)
+#else
+#define _AVR_PWM4_C
+#endif
+#define _AVR_SETUP_COUNTER4 _AVR_PWM_SETUP(4)
+	_AVR_PWM(4)
+#endif
+	// }}}
+#endif
+
+#ifdef TCNT5L
+// PWM for counter 5. {{{
+#if defined(PWM5_FREQUENCY)
+#if defined(SYSTEM_CLOCK5_ENABLE_CAPT) || defined(SYSTEM_CLOCK5_ENABLE_COMPA) || defined(CAPTURE5_SIZE)
+#error "PWM can not be combined with input capture or a system clock on counter 5"
+#endif
+#ifndef PWM5_RESOLUTION
+#define PWM5_RESOLUTION 8
+#endif
+#define PWM5_MAX (1UL << PWM5_RESOLUTION)
+#if defined(PWM5_ENABLE_FAST)
+#define _AVR_PWM5_FAST 1
+#elif defined(PWM5_ENABLE_PHASE_CORRECT)
+#define _AVR_PWM5_FAST 0
+#else
+#define _AVR_PWM5_FAST (uint32_t(F_CPU) / 2 / uint32_t(PWM5_FREQUENCY) >= PWM5_MAX ? 0 : 1)
+#endif
+#define _AVR_PWM5_TICKS _AVR_PWM_TICKS(5)
+#ifndef PWM5_DIVIDER
+#define PWM5_DIVIDER _AVR_PWM_DIVIDER(5)
+#endif
+#define PWM5_TOP _AVR_PWM_TOP(5)
+#define PWM5_ACTUAL_FREQUENCY _AVR_PWM_ACTUAL_FREQUENCY(5)
+#if defined(OCR5AL) && defined(PIN_OC5A)
+#define _AVR_PWM5_A _AVR_PWM_OCR(5, a, A)
+#else
+#define _AVR_PWM5_A
+#endif
+#if defined(OCR5BL) && defined(PIN_OC5B)
+#define _AVR_PWM5_B _AVR_PWM_OCR(5, b, B)
+#else
+#define _AVR_PWM5_B
+#endif
+#if defined(OCR5CL) && defined(PIN_OC5C)
+#define _AVR_PWM5_C _AVR_PWM_OCR(5, c, C)
+#else
+#define _AVR_PWM5_C
+#endif
+#define _AVR_SETUP_COUNTER5 _AVR_PWM_SETUP(5)
+	_AVR_PWM(5)
 #endif
 	// }}}
 #endif
@@ -2,6 +2,12 @@
 
 // Options:
 // EEPROM_BUFFER_SIZE
+// EEPROM_BUFFER_PACKETS
+// EEPROM_BUFFER_UPDATE
+// EEPROM_READ_SIZE
+// EEPROM_KV_SIZE
+// EEPROM_KV_START
+// EEPROM_KV_KEYS
 
 #ifndef _AVR_EEPROM_HH
 #define _AVR_EEPROM_HH
@@ -29,6 +35,23 @@ void setup() {
 }
 ```
 
+Example of using the key/value store for a value that changes often
+```
+#define EEPROM_KV_SIZE 256
+
+#include <amat.hh>
+
+static uint16_t boots;
+
+void setup() {
+	// The store has been scanned before setup() is called.
+	if (Eeprom::kv_read(0, &boots, sizeof(boots)) != sizeof(boots))
+		boots = 0;
+	++boots;
+	Eeprom::kv_write(0, &boots, sizeof(boots));
+}
+```
+
 @author Bas Wijnen <wijnen@debian.org>
 */
 
@@ -60,17 +83,52 @@ namespace Eeprom {
  * More packets can be queued while the packet is being written.
  */
 #define EEPROM_BUFFER_SIZE
+
+/// Define this to write the packets with update() instead of write().
+/**
+ * This is defined automatically when EEPROM_KV_SIZE is defined.
+ */
+#define EEPROM_BUFFER_UPDATE
+
+/// Size of the stream buffer for stream_start(); defining this enables streaming reads.
+/**
+ * It must be at most 255.
+ */
+#define EEPROM_READ_SIZE
+
+/// Define this to use a region of this many bytes as a key/value store.
+/**
+ * The region is split in two halves. New values are appended to a log in
+ * the active half, with a checksum, so writing a value often spreads the
+ * writes over the half. When it is full, the current values are copied to
+ * the other half, which then becomes active. All writes go through the
+ * packet buffer; if EEPROM_BUFFER_SIZE is not defined, it defaults to 32.
+ *
+ * The log is scanned at boot, to find the current value of every key. A
+ * record that was not completely written when power was lost is ignored, and
+ * so is a half that was not completely copied.
+ */
+#define EEPROM_KV_SIZE
+
+/// First address of the key/value store. Defaults to 0.
+#define EEPROM_KV_START
+
+/// Number of keys in the key/value store. Defaults to 16. Keys are 0 to EEPROM_KV_KEYS - 1.
+#define EEPROM_KV_KEYS
 #endif
 
-	/// Write a byte of data into EEPROM.
-	/**
-	 * This function busy waits for the EEPROM to be ready.
-	 *
-	 * To avoid a delay, it should be called from the interrupt.
-	 */
-	static inline void write(EEPROM_ADDR_TYPE addr, uint8_t data) { // {{{
-		uint8_t sreg = SREG;
-		cli();
+#ifdef EEPROM_KV_SIZE
+#ifndef EEPROM_BUFFER_SIZE
+#define EEPROM_BUFFER_SIZE 32
+#endif
+#ifndef EEPROM_BUFFER_UPDATE
+#define EEPROM_BUFFER_UPDATE
+#endif
+#endif
+
+	/// @cond
+	// Wait until the EEPROM can be used and set the address. Interrupts must be disabled.
+	static inline void _prepare(EEPROM_ADDR_TYPE addr) { // {{{
 		while (EECR & _BV(EEPE)) {}
 #ifdef SELFPRGEN
 		while (SPMCSR & _BV(SELFPRGEN)) {}
@@ -81,16 +139,40 @@ namespace Eeprom {
 #else
 		EEAR = addr;
 #endif
-		EEDR = data;
-		uint8_t eecr0 = EECR & _BV(EERIE); // Clear EEPM[01], EEMPE, EEPE, EERE
+	} // }}}
+
+	// Start programming EEDR into the prepared address. Mode is the value for the EEPM bits.
+	static inline void _program(uint8_t mode) { // {{{
+		uint8_t eecr0 = (EECR & _BV(EERIE)) | mode; // Clear EEMPE, EEPE, EERE
+#ifdef AVR_HOST_TEST
+		// The host tests simulate the EEPROM through EECR; the timing does not matter there.
+		EECR = eecr0 | _BV(EEMPE);
+		EECR = eecr0 | _BV(EEMPE) | _BV(EEPE);
+#else
 		asm volatile (
 			"out %[eecr], %[eempe]\n"
 			"out %[eecr], %[eepe]"
 			:: \
-				[eecr] "" (_SFR_IO_ADDR(EECR)),
+				[eecr] "I" (_SFR_IO_ADDR(EECR)),
 				[eempe] "r" (eecr0 | _BV(EEMPE)),
 				[eepe] "r" (eecr0 | _BV(EEMPE) | _BV(EEPE))
 		);
+#endif
+	} // }}}
+	/// @endcond
+
+	/// Write a byte of data into EEPROM.
+	/**
+	 * This function busy waits for the EEPROM to be ready.
+	 *
+	 * To avoid a delay, it should be called from the interrupt.
+	 */
+	static inline void write(EEPROM_ADDR_TYPE addr, uint8_t data) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_prepare(addr);
+		EEDR = data;
+		_program(0);
 		SREG = sreg;
 	} // }}}
 
@@ -114,26 +196,152 @@ namespace Eeprom {
 	static inline uint8_t read(EEPROM_ADDR_TYPE addr) { // {{{
 		uint8_t sreg = SREG;
 		cli();
-		while (EECR & _BV(EEPE)) {}
+		_prepare(addr);
+		EECR |= _BV(EERE);
+		uint8_t data = EEDR;
+		SREG = sreg;
+		return data;
+	} // }}}
+
+	/// Write a byte of data into EEPROM, if it is different.
+	/**
+	 * Like write(), but the byte is read first. Nothing is written if it
+	 * already holds the data. If possible, only half of the atomic
+	 * programming operation is done: an erase if data is 0xff, or a write
+	 * if no bits need to change from 0 to 1. Each takes half the time,
+	 * and causes less wear.
+	 *
+	 * Returns true if programming was started.
+	 */
+	static inline bool update(EEPROM_ADDR_TYPE addr, uint8_t data) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_prepare(addr);
+		EECR |= _BV(EERE);
+		uint8_t old = EEDR;
+		if (old == data) {
+			SREG = sreg;
+			return false;
+		}
+		EEDR = data;
+#ifdef EEPM0
+		if (data == 0xff)
+			_program(_BV(EEPM0));	// Erase only.
+		else if ((old & data) == data)
+			_program(_BV(EEPM1));	// Write only.
+		else
+			_program(0);
+#else
+		_program(0);
+#endif
+		SREG = sreg;
+		return true;
+	} // }}}
+
+	/// Read len bytes from the EEPROM into data.
+	/**
+	 * Like read(), but it does not keep interrupts disabled while it
+	 * waits. Interrupts are only disabled for a few cycles while each byte
+	 * is read. If a write is started from an interrupt during the block,
+	 * such as by the write queue, the next byte waits for it to finish
+	 * with interrupts enabled.
+	 */
+	static inline void read_block(EEPROM_ADDR_TYPE addr, uint8_t *data, uint16_t len) { // {{{
 #ifdef SELFPRGEN
 		while (SPMCSR & _BV(SELFPRGEN)) {}
 #endif
+		for (uint16_t i = 0; i < len; ++i, ++addr) {
+			uint8_t sreg;
+			while (true) {
+				while (EECR & _BV(EEPE)) {}
+				sreg = SREG;
+				cli();
+				// An interrupt may have started a write before cli().
+				if (!(EECR & _BV(EEPE)))
+					break;
+				SREG = sreg;
+			}
 #ifdef EEARH
-		EEARH = addr >> 8;
-		EEARL = addr & 0xff;
+			EEARH = addr >> 8;
+			EEARL = addr & 0xff;
 #else
-		EEAR = addr;
+			EEAR = addr;
 #endif
-		EECR |= _BV(EERE);
-		uint8_t data = EEDR;
-		SREG = sreg;
-		return data;
+			EECR |= _BV(EERE);
+			data[i] = EEDR;
+			SREG = sreg;
+		}
 	} // }}}
 
+#if defined(EEPROM_READ_SIZE) || defined(DOXYGEN)
+	// Streaming read. {{{
+
+	/// @cond
+	static_assert(EEPROM_READ_SIZE > 1 && EEPROM_READ_SIZE < 0x100, "EEPROM_READ_SIZE must be between 2 and 255");
+	static EEPROM_ADDR_TYPE _stream_addr;
+	static uint16_t _stream_left;
+	static inline void stream_poll();
+	/// @endcond
+
+	/// Buffer that is filled by stream_poll().
+	STREAM_BUFFER_WITH_CBS(read_buffer, EEPROM_READ_SIZE, _AVR_NOP, stream_poll();)
+
+	/// Return the number of bytes that have not been read from the EEPROM yet.
+	static inline uint16_t stream_remaining() { return _stream_left; }
+
+	/// Read as much data as fits in the free part of read_buffer.
+	/**
+	 * This is called when data is popped from read_buffer, so it only
+	 * needs to be called by user code to retry after a failed write to
+	 * the buffer. Every call reads one contiguous block, so when the free
+	 * space wraps around the end of the buffer, the rest is read by the
+	 * next call.
+	 */
+	static inline void stream_poll() { // {{{
+		if (_stream_left == 0)
+			return;
+		uint8_t tail = read_buffer_tail;
+		uint8_t len = read_buffer_buffer_available();
+		if (len > EEPROM_READ_SIZE - tail)
+			len = EEPROM_READ_SIZE - tail;
+		if (len > _stream_left)
+			len = _stream_left;
+		if (len == 0)
+			return;
+		read_block(_stream_addr, &read_buffer_buffer[tail], len);
+		read_buffer_tail = (tail + len) % EEPROM_READ_SIZE;
+		_stream_addr += len;
+		_stream_left -= len;
+	} // }}}
+
+	/// Start streaming data from the EEPROM into read_buffer.
+	/**
+	 * The buffer is filled immediately, and refilled whenever user code
+	 * takes data out of it with read_buffer_pop().
+	 */
+	static inline void stream_start(EEPROM_ADDR_TYPE addr, uint16_t len) { // {{{
+		read_buffer_reset();
+		_stream_addr = addr;
+		_stream_left = len;
+		stream_poll();
+		stream_poll();
+	} // }}}
+
+	// }}}
+#endif
+
 #ifdef EEPROM_BUFFER_SIZE
+#ifndef EEPROM_BUFFER_PACKETS
+/// If EEPROM_BUFFER_SIZE is defined, this macro can be defined to set the number of packets in the queue.
+#define EEPROM_BUFFER_PACKETS 6
+#endif
 	/// @cond
 	static bool writing = false;
 	static EEPROM_ADDR_TYPE next_byte;
+	static inline void new_packet();
+	/// @endcond
+	PACKET_BUFFER_WITH_CBS(buffer, EEPROM_BUFFER_SIZE, EEPROM_BUFFER_PACKETS, new_packet();,)
+	/// @cond
 	static inline void buffer_address(EEPROM_ADDR_TYPE addr) {
 		if (buffer_packet_length() > 0)
 			buffer_end();
@@ -152,23 +360,260 @@ namespace Eeprom {
 			enable_int();
 		}
 	}
-	ISR(EE_READY_vect) {
-		write(next_byte++, buffer_read(0));
-		buffer_partial_pop(1);
-		if (buffer_packet_length() > 0)
-			return;
+	static inline void write_next() {
+		while (true) {
+			uint8_t data = buffer_read(0);
+			buffer_partial_pop(1);
+#ifdef EEPROM_BUFFER_UPDATE
+			// Continue with the next byte immediately if this one did not need programming.
+			bool started = update(next_byte++, data);
+#else
+			write(next_byte++, data);
+			bool started = true;
+#endif
+			if (buffer_packet_length() == 0)
+				break;
+			if (started)
+				return;
+		}
 		buffer_pop();
 		writing = false;
 		disable_int();
 		new_packet();
 	}
+	ISR(EE_READY_vect) {
+		write_next();
+	}
+	// Wait for the queue to make progress. With interrupts disabled, do the work of the interrupt handler.
+	static inline void buffer_wait() {
+		if (!(SREG & _BV(SREG_I)) && (EECR & _BV(EERIE)) && !(EECR & _BV(EEPE)))
+			write_next();
+	}
 	/// @endcond
 
-#ifndef EEPROM_BUFFER_PACKETS
-/// If EEPROM_BUFFER_SIZE is defined, this macro can be defined to set the number of packets in the queue.
-#define EEPROM_BUFFER_PACKETS 6
+	/// Wait until all queued packets have been written.
+	/**
+	 * If interrupts are disabled, the packets are written from this
+	 * function. It returns when programming of the last byte is done.
+	 */
+	static inline void buffer_flush() { // {{{
+		while (writing || buffer_packets_available() > 0)
+			buffer_wait();
+		while (EECR & _BV(EEPE)) {}
+	} // }}}
+#endif
+
+#ifdef EEPROM_KV_SIZE
+#ifndef EEPROM_KV_START
+#define EEPROM_KV_START 0
+#endif
+#ifndef EEPROM_KV_KEYS
+#define EEPROM_KV_KEYS 16
 #endif
-	PACKET_BUFFER_WITH_CBS(buffer, EEPROM_BUFFER_SIZE, EEPROM_BUFFER_PACKETS,new_packet,)
+	static_assert(EEPROM_KV_SIZE >= 16 && EEPROM_KV_SIZE % 2 == 0, "EEPROM_KV_SIZE must be even and at least 16");
+	static_assert(EEPROM_KV_START + EEPROM_KV_SIZE <= E2END + 1, "EEPROM_KV_START + EEPROM_KV_SIZE is larger than the EEPROM");
+	static_assert(EEPROM_KV_KEYS < 0xff, "EEPROM_KV_KEYS must be less than 255");
+
+	/// @cond
+	// Each half starts with a sequence number and its complement; the
+	// half with the highest valid sequence number is active. It is
+	// followed by records of key, length, value and a CRC-8 over all of
+	// those. An unwritten key (0xff) ends the log.
+#define _AVR_EEPROM_KV_HALF (EEPROM_KV_SIZE / 2)
+	static EEPROM_ADDR_TYPE _kv_index[EEPROM_KV_KEYS];	// Record address for every key, or 0.
+	static EEPROM_ADDR_TYPE _kv_base;
+	static EEPROM_ADDR_TYPE _kv_end;
+	static EEPROM_ADDR_TYPE _kv_put_addr;
+	static uint8_t _kv_seq;
+
+	static inline uint8_t _kv_crc(uint8_t crc, uint8_t data) { // {{{
+		crc ^= data;
+		for (uint8_t i = 0; i < 8; ++i)
+			crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+		return crc;
+	} // }}}
+
+	// The CRC is written last, so a record that was cut off has 0xff there; never use that value.
+	static inline uint8_t _kv_crc_final(uint8_t crc) { return crc == 0xff ? 0 : crc; }
+
+	static inline bool _kv_valid(EEPROM_ADDR_TYPE base) { // {{{
+		uint8_t seq = read(base);
+		return seq != 0xff && (seq ^ read(base + 1)) == 0xff;
+	} // }}}
+
+	// Queue a write of one byte to _kv_put_addr, waiting for room if needed.
+	static inline void _kv_put(uint8_t data) { // {{{
+		if (buffer_buffer_available() == 0) {
+			buffer_end();
+			while (buffer_buffer_available() < 3 || buffer_packets_available() >= EEPROM_BUFFER_PACKETS)
+				buffer_wait();
+			buffer_write(_kv_put_addr & 0xff);
+			buffer_write((_kv_put_addr >> 8) & 0xff);
+		}
+		buffer_write(data);
+		++_kv_put_addr;
+	} // }}}
+
+	static inline void _kv_begin(EEPROM_ADDR_TYPE addr) { // {{{
+		while (buffer_buffer_available() < 3 || buffer_packets_available() >= EEPROM_BUFFER_PACKETS)
+			buffer_wait();
+		_kv_put_addr = addr;
+		buffer_write(addr & 0xff);
+		buffer_write((addr >> 8) & 0xff);
+	} // }}}
+
+	// Set all bytes of a half to 0xff, starting with the header.
+	static inline void _kv_erase(EEPROM_ADDR_TYPE base) { // {{{
+		bool queued = false;
+		for (EEPROM_ADDR_TYPE addr = base; addr < base + _AVR_EEPROM_KV_HALF; ++addr) {
+			if (read(addr) == 0xff) {
+				if (queued)
+					buffer_end();
+				queued = false;
+				continue;
+			}
+			if (!queued)
+				_kv_begin(addr);
+			queued = true;
+			_kv_put(0xff);
+		}
+		if (queued)
+			buffer_end();
+	} // }}}
+
+	// Copy all current records to the other half and make it active.
+	static inline void _kv_compact() { // {{{
+		buffer_flush();
+		EEPROM_ADDR_TYPE other = _kv_base == EEPROM_KV_START ? EEPROM_KV_START + _AVR_EEPROM_KV_HALF : EEPROM_KV_START;
+		_kv_erase(other);
+		buffer_flush();
+		_kv_begin(other + 2);
+		for (uint8_t key = 0; key < EEPROM_KV_KEYS; ++key) {
+			EEPROM_ADDR_TYPE src = _kv_index[key];
+			if (src == 0)
+				continue;
+			_kv_index[key] = _kv_put_addr;
+			uint8_t len = read(src + 1) + 3;
+			for (uint8_t i = 0; i < len; ++i)
+				_kv_put(read(src + i));
+		}
+		_kv_end = _kv_put_addr;
+		// Write the header last, so the old half stays active until everything is copied.
+		buffer_end();
+		_kv_begin(other);
+		++_kv_seq;
+		if (_kv_seq == 0xff)
+			_kv_seq = 0;
+		_kv_put(_kv_seq);
+		_kv_put(~_kv_seq);
+		buffer_end();
+		_kv_base = other;
+	} // }}}
+	/// @endcond
+
+	/// Find the current values in the key/value store.
+	/**
+	 * This is called automatically before setup(). If the store does not
+	 * hold valid data, it is erased.
+	 */
+	static inline void kv_init() { // {{{
+		EEPROM_ADDR_TYPE const second = EEPROM_KV_START + _AVR_EEPROM_KV_HALF;
+		bool valid0 = _kv_valid(EEPROM_KV_START);
+		bool valid1 = _kv_valid(second);
+		for (uint8_t key = 0; key < EEPROM_KV_KEYS; ++key)
+			_kv_index[key] = 0;
+		if (!valid0 && !valid1) {
+			// Nothing stored yet; start with an empty first half.
+			_kv_erase(EEPROM_KV_START);
+			_kv_begin(EEPROM_KV_START);
+			_kv_put(0);
+			_kv_put(0xff);
+			buffer_end();
+			buffer_flush();
+			_kv_base = EEPROM_KV_START;
+			_kv_seq = 0;
+			_kv_end = EEPROM_KV_START + 2;
+			return;
+		}
+		if (valid0 && valid1)
+			_kv_base = int8_t(read(second) - read(EEPROM_KV_START)) > 0 ? second : EEPROM_KV_START;
+		else
+			_kv_base = valid0 ? EEPROM_KV_START : second;
+		_kv_seq = read(_kv_base);
+		EEPROM_ADDR_TYPE addr = _kv_base + 2;
+		EEPROM_ADDR_TYPE const end = _kv_base + _AVR_EEPROM_KV_HALF;
+		while (addr + 3 <= end) {
+			uint8_t key = read(addr);
+			if (key == 0xff)
+				break;
+			uint8_t len = read(addr + 1);
+			if (addr + 3 + len > end) {
+				// Damaged; compact before the next write.
+				addr = end;
+				break;
+			}
+			uint8_t crc = _kv_crc(_kv_crc(0, key), len);
+			for (uint8_t i = 0; i < len; ++i)
+				crc = _kv_crc(crc, read(addr + 2 + i));
+			if (_kv_crc_final(crc) == read(addr + 2 + len) && key < EEPROM_KV_KEYS)
+				_kv_index[key] = len == 0 ? 0 : addr;
+			addr += 3 + len;
+		}
+		_kv_end = addr;
+	} // }}}
+
+	/// Read the value of a key into data; return its length.
+	/**
+	 * At most size bytes are copied. If the key is not in the store, 0 is
+	 * returned. Queued writes are finished first.
+	 */
+	static inline uint8_t kv_read(uint8_t key, void *data, uint8_t size) { // {{{
+		if (key >= EEPROM_KV_KEYS || _kv_index[key] == 0)
+			return 0;
+		buffer_flush();
+		EEPROM_ADDR_TYPE addr = _kv_index[key];
+		uint8_t len = read(addr + 1);
+		read_block(addr + 2, reinterpret_cast <uint8_t *>(data), len < size ? len : size);
+		return len;
+	} // }}}
+
+	/// Store a new value for a key.
+	/**
+	 * The value is queued for writing; it is returned by kv_read()
+	 * immediately. A length of 0 removes the key. If the value does not
+	 * fit even after compacting the store, false is returned.
+	 *
+	 * When the queue is full, this waits for room.
+	 */
+	static inline bool kv_write(uint8_t key, void const *data, uint8_t len) { // {{{
+		if (key >= EEPROM_KV_KEYS || len > _AVR_EEPROM_KV_HALF - 5)
+			return false;
+		if (_kv_end + 3 + len > _kv_base + _AVR_EEPROM_KV_HALF) {
+			_kv_compact();
+			if (_kv_end + 3 + len > _kv_base + _AVR_EEPROM_KV_HALF)
+				return false;
+		}
+		uint8_t const *src = reinterpret_cast <uint8_t const *>(data);
+		_kv_begin(_kv_end);
+		_kv_index[key] = len == 0 ? 0 : _kv_end;
+		uint8_t crc = _kv_crc(_kv_crc(0, key), len);
+		_kv_put(key);
+		_kv_put(len);
+		for (uint8_t i = 0; i < len; ++i) {
+			crc = _kv_crc(crc, src[i]);
+			_kv_put(src[i]);
+		}
+		_kv_put(_kv_crc_final(crc));
+		buffer_end();
+		_kv_end = _kv_put_addr;
+		return true;
+	} // }}}
+
+	/// Remove a key from the store.
+	static inline bool kv_remove(uint8_t key) { return kv_write(key, NULL, 0); }
+
+#define _AVR_SETUP_EEPROM \
+	Eeprom::kv_init();
 #endif
 
 }
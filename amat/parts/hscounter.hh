@@ -1,16 +1,402 @@
 // High Speed Counter
 
+// Options:
+// CALL_hscounter_fault
+
 #ifndef _AVR_HSCOUNTER_HH
 #define _AVR_HSCOUNTER_HH
 
 /** @file
 # High speed counter 4, present in USB-capable devices.
 
+Timer/Counter 4 of the atmega16u4 and atmega32u4 is a 10 bit counter that can
+be clocked from the PLL instead of the system clock. With a 64 MHz counter
+clock, an 8 bit PWM runs at 250 kHz, which is far beyond what the 16 bit
+counters can do at the same resolution.
+
+The counter always counts up to OCR4C (the TOP value, set with set_top) and
+has three compare channels, A, B and D. Every channel drives a pin (OC4x) and
+its inverted version (NOT_OC4x). In complementary mode (output type 1), a dead
+time generator delays the rising edge of both signals, so a half bridge never
+has both switches on at the same time.
+
+Fault protection can switch off all PWM outputs in hardware when the INT0 pin
+or the analog comparator signals a fault. When that happens, the output
+compare pins are disconnected and the pins fall back to their PORT values, so
+the pins should be set to output low with Gpio::write before the outputs are
+enabled.
+
+The PLL is shared with USB. When USB_ENABLE is defined, the PLL is started
+through the USB code, which also stops it when the bus is suspended. After
+the USB system resumes, set_clock must be called again if a clock other than
+clk_pll64 is used.
+
+Example: 250 kHz complementary PWM for a half bridge on OC4A and NOT_OC4A,
+with 125 ns dead time.
+```
+#include <amat.hh>
+
+void setup() {
+	Gpio::write(PIN_OC4A, false);
+	Gpio::write(NOT_PIN_OC4A, false);
+	Hscounter::set_clock(Hscounter::clk_pll64);
+	Hscounter::set_top(255);
+	Hscounter::set_ocr4a(128);
+	Hscounter::set_dead_time(8, 8);
+	Hscounter::enable_fault();
+	Hscounter::enable_oc4a(1);
+	Hscounter::enable(Hscounter::s_div1, Hscounter::m_pwm_fast);
+}
+```
+
 @author Bas Wijnen <wijnen@debian.org>
 */
 
+/// @cond
+#ifdef CALL_hscounter_fault
+static void hscounter_fault();
+#endif
+/// @endcond
+
+/// High speed counter 4.
 namespace Hscounter {
+	// Clock selection. {{{
+
+	/// Counter clock source, before the prescaler.
+	/**
+	 * The PLL runs at 96 MHz and has a postscaler for the counter.
+	 * Clocks faster than 64 MHz are out of specification.
+	 */
+	enum Clock {
+		clk_io = 0,	///< System clock.
+		clk_pll96 = 1,	///< PLL, 96 MHz.
+		clk_pll64 = 2,	///< PLL, 64 MHz.
+		clk_pll48 = 3	///< PLL, 48 MHz.
+	};
+
+/// @cond
+	static inline void enable_pll() { // {{{
+		if (PLLCSR & _BV(PLOCK))
+			return;
+#ifdef USB_ENABLE
+		Usb::enable_PLL();
+#else
+		// Same configuration as for USB, so it can be enabled later.
+		PLLFRQ = (0xa << PDIV0)
+			| (2 << PLLTM0)
+#if F_CPU != 8000000 && F_CPU != 16000000
+			| _BV(PINMUX)
+#endif
+		;
+#if F_CPU == 16000000
+		PLLCSR = _BV(PLLE) | _BV(PINDIV);
+#else
+		PLLCSR = _BV(PLLE);
+#endif
+		while (!(PLLCSR & _BV(PLOCK))) {}
+#endif
+	} // }}}
+/// @endcond
+
+	/// Select the clock source of the counter.
+	/**
+	 * If a PLL clock is selected, the PLL is started if it isn't
+	 * running yet. This waits for the PLL to lock.
+	 *
+	 * The clock should be selected while the counter is disabled.
+	 */
+	static inline void set_clock(Clock clock) { // {{{
+		if (clock != clk_io)
+			enable_pll();
+		PLLFRQ = (PLLFRQ & ~(_BV(PLLTM1) | _BV(PLLTM0))) | (clock << PLLTM0);
+	} // }}}
+
+	// }}}
+
+	// Counter control. {{{
+
+	/// Prescaler setting.
+	enum Source {
+		s_off = 0,	///< Counter is stopped.
+		s_div1,		///< Counter clock.
+		s_div2,		///< Counter clock / 2.
+		s_div4,		///< Counter clock / 4.
+		s_div8,		///< Counter clock / 8.
+		s_div16,	///< Counter clock / 16.
+		s_div32,	///< Counter clock / 32.
+		s_div64,	///< Counter clock / 64.
+		s_div128,	///< Counter clock / 128.
+		s_div256,	///< Counter clock / 256.
+		s_div512,	///< Counter clock / 512.
+		s_div1024,	///< Counter clock / 1024.
+		s_div2048,	///< Counter clock / 2048.
+		s_div4096,	///< Counter clock / 4096.
+		s_div8192,	///< Counter clock / 8192.
+		s_div16384	///< Counter clock / 16384.
+	};
+
+	/// Waveform generation mode.
+	/**
+	 * These modes apply to channels that have PWM enabled (which
+	 * enable_oc4a, enable_oc4b and enable_oc4d do). Other channels use
+	 * normal compare output mode.
+	 */
+	enum Mode {
+		m_pwm_fast = 0,		///< Fast PWM; frequency is clock / (TOP + 1).
+		m_pwm_pfc = 1,		///< Phase and frequency correct PWM; frequency is clock / (2 * TOP).
+		m_pwm6_single = 2,	///< Six output PWM from OCR4A, single slope.
+		m_pwm6_dual = 3		///< Six output PWM from OCR4A, dual slope.
+	};
+
+	/// Set prescaler and waveform generation mode.
+	static inline void enable(Source source, Mode mode) { // {{{
+		// Writing FPF4 as 1 would clear a pending fault.
+		TCCR4D = (TCCR4D & ~(_BV(WGM41) | _BV(WGM40) | _BV(FPF4))) | (mode << WGM40);
+		TCCR4B = (TCCR4B & ~(_BV(CS43) | _BV(CS42) | _BV(CS41) | _BV(CS40))) | (source << CS40);
+	} // }}}
+
+	/// Stop the counter.
+	static inline void disable() { // {{{
+		TCCR4B &= ~(_BV(CS43) | _BV(CS42) | _BV(CS41) | _BV(CS40));
+	} // }}}
+
+	/// Read the 10 bit counter value.
+	static inline uint16_t read() { // {{{
+		// TC4H is shared by all 10 bit registers.
+		uint8_t sreg = SREG;
+		cli();
+		uint8_t l = TCNT4;
+		uint8_t h = TC4H;
+		SREG = sreg;
+		return uint16_t(h) << 8 | l;
+	} // }}}
+
+	/// Write the 10 bit counter value.
+	static inline void write(uint16_t value) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		TC4H = value >> 8;
+		TCNT4 = value & 0xff;
+		SREG = sreg;
+	} // }}}
+
+	/// Return the TOP value (OCR4C).
+	static inline uint16_t get_top() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		uint8_t l = OCR4C;
+		uint8_t h = TC4H;
+		SREG = sreg;
+		return uint16_t(h) << 8 | l;
+	} // }}}
+
+	/// Set the TOP value (OCR4C), at most 0x3ff.
+	static inline void set_top(uint16_t value) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		TC4H = value >> 8;
+		OCR4C = value & 0xff;
+		SREG = sreg;
+	} // }}}
+
+	/// Enable or disable enhanced mode.
+	/**
+	 * In enhanced mode, bit 0 of the compare registers selects a half
+	 * clock cycle, which adds one bit of PWM resolution.
+	 */
+	static inline void set_enhanced(bool enhanced) { // {{{
+		if (enhanced)
+			TCCR4E |= _BV(ENHC4);
+		else
+			TCCR4E &= ~_BV(ENHC4);
+	} // }}}
+
+	/// Hold compare register updates until unlock is called.
+	/**
+	 * Use this to update several channels at the same time.
+	 */
+	static inline void lock() { TCCR4E |= _BV(TLOCK4); }
+
+	/// Apply all compare register updates since lock was called.
+	static inline void unlock() { TCCR4E &= ~_BV(TLOCK4); }
+
+	/// Select the pins that are driven in six output PWM mode.
+	/**
+	 * Bit 0 is NOT_OC4A, bit 1 OC4A, bit 2 NOT_OC4B, bit 3 OC4B,
+	 * bit 4 NOT_OC4D, bit 5 OC4D.
+	 */
+	static inline void set_pwm6_outputs(uint8_t mask) { // {{{
+		TCCR4E = (TCCR4E & (_BV(TLOCK4) | _BV(ENHC4))) | (mask & 0x3f);
+	} // }}}
+
+	/// Enable overflow interrupt.
+	/**
+	 * ISR(TIMER4_OVF_vect) must be defined when using this.
+	 */
+	static inline void enable_ovf() { TIMSK4 |= _BV(TOIE4); }
+
+	/// Disable overflow interrupt.
+	static inline void disable_ovf() { TIMSK4 &= ~_BV(TOIE4); }
+
+	/// Check if the overflow interrupt flag is set.
+	static inline bool has_ovf() { return TIFR4 & _BV(TOV4); }
+
+	/// Clear all interrupt flags.
+	static inline void clear_ints() { TIFR4 = _BV(TOV4) | _BV(OCF4A) | _BV(OCF4B) | _BV(OCF4D); }
+
+	/// Disable power to the counter.
+	static inline void off() { PRR1 |= _BV(PRTIM4); }
+
+	/// Enable power to the counter.
+	static inline void on() { PRR1 &= ~_BV(PRTIM4); }
+
+	// }}}
+
+	// Dead time. {{{
+
+	/// Dead time prescaler.
+	enum DeadTimeSource {
+		dt_div1 = 0,	///< Counter clock, before the counter prescaler.
+		dt_div2,	///< Counter clock / 2.
+		dt_div4,	///< Counter clock / 4.
+		dt_div8		///< Counter clock / 8.
+	};
+
+	/// Set the dead time for complementary outputs.
+	/**
+	 * The rising edge of OC4x is delayed by oc ticks, the rising edge of
+	 * NOT_OC4x by not_oc ticks. Both values are at most 15.
+	 * The dead time applies to all channels in output mode 1.
+	 */
+	static inline void set_dead_time(uint8_t oc, uint8_t not_oc, DeadTimeSource source = dt_div1) { // {{{
+		DT4 = (not_oc << 4) | (oc & 0xf);
+		TCCR4B = (TCCR4B & ~(_BV(DTPS41) | _BV(DTPS40))) | (source << DTPS40);
+	} // }}}
+
+	// }}}
+
+	// Fault protection. {{{
+
+	/// Enable fault protection.
+	/**
+	 * When the fault input is triggered, the hardware disconnects all
+	 * output compare pins. Call clear_fault and enable the outputs again
+	 * to recover.
+	 *
+	 * If CALL_hscounter_fault is defined, hscounter_fault() is called
+	 * from the fault interrupt.
+	 *
+	 * @param use_comparator Use the analog comparator instead of the INT0 pin as fault input.
+	 * @param rising Trigger on a rising edge instead of a falling edge.
+	 * @param noise_cancel Require four equal samples before triggering.
+	 */
+	static inline void enable_fault(bool use_comparator = false, bool rising = false, bool noise_cancel = false) { // {{{
+		TCCR4D = (TCCR4D & (_BV(WGM41) | _BV(WGM40)))
+			| _BV(FPF4) | _BV(FPEN4)
+			| (use_comparator ? _BV(FPAC4) : 0)
+			| (rising ? _BV(FPES4) : 0)
+			| (noise_cancel ? _BV(FPNC4) : 0)
+#ifdef CALL_hscounter_fault
+			| _BV(FPIE4)
+#endif
+		;
+	} // }}}
+
+	/// Disable fault protection.
+	static inline void disable_fault() { // {{{
+		TCCR4D &= _BV(WGM41) | _BV(WGM40);
+	} // }}}
+
+	/// Check if a fault has been detected.
+	static inline bool has_fault() { return TCCR4D & _BV(FPF4); }
+
+	/// Clear the fault flag.
+	/**
+	 * This does not enable the outputs again.
+	 */
+	static inline void clear_fault() { TCCR4D |= _BV(FPF4); }
+
+	// }}}
+
+	// Compare channels. {{{
+#ifdef DOXYGEN
+	/// Enable PWM output for channel A.
+	/**
+	 * Output types in PWM mode:
+	 * - 1: OC4A cleared on compare match, NOT_OC4A is its complement, with dead time.
+	 * - 2: OC4A cleared on compare match, NOT_OC4A disconnected.
+	 * - 3: OC4A set on compare match, NOT_OC4A disconnected.
+	 *
+	 * The pins must be set to output.
+	 */
+	static inline void enable_oc4a(uint8_t type = 2);
+
+	/// Disable output for channel A.
+	static inline void disable_oc4a();
+
+	/// Enable interrupt on compare match for OCR4A.
+	/**
+	 * ISR(TIMER4_COMPA_vect) must be defined when using this.
+	 */
+	static inline void enable_compa();
+
+	/// Disable interrupt on compare match for OCR4A.
+	static inline void disable_compa();
+
+	/// Return the 10 bit OCR4A value.
+	static inline uint16_t get_ocr4a();
+
+	/// Set the 10 bit OCR4A value.
+	static inline void set_ocr4a(uint16_t value);
+
+	/// Check if the compare match flag for OCR4A is set.
+	static inline bool has_ocf4a();
+
+	// Channels B and D have the same functions.
+#else
+/// @cond
+#define _AVR_HSCOUNTER_OC(p, P, CTRL) \
+	static inline void enable_oc4 ## p(uint8_t type = 2) { \
+		CTRL = (CTRL & ~(_BV(COM4 ## P ## 1) | _BV(COM4 ## P ## 0))) | (type << COM4 ## P ## 0) | _BV(PWM4 ## P); \
+	} \
+	static inline void disable_oc4 ## p() { \
+		CTRL &= ~(_BV(COM4 ## P ## 1) | _BV(COM4 ## P ## 0) | _BV(PWM4 ## P)); \
+	} \
+	static inline void enable_comp ## p() { TIMSK4 |= _BV(OCIE4 ## P); } \
+	static inline void disable_comp ## p() { TIMSK4 &= ~_BV(OCIE4 ## P); } \
+	static inline uint16_t get_ocr4 ## p() { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		uint8_t l = OCR4 ## P; \
+		uint8_t h = TC4H; \
+		SREG = sreg; \
+		return uint16_t(h) << 8 | l; \
+	} \
+	static inline void set_ocr4 ## p(uint16_t value) { \
+		uint8_t sreg = SREG; \
+		cli(); \
+		TC4H = value >> 8; \
+		OCR4 ## P = value & 0xff; \
+		SREG = sreg; \
+	} \
+	static inline bool has_ocf4 ## p() { return TIFR4 & _BV(OCF4 ## P); }
+
+	_AVR_HSCOUNTER_OC(a, A, TCCR4A)
+	_AVR_HSCOUNTER_OC(b, B, TCCR4A)
+	_AVR_HSCOUNTER_OC(d, D, TCCR4C)
+#undef _AVR_HSCOUNTER_OC
+/// @endcond
+#endif
+	// }}}
+}
+
+/// @cond
+#ifdef CALL_hscounter_fault
+ISR(TIMER4_FPF_vect) {
+	hscounter_fault();
 }
+#endif
+/// @endcond
 
 #ifdef AVR_TEST_HSCOUNTER // {{{
 
@@ -22,11 +408,260 @@ namespace Hscounter {
 			return false;
 		if (cmd == '?' && len == 0) {
 			Test::tx(testcode);
+			Test::tx('k');
+			Test::tx('e');
+			Test::tx('d');
+			Test::tx('a');
+			Test::tx('b');
+			Test::tx('D');
+			Test::tx('t');
+			Test::tx('x');
+			Test::tx('f');
+			Test::tx('o');
+			Test::tx('O');
+			Test::tx('r');
+			Test::tx('w');
+			Test::tx('F');
+			Test::tx('-');
+			Test::tx('+');
 			Test::tx('\n');
 			return true;
 		}
 		// Commands:
+		//	kX	set clock to X
+		//	eXY	enable with source X in mode Y
+		//	d	disable
+		//	a+T	enable oc4a with type T
+		//	a-	disable oc4a
+		//	a!	enable compa interrupt
+		//	a.	disable compa interrupt
+		//	a=XXXX	set OCR4A register
+		//	ar	get OCR4A register
+		//	b*, D*	the same for channels B and D
+		//	t=XXXX	set TOP
+		//	tr	get TOP
+		//	xABS	set dead time to A for OC4x, B for NOT_OC4x, prescaler S
+		//	f+	enable fault protection on INT0, falling edge
+		//	f-	disable fault protection
+		//	f.	clear fault flag
+		//	fr	get fault flag
+		//	o	enable ovf
+		//	O	disable ovf
+		//	r	read value
+		//	wXXXX	write value
+		//	F	clear interrupt flags
+		//	-	switch off module
+		//	+	switch on module
 		switch (cmd) {
+		case 'k':
+			if (len != 1)
+				return false;
+			set_clock(static_cast <Clock>(Test::read_digit(0) & 3));
+			break;
+		case 'e':
+			if (len != 2)
+				return false;
+			enable(static_cast <Source>(Test::read_digit(0)), static_cast <Mode>(Test::read_digit(1) & 3));
+			break;
+		case 'd':
+			if (len != 0)
+				return false;
+			disable();
+			break;
+		case 'a':
+		case 'b':
+		case 'D':
+			if (len < 1)
+				return false;
+			switch (Test::rx_read(0)) {
+			case '+':
+			{
+				if (len != 2)
+					return false;
+				uint8_t type = Test::read_digit(1);
+				if (cmd == 'a')
+					enable_oc4a(type);
+				else if (cmd == 'b')
+					enable_oc4b(type);
+				else
+					enable_oc4d(type);
+				break;
+			}
+			case '-':
+				if (len != 1)
+					return false;
+				if (cmd == 'a')
+					disable_oc4a();
+				else if (cmd == 'b')
+					disable_oc4b();
+				else
+					disable_oc4d();
+				break;
+			case '!':
+				if (len != 1)
+					return false;
+				if (cmd == 'a')
+					enable_compa();
+				else if (cmd == 'b')
+					enable_compb();
+				else
+					enable_compd();
+				break;
+			case '.':
+				if (len != 1)
+					return false;
+				if (cmd == 'a')
+					disable_compa();
+				else if (cmd == 'b')
+					disable_compb();
+				else
+					disable_compd();
+				break;
+			case '=':
+			{
+				if (len != 5)
+					return false;
+				bool ok = true;
+				uint8_t h = Test::read_byte(1, ok);
+				uint8_t l = Test::read_byte(3, ok);
+				if (!ok)
+					return false;
+				uint16_t hl = (h << 8) | l;
+				if (cmd == 'a')
+					set_ocr4a(hl);
+				else if (cmd == 'b')
+					set_ocr4b(hl);
+				else
+					set_ocr4d(hl);
+				break;
+			}
+			case 'r':
+			{
+				if (len != 1)
+					return false;
+				uint16_t value;
+				if (cmd == 'a')
+					value = get_ocr4a();
+				else if (cmd == 'b')
+					value = get_ocr4b();
+				else
+					value = get_ocr4d();
+				Test::tx(testcode);
+				Test::send_byte(value >> 8);
+				Test::send_byte(value & 0xff);
+				Test::tx('\n');
+				break;
+			}
+			default:
+				return false;
+			}
+			break;
+		case 't':
+			if (len < 1)
+				return false;
+			switch (Test::rx_read(0)) {
+			case '=':
+			{
+				if (len != 5)
+					return false;
+				bool ok = true;
+				uint8_t h = Test::read_byte(1, ok);
+				uint8_t l = Test::read_byte(3, ok);
+				if (!ok)
+					return false;
+				set_top((h << 8) | l);
+				break;
+			}
+			case 'r':
+			{
+				if (len != 1)
+					return false;
+				uint16_t value = get_top();
+				Test::tx(testcode);
+				Test::send_byte(value >> 8);
+				Test::send_byte(value & 0xff);
+				Test::tx('\n');
+				break;
+			}
+			default:
+				return false;
+			}
+			break;
+		case 'x':
+			if (len != 3)
+				return false;
+			set_dead_time(Test::read_digit(0), Test::read_digit(1), static_cast <DeadTimeSource>(Test::read_digit(2) & 3));
+			break;
+		case 'f':
+			if (len != 1)
+				return false;
+			switch (Test::rx_read(0)) {
+			case '+':
+				enable_fault();
+				break;
+			case '-':
+				disable_fault();
+				break;
+			case '.':
+				clear_fault();
+				break;
+			case 'r':
+				Test::tx(testcode);
+				Test::tx(has_fault() ? '1' : '0');
+				Test::tx('\n');
+				break;
+			default:
+				return false;
+			}
+			break;
+		case 'o':
+			if (len != 0)
+				return false;
+			enable_ovf();
+			break;
+		case 'O':
+			if (len != 0)
+				return false;
+			disable_ovf();
+			break;
+		case 'r':
+		{
+			if (len != 0)
+				return false;
+			uint16_t value = read();
+			Test::tx(testcode);
+			Test::send_byte(value >> 8);
+			Test::send_byte(value & 0xff);
+			Test::tx('\n');
+			break;
+		}
+		case 'w':
+		{
+			if (len != 4)
+				return false;
+			bool ok = true;
+			uint8_t h = Test::read_byte(0, ok);
+			uint8_t l = Test::read_byte(2, ok);
+			if (!ok)
+				return false;
+			write((h << 8) | l);
+			break;
+		}
+		case 'F':
+			if (len != 0)
+				return false;
+			clear_ints();
+			break;
+		case '-':
+			if (len != 0)
+				return false;
+			off();
+			break;
+		case '+':
+			if (len != 0)
+				return false;
+			on();
+			break;
 		default:
 			return false;
 		}
@@ -34,6 +669,30 @@ namespace Hscounter {
 	}
 }
 
+ISR(TIMER4_COMPA_vect) {
+	Test::tx(Hscounter::testcode);
+	Test::tx('A');
+	Test::tx('\n');
+}
+
+ISR(TIMER4_COMPB_vect) {
+	Test::tx(Hscounter::testcode);
+	Test::tx('B');
+	Test::tx('\n');
+}
+
+ISR(TIMER4_COMPD_vect) {
+	Test::tx(Hscounter::testcode);
+	Test::tx('D');
+	Test::tx('\n');
+}
+
+ISR(TIMER4_OVF_vect) {
+	Test::tx(Hscounter::testcode);
+	Test::tx('O');
+	Test::tx('\n');
+}
+
 #else
 
 namespace Hscounter {
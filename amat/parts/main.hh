@@ -131,6 +131,18 @@ static void loop();
 #define _AVR_SETUP_USB
 #endif
 
+#ifndef _AVR_SETUP_STEPPER
+#define _AVR_SETUP_STEPPER
+#endif
+
+#ifndef _AVR_SETUP_SOFTPWM
+#define _AVR_SETUP_SOFTPWM
+#endif
+
+#ifndef _AVR_SETUP_EEPROM
+#define _AVR_SETUP_EEPROM
+#endif
+
 // @todo Add more setup from other parts.
 // }}}
 
@@ -154,7 +166,10 @@ static void loop();
 	_AVR_SETUP_USART \
 	_AVR_SETUP_DBG \
 	_AVR_SETUP_USI \
-	_AVR_SETUP_USB
+	_AVR_SETUP_USB \
+	_AVR_SETUP_STEPPER \
+	_AVR_SETUP_SOFTPWM \
+	_AVR_SETUP_EEPROM
 
 /// The main function is defined if NO_main is not defined.
 int main() {
@@ -0,0 +1,445 @@
+// SD card in SPI mode
+
+// Options:
+// SDCARD_CS
+// SDCARD_DIVIDER
+
+#ifndef _AVR_SDCARD_HH
+#define _AVR_SDCARD_HH
+
+/** @file
+# Block device driver for SD and MMC cards in SPI mode
+This supports MMC, SD version 1 and 2 and SDHC/SDXC cards. Blocks are always
+512 bytes; the buffers are provided by user code, so the driver itself uses
+almost no RAM.
+
+The card is initialized at a low clock rate, as the specification requires.
+After that, the bus is switched to SDCARD_DIVIDER. All data is moved with
+Spi::transfer_block(), so it runs at nearly the full bus speed.
+
+For sustained transfers, use the multi-block commands: read_start(),
+read_next() and read_stop(), or write_start(), write_next() and write_stop().
+The card keeps the bus during a multi-block transfer. write_next() does not
+wait for the card to finish programming the block; it waits before sending the
+next one, so user code can prepare the next block while the card is busy.
+
+Example:
+```
+#define SPI_ENABLE_MASTER
+#define SDCARD_CS GPIO_MAKE_PIN(PB, 4)
+#include <amat.hh>
+
+static uint8_t block[512];
+
+void setup() {
+	Spi::enable();
+	if (!Sdcard::init())
+		return;
+	Sdcard::write_start(1000);
+	for (uint16_t i = 0; i < 100; ++i) {
+		// Fill block with data here.
+		Sdcard::write_next(block);
+	}
+	Sdcard::write_stop();
+}
+```
+
+@author Bas Wijnen <wijnen@debian.org>
+*/
+
+#ifdef DOXYGEN
+/// Chip select pin of the card; defining this enables the driver.
+#define SDCARD_CS
+/// Spi clock divider after initialization, as for Spi::enable(). Default: 0 (f_osc / 2).
+#define SDCARD_DIVIDER 0
+#endif
+
+#ifdef SDCARD_CS
+
+#ifndef SPI_ENABLE_MASTER
+#error "The SD card driver requires SPI_ENABLE_MASTER"
+#endif
+#ifdef SPI_TX_SIZE
+#error "The SD card driver can not be used together with SPI_TX_SIZE"
+#endif
+
+#ifndef SDCARD_DIVIDER
+#define SDCARD_DIVIDER 0
+#endif
+
+/// SD card block device
+namespace Sdcard {
+	/// Type of the card.
+	enum Type {
+		/// No card, or initialization failed.
+		TYPE_NONE,
+		/// MultiMediaCard.
+		TYPE_MMC,
+		/// SD card version 1.
+		TYPE_SD1,
+		/// SD card version 2, byte addressed.
+		TYPE_SD2,
+		/// SDHC or SDXC card, block addressed.
+		TYPE_SDHC
+	};
+
+	/// Size of a block in bytes.
+	uint16_t const BLOCK_SIZE = 512;
+
+	/// @cond
+	enum _Command {
+		_CMD_GO_IDLE = 0,
+		_CMD_SEND_OP_COND = 1,
+		_CMD_SEND_IF_COND = 8,
+		_CMD_SEND_CSD = 9,
+		_CMD_STOP = 12,
+		_CMD_SET_BLOCKLEN = 16,
+		_CMD_READ_BLOCK = 17,
+		_CMD_READ_MULTIPLE = 18,
+		_CMD_WRITE_BLOCK = 24,
+		_CMD_WRITE_MULTIPLE = 25,
+		_CMD_APP_SEND_OP_COND = 41,
+		_CMD_APP = 55,
+		_CMD_READ_OCR = 58
+	};
+	// Data tokens.
+	uint8_t const _TOKEN_START = 0xfe;
+	uint8_t const _TOKEN_MULTIPLE = 0xfc;
+	uint8_t const _TOKEN_STOP = 0xfd;
+	// R1 response bits.
+	uint8_t const _R1_IDLE = 0x01;
+	uint8_t const _R1_ILLEGAL = 0x04;
+	// f_osc / 128: at most 400 kHz up to a clock of 51.2 MHz.
+	uint8_t const _SLOW_DIVIDER = 7;
+	// Timeouts in ms. The card may take up to 100 ms to start sending a
+	// block, up to 250 ms (500 ms for SDXC) to program one and up to a
+	// second to initialize.
+	uint16_t const _READ_TIMEOUT = 200;
+	uint16_t const _BUSY_TIMEOUT = 500;
+	uint16_t const _INIT_TIMEOUT = 1000;
+
+	// Mode 0, most significant bit first.
+	static Spi::Device _device = {SDCARD_CS, _SLOW_DIVIDER, true, false, true};
+	static uint8_t _type;
+	// Set while a multi-block read or write is running.
+	static bool _reading;
+	static bool _writing;
+
+	// Number of bytes that take at least ms milliseconds on the bus with
+	// the current divider. SPR1:0 selects f_osc / 4, 16, 64 or 128 and
+	// SPI2X halves that, so dividers 5 and 6 are both f_osc / 64. A byte
+	// takes 8 bus clock cycles, plus some overhead, so this errs on the
+	// long side.
+	static inline uint32_t _polls(uint16_t ms) { // {{{
+		uint8_t spr = _device.freq_divider_log2 >> 1;
+		uint8_t spi2x = ~_device.freq_divider_log2 & 1;
+		uint8_t byte_log2 = (spr == 3 ? 7 : 2 * spr + 2) - spi2x + 3;
+		return (uint32_t(F_CPU / 1000) * ms) >> byte_log2;
+	} // }}}
+
+	static inline uint8_t _byte(uint8_t data = 0xff) { // {{{
+		Spi::transfer_block(&data, &data, 1);
+		return data;
+	} // }}}
+
+	static inline void _select() { // {{{
+		Spi::select(_device);
+	} // }}}
+
+	// The card only releases its data output after a clock pulse with
+	// chip select high.
+	static inline void _deselect() { // {{{
+		Spi::deselect(_device);
+		_byte();
+	} // }}}
+
+	// Wait until the card does not hold the data line low.
+	static inline bool _wait_ready() { // {{{
+		for (uint32_t i = _polls(_BUSY_TIMEOUT); i > 0; --i) {
+			if (_byte() == 0xff)
+				return true;
+		}
+		return false;
+	} // }}}
+
+	// Send a command to the selected card and return the R1 response.
+	static inline uint8_t _command(uint8_t cmd, uint32_t arg) { // {{{
+		if (cmd != _CMD_GO_IDLE)
+			_wait_ready();
+		uint8_t packet[6] = {
+			uint8_t(0x40 | cmd),
+			uint8_t(arg >> 24),
+			uint8_t(arg >> 16),
+			uint8_t(arg >> 8),
+			uint8_t(arg),
+			// The CRC is only checked for these two commands.
+			uint8_t(cmd == _CMD_GO_IDLE ? 0x95 : cmd == _CMD_SEND_IF_COND ? 0x87 : 0x01)
+		};
+		Spi::transfer_block(packet, NULL, 6);
+		// After a stop command, one stuff byte must be skipped.
+		if (cmd == _CMD_STOP)
+			_byte();
+		uint8_t r1 = 0xff;
+		for (uint8_t i = 0; i < 10 && (r1 & 0x80); ++i)
+			r1 = _byte();
+		return r1;
+	} // }}}
+
+	static inline uint8_t _app_command(uint8_t cmd, uint32_t arg) { // {{{
+		_command(_CMD_APP, 0);
+		return _command(cmd, arg);
+	} // }}}
+
+	// Convert a block number to the address argument of a command.
+	static inline uint32_t _address(uint32_t block) { // {{{
+		return _type == TYPE_SDHC ? block : block << 9;
+	} // }}}
+
+	// Wait for a data token, then read a block of len bytes and the CRC.
+	static inline bool _read_data(uint8_t *buffer, uint16_t len) { // {{{
+		uint8_t token = 0xff;
+		for (uint32_t i = _polls(_READ_TIMEOUT); i > 0 && token == 0xff; --i)
+			token = _byte();
+		if (token != _TOKEN_START)
+			return false;
+		Spi::transfer_block(NULL, buffer, len);
+		// The CRC is not checked.
+		_byte();
+		_byte();
+		return true;
+	} // }}}
+
+	// Send a data block and check the data response.
+	static inline bool _write_data(uint8_t token, uint8_t const *buffer) { // {{{
+		_byte(token);
+		Spi::transfer_block(buffer, NULL, BLOCK_SIZE);
+		_byte();
+		_byte();
+		// Data response: xxx00101 means the data was accepted.
+		return (_byte() & 0x1f) == 0x05;
+	} // }}}
+	/// @endcond
+
+	/// Initialize the card.
+	/**
+	 * This must be called after Spi::enable() and after a card has been
+	 * inserted. It busy waits; a card can take up to a second to
+	 * initialize.
+	 *
+	 * @return false if there is no usable card; type() is TYPE_NONE in that case.
+	 */
+	static inline bool init() { // {{{
+		_type = TYPE_NONE;
+		_reading = false;
+		_writing = false;
+		_device.freq_divider_log2 = _SLOW_DIVIDER;
+		Spi::setup_device(_device);
+		while (!Spi::acquire()) {}
+		// At least 74 clock pulses with chip select high.
+		Spi::select(_device);
+		Spi::deselect(_device);
+		for (uint8_t i = 0; i < 10; ++i)
+			_byte();
+		_select();
+		uint8_t r1 = 0xff;
+		for (uint8_t i = 0; i < 10 && r1 != _R1_IDLE; ++i)
+			r1 = _command(_CMD_GO_IDLE, 0);
+		uint8_t type = TYPE_NONE;
+		if (r1 == _R1_IDLE) {
+			uint32_t hcs = 0;
+			uint8_t ocr[4];
+			if (!(_command(_CMD_SEND_IF_COND, 0x1aa) & _R1_ILLEGAL)) {
+				Spi::transfer_block(NULL, ocr, 4);
+				if (ocr[3] == 0xaa) {
+					type = TYPE_SD2;
+					hcs = 0x40000000;
+				}
+			}
+			else
+				type = TYPE_SD1;
+			if (type != TYPE_NONE) {
+				// Wait for the card to leave the idle state. Every
+				// attempt takes at least 16 bytes.
+				r1 = _R1_IDLE;
+				for (uint32_t i = _polls(_INIT_TIMEOUT) >> 4; i > 0 && r1 == _R1_IDLE; --i)
+					r1 = _app_command(_CMD_APP_SEND_OP_COND, hcs);
+				if (r1 != 0 && type == TYPE_SD1)
+					type = TYPE_MMC;
+				else if (r1 != 0)
+					type = TYPE_NONE;
+			}
+			if (type == TYPE_MMC) {
+				r1 = _R1_IDLE;
+				for (uint32_t i = _polls(_INIT_TIMEOUT) >> 3; i > 0 && r1 == _R1_IDLE; --i)
+					r1 = _command(_CMD_SEND_OP_COND, 0);
+				if (r1 != 0)
+					type = TYPE_NONE;
+			}
+			if (type == TYPE_SD2 && _command(_CMD_READ_OCR, 0) == 0) {
+				Spi::transfer_block(NULL, ocr, 4);
+				// The card capacity status bit is set for block addressing.
+				if (ocr[0] & 0x40)
+					type = TYPE_SDHC;
+			}
+			if (type != TYPE_NONE && type != TYPE_SDHC && _command(_CMD_SET_BLOCKLEN, BLOCK_SIZE) != 0)
+				type = TYPE_NONE;
+		}
+		_deselect();
+		Spi::release();
+		_type = type;
+		_device.freq_divider_log2 = SDCARD_DIVIDER;
+		return _type != TYPE_NONE;
+	} // }}}
+
+	/// Return the Type of the card.
+	static inline uint8_t type() { return _type; }
+
+	/// Return the number of blocks on the card, or 0 if it can't be read.
+	static inline uint32_t blocks() { // {{{
+		if (_type == TYPE_NONE || !Spi::acquire())
+			return 0;
+		uint8_t csd[16];
+		_select();
+		bool ok = _command(_CMD_SEND_CSD, 0) == 0 && _read_data(csd, 16);
+		_deselect();
+		Spi::release();
+		if (!ok)
+			return 0;
+		if ((csd[0] >> 6) == 1) {
+			// CSD version 2: size is (C_SIZE + 1) * 512 kB.
+			uint32_t c_size = (uint32_t(csd[7] & 0x3f) << 16) | (uint16_t(csd[8]) << 8) | csd[9];
+			return (c_size + 1) << 10;
+		}
+		uint16_t c_size = (uint16_t(csd[6] & 3) << 10) | (uint16_t(csd[7]) << 2) | (csd[8] >> 6);
+		uint8_t mult = ((csd[9] & 3) << 1) | (csd[10] >> 7);
+		uint8_t read_bl_len = csd[5] & 0xf;
+		return uint32_t(c_size + 1) << (mult + 2 + read_bl_len - 9);
+	} // }}}
+
+	/// Read a single block.
+	/**
+	 * @return false on error, or if the bus is in use.
+	 */
+	static inline bool read(uint32_t block, uint8_t *buffer) { // {{{
+		if (_type == TYPE_NONE || _reading || _writing || !Spi::acquire())
+			return false;
+		_select();
+		bool ok = _command(_CMD_READ_BLOCK, _address(block)) == 0 && _read_data(buffer, BLOCK_SIZE);
+		_deselect();
+		Spi::release();
+		return ok;
+	} // }}}
+
+	/// Write a single block.
+	/**
+	 * This waits until the card has programmed the block.
+	 *
+	 * @return false on error, or if the bus is in use.
+	 */
+	static inline bool write(uint32_t block, uint8_t const *buffer) { // {{{
+		if (_type == TYPE_NONE || _reading || _writing || !Spi::acquire())
+			return false;
+		_select();
+		bool ok = _command(_CMD_WRITE_BLOCK, _address(block)) == 0 && _write_data(_TOKEN_START, buffer) && _wait_ready();
+		_deselect();
+		Spi::release();
+		return ok;
+	} // }}}
+
+	/// Start reading consecutive blocks.
+	/**
+	 * The card keeps the bus until read_stop() is called.
+	 *
+	 * @return false on error, or if the bus is in use.
+	 */
+	static inline bool read_start(uint32_t block) { // {{{
+		if (_type == TYPE_NONE || _reading || _writing || !Spi::acquire())
+			return false;
+		_select();
+		if (_command(_CMD_READ_MULTIPLE, _address(block)) != 0) {
+			_deselect();
+			Spi::release();
+			return false;
+		}
+		_reading = true;
+		return true;
+	} // }}}
+
+	/// Read the next block after read_start().
+	static inline bool read_next(uint8_t *buffer) { // {{{
+		if (!_reading)
+			return false;
+		return _read_data(buffer, BLOCK_SIZE);
+	} // }}}
+
+	/// Stop reading blocks and release the bus.
+	static inline bool read_stop() { // {{{
+		if (!_reading)
+			return false;
+		_reading = false;
+		bool ok = _command(_CMD_STOP, 0) == 0 && _wait_ready();
+		_deselect();
+		Spi::release();
+		return ok;
+	} // }}}
+
+	/// Start writing consecutive blocks.
+	/**
+	 * The card keeps the bus until write_stop() is called.
+	 *
+	 * @return false on error, or if the bus is in use.
+	 */
+	static inline bool write_start(uint32_t block) { // {{{
+		if (_type == TYPE_NONE || _reading || _writing || !Spi::acquire())
+			return false;
+		_select();
+		if (_command(_CMD_WRITE_MULTIPLE, _address(block)) != 0) {
+			_deselect();
+			Spi::release();
+			return false;
+		}
+		_writing = true;
+		return true;
+	} // }}}
+
+	/// Check if the card is still programming the last block.
+	/**
+	 * This only works during a multi-block write; it never waits.
+	 */
+	static inline bool busy() { // {{{
+		return _writing && _byte() != 0xff;
+	} // }}}
+
+	/// Write the next block after write_start().
+	/**
+	 * This first waits until the previous block has been programmed, then
+	 * sends the data and returns without waiting for it to be
+	 * programmed.
+	 */
+	static inline bool write_next(uint8_t const *buffer) { // {{{
+		if (!_writing || !_wait_ready())
+			return false;
+		return _write_data(_TOKEN_MULTIPLE, buffer);
+	} // }}}
+
+	/// Stop writing blocks, wait until they are programmed and release the bus.
+	static inline bool write_stop() { // {{{
+		if (!_writing)
+			return false;
+		_writing = false;
+		bool ok = _wait_ready();
+		_byte(_TOKEN_STOP);
+		// Skip one byte before the card signals busy.
+		_byte();
+		ok = _wait_ready() && ok;
+		_deselect();
+		Spi::release();
+		return ok;
+	} // }}}
+}
+
+#endif
+
+#endif
+
+// vim: set foldmethod=marker :
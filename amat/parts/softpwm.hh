@@ -0,0 +1,307 @@
+// Software PWM
+
+// Options:
+// SOFTPWM_CHANNELS
+// SOFTPWM_COUNTER
+// SOFTPWM_PERIOD
+// SOFTPWM_MIN_GAP
+
+#ifndef _AVR_SOFTPWM_HH
+#define _AVR_SOFTPWM_HH
+
+/** @file
+# Software PWM and servo control on any GPIO pins
+This drives up to 16 pins with a PWM signal, using a single compare match
+interrupt of a 16 bit counter. It is intended for RC servos (the default
+period is 20 ms), but works for any PWM signal that is slow enough for an
+interrupt per edge.
+
+At the start of every period, all channels with a nonzero pulse width are set
+high and the others low, with one write per port. The falling edges are stored
+as a list that is sorted by time, where all channels on the same port that fall
+at the same time share one entry. Every entry is a single write to a port
+register. If the next entry is too close to handle with a new interrupt, the
+interrupt waits for it.
+
+Changes are double buffered. The main loop builds a new edge list with
+commit() and the interrupt switches to it at the start of the next period, so
+a period is never cut short or stretched and the main loop never waits for
+the interrupt.
+
+Example:
+```
+#define SOFTPWM_CHANNELS 2
+
+#include <amat.hh>
+
+void setup() {
+	SoftPwm::setup_channel(0, Gpio::make_pin(PD, 2));
+	SoftPwm::setup_channel(1, Gpio::make_pin(PD, 3));
+	// Center position for both servos.
+	SoftPwm::set(0, 1500, false);
+	SoftPwm::set(1, 1500);
+}
+```
+
+@author Bas Wijnen <wijnen@debian.org>
+*/
+
+#ifdef DOXYGEN
+/// Number of channels; defining this enables software PWM. Maximum 16.
+#define SOFTPWM_CHANNELS
+/// Counter that is used for software PWM. Default: 1. Must be a 16 bit counter.
+/**
+ * The counter runs in normal mode and the compare match A interrupt is
+ * used.
+ */
+#define SOFTPWM_COUNTER 1
+/// Length of a period in µs. Default: 20000.
+/**
+ * The counter prescaler is chosen at compile time as the smallest value for
+ * which a period fits in the counter. With a 16 MHz clock and the default
+ * period, that is 8, so the resolution is 0.5 µs.
+ */
+#define SOFTPWM_PERIOD 20000
+/// Edges that are less than this many counter ticks apart are handled in the same interrupt. Default: 128 clock cycles.
+#define SOFTPWM_MIN_GAP
+#endif
+
+#ifdef SOFTPWM_CHANNELS
+
+#ifndef SOFTPWM_COUNTER
+#define SOFTPWM_COUNTER 1
+#endif
+
+#ifndef SOFTPWM_PERIOD
+#define SOFTPWM_PERIOD 20000
+#endif
+
+/// @cond
+#define _AVR_SOFTPWM_CAT_(a, b, c) a ## b ## c
+#define _AVR_SOFTPWM_CAT(a, b, c) _AVR_SOFTPWM_CAT_(a, b, c)
+#define _AVR_SOFTPWM_COUNTER(name, suffix) Counter::_AVR_SOFTPWM_CAT(name, SOFTPWM_COUNTER, suffix)
+
+// Ticks per period at prescaler 1.
+#define _AVR_SOFTPWM_TICKS (uint64_t(F_CPU) * SOFTPWM_PERIOD / 1000000)
+#define _AVR_SOFTPWM_DIVIDER ( \
+	_AVR_SOFTPWM_TICKS < 0x10000 ? 1 : \
+	_AVR_SOFTPWM_TICKS / 8 < 0x10000 ? 8 : \
+	_AVR_SOFTPWM_TICKS / 64 < 0x10000 ? 64 : \
+	_AVR_SOFTPWM_TICKS / 256 < 0x10000 ? 256 : \
+	1024)
+#define _AVR_SOFTPWM_PERIOD_TICKS uint16_t(_AVR_SOFTPWM_TICKS / _AVR_SOFTPWM_DIVIDER)
+
+#ifndef SOFTPWM_MIN_GAP
+#define SOFTPWM_MIN_GAP (128 / _AVR_SOFTPWM_DIVIDER + 1)
+#endif
+
+#if (SOFTPWM_COUNTER == 1 && (defined(SYSTEM_CLOCK1_ENABLE_CAPT) || defined(SYSTEM_CLOCK1_ENABLE_COMPA) || defined(CAPTURE1_SIZE) || defined(PWM1_FREQUENCY))) \
+	|| (SOFTPWM_COUNTER == 3 && (defined(SYSTEM_CLOCK3_ENABLE_CAPT) || defined(SYSTEM_CLOCK3_ENABLE_COMPA) || defined(CAPTURE3_SIZE) || defined(PWM3_FREQUENCY))) \
+	|| (SOFTPWM_COUNTER == 4 && (defined(SYSTEM_CLOCK4_ENABLE_CAPT) || defined(SYSTEM_CLOCK4_ENABLE_COMPA) || defined(CAPTURE4_SIZE) || defined(PWM4_FREQUENCY))) \
+	|| (SOFTPWM_COUNTER == 5 && (defined(SYSTEM_CLOCK5_ENABLE_CAPT) || defined(SYSTEM_CLOCK5_ENABLE_COMPA) || defined(CAPTURE5_SIZE) || defined(PWM5_FREQUENCY))) \
+	|| (defined(STEPPER_AXES) && STEPPER_COUNTER == SOFTPWM_COUNTER)
+#error "The counter for software PWM is already in use"
+#endif
+/// @endcond
+
+/// Software PWM
+namespace SoftPwm {
+	/// @cond
+	static_assert(SOFTPWM_CHANNELS >= 1 && SOFTPWM_CHANNELS <= 16, "SOFTPWM_CHANNELS must be in the range 1 through 16");
+	static_assert(_AVR_SOFTPWM_TICKS / 1024 < 0x10000, "SOFTPWM_PERIOD is too long");
+
+	struct Edge {
+		uint16_t time;
+		volatile uint8_t *port;
+		uint8_t mask;
+	};
+
+	struct Frame {
+		Edge edge[SOFTPWM_CHANNELS];
+		uint8_t num_edges;
+		// Start of period: for every port, channels in all_mask are set to the value in on_mask.
+		volatile uint8_t *start_port[SOFTPWM_CHANNELS];
+		uint8_t all_mask[SOFTPWM_CHANNELS];
+		uint8_t on_mask[SOFTPWM_CHANNELS];
+		uint8_t num_ports;
+	};
+
+	static Frame frame[2];
+	// Shared with the interrupt. commit() only reads front after it has
+	// seen that pending is false; the interrupt only changes it while
+	// pending is true.
+	static volatile uint8_t front = 0;
+	static volatile bool pending = false;
+	static bool dirty = false;
+
+	static volatile uint8_t *port[SOFTPWM_CHANNELS];
+	static uint8_t mask[SOFTPWM_CHANNELS];
+	static uint16_t width[SOFTPWM_CHANNELS];
+
+	// State of the interrupt.
+	static uint16_t base;
+	static uint8_t current;
+	/// @endcond
+
+	/// Number of counter ticks per period.
+	static const uint16_t period_ticks = _AVR_SOFTPWM_PERIOD_TICKS;
+
+	/// Convert µs to counter ticks.
+	static inline uint16_t us_to_ticks(uint16_t us) { // {{{
+		return uint32_t(us) * (F_CPU / _AVR_SOFTPWM_DIVIDER / 1000) / 1000;
+	} // }}}
+
+	/// Build a new edge list from the current pulse widths and hand it to the interrupt.
+	/**
+	 * If the interrupt has not yet started using the previous list, nothing
+	 * is done and false is returned; call this function again later. It
+	 * never waits for the interrupt.
+	 */
+	static inline bool commit() { // {{{
+		if (pending)
+			return false;
+		// Both are volatile, so front is read after pending.
+		Frame &f = frame[!front];
+		f.num_edges = 0;
+		f.num_ports = 0;
+		for (uint8_t c = 0; c < SOFTPWM_CHANNELS; ++c) {
+			if (port[c] == nullptr)
+				continue;
+			// Add the channel to the write at the start of the period.
+			uint8_t i;
+			for (i = 0; i < f.num_ports; ++i) {
+				if (f.start_port[i] == port[c])
+					break;
+			}
+			if (i == f.num_ports) {
+				f.start_port[i] = port[c];
+				f.all_mask[i] = 0;
+				f.on_mask[i] = 0;
+				++f.num_ports;
+			}
+			f.all_mask[i] |= mask[c];
+			if (width[c] == 0)
+				continue;
+			f.on_mask[i] |= mask[c];
+			// Pulses that end too close to the next period are always on, so the start of the period is never missed.
+			if (width[c] >= period_ticks - 2 * SOFTPWM_MIN_GAP)
+				continue;
+			// Insert the falling edge, sorted by time. Merge with an existing edge on the same port.
+			for (i = 0; i < f.num_edges; ++i) {
+				if (f.edge[i].time >= width[c])
+					break;
+			}
+			uint8_t j;
+			for (j = i; j < f.num_edges && f.edge[j].time == width[c]; ++j) {
+				if (f.edge[j].port == port[c])
+					break;
+			}
+			if (j < f.num_edges && f.edge[j].time == width[c] && f.edge[j].port == port[c]) {
+				f.edge[j].mask |= mask[c];
+				continue;
+			}
+			for (j = f.num_edges; j > i; --j)
+				f.edge[j] = f.edge[j - 1];
+			f.edge[i].time = width[c];
+			f.edge[i].port = port[c];
+			f.edge[i].mask = mask[c];
+			++f.num_edges;
+		}
+		dirty = false;
+		// The frame is not volatile; make sure the compiler stores all of
+		// it before the interrupt can see it.
+		asm volatile("" ::: "memory");
+		pending = true;
+		return true;
+	} // }}}
+
+	/// Check if changes have not been committed yet.
+	static inline bool need_commit() { return dirty; }
+
+	/// Set up a pin as software PWM channel. The pin is set to output low.
+	static inline void setup_channel(uint8_t channel, uint8_t pin) { // {{{
+		Gpio::write(pin, false);
+		port[channel] = &Gpio::PORT((pin >> 3) & 0xf);
+		mask[channel] = 1 << (pin & 0x7);
+		dirty = true;
+	} // }}}
+
+	/// Set the pulse width of a channel in counter ticks.
+	/**
+	 * 0 means always low; period_ticks (or slightly less) means always
+	 * high. If do_commit is true, commit() is called.
+	 *
+	 * @return false if do_commit is true and commit() failed, true otherwise.
+	 */
+	static inline bool set_ticks(uint8_t channel, uint16_t ticks, bool do_commit = true) { // {{{
+		width[channel] = ticks;
+		dirty = true;
+		return do_commit ? commit() : true;
+	} // }}}
+
+	/// Set the pulse width of a channel in µs. @sa set_ticks()
+	static inline bool set(uint8_t channel, uint16_t us, bool do_commit = true) { // {{{
+		return set_ticks(channel, us_to_ticks(us), do_commit);
+	} // }}}
+}
+
+/// @cond
+#define _AVR_SETUP_SOFTPWM \
+	_AVR_SOFTPWM_COUNTER(enable, ) (static_cast <_AVR_SOFTPWM_COUNTER(Source, )>(COUNTER1_DIV_TO_SOURCE(_AVR_SOFTPWM_DIVIDER)), _AVR_SOFTPWM_COUNTER(m, _normal)); \
+	SoftPwm::current = SoftPwm::frame[0].num_edges = SoftPwm::frame[0].num_ports = 0; \
+	SoftPwm::base = _AVR_SOFTPWM_COUNTER(read, ) () + SoftPwm::period_ticks; \
+	_AVR_SOFTPWM_COUNTER(set_ocr, a) (SoftPwm::base); \
+	_AVR_SOFTPWM_COUNTER(enable_compa, ) ();
+
+ISR(_AVR_SOFTPWM_CAT(TIMER, SOFTPWM_COUNTER, _COMPA_vect)) { // {{{
+	using namespace SoftPwm;
+	Frame *f = &frame[front];
+	if (current >= f->num_edges) {
+		// Start of a new period.
+		if (pending) {
+			front = !front;
+			f = &frame[front];
+			pending = false;
+		}
+		for (uint8_t i = 0; i < f->num_ports; ++i)
+			*f->start_port[i] = (*f->start_port[i] & ~f->all_mask[i]) | f->on_mask[i];
+		current = 0;
+		if (f->num_edges == 0) {
+			base += period_ticks;
+			_AVR_SOFTPWM_COUNTER(set_ocr, a) (base);
+			return;
+		}
+		uint16_t first = base + f->edge[0].time;
+		if (int16_t(first - _AVR_SOFTPWM_COUNTER(read, ) ()) > SOFTPWM_MIN_GAP) {
+			_AVR_SOFTPWM_COUNTER(set_ocr, a) (first);
+			return;
+		}
+		while (int16_t(first - _AVR_SOFTPWM_COUNTER(read, ) ()) > 0) {}
+	}
+	while (true) {
+		Edge const &e = f->edge[current];
+		*e.port &= ~e.mask;
+		++current;
+		uint16_t next;
+		if (current >= f->num_edges) {
+			base += period_ticks;
+			next = base;
+		}
+		else
+			next = base + f->edge[current].time;
+		int16_t remaining = next - _AVR_SOFTPWM_COUNTER(read, ) ();
+		if (remaining > SOFTPWM_MIN_GAP || current >= f->num_edges) {
+			_AVR_SOFTPWM_COUNTER(set_ocr, a) (next);
+			return;
+		}
+		// The next edge is too close for a new interrupt; wait for it here.
+		while (int16_t(next - _AVR_SOFTPWM_COUNTER(read, ) ()) > 0) {}
+	}
+} // }}}
+/// @endcond
+
+#endif
+
+#endif
+
+// vim: set foldmethod=marker :
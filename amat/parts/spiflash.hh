@@ -0,0 +1,558 @@
+// SPI NOR flash
+
+// Options:
+// SPIFLASH_CS
+// SPIFLASH_DIVIDER
+// SPIFLASH_PAGE_SIZE
+// SPIFLASH_SECTOR_SIZE
+// SPIFLASH_READ_SIZE
+// SPIFLASH_LOG_START
+// SPIFLASH_LOG_END
+
+#ifndef _AVR_SPIFLASH_HH
+#define _AVR_SPIFLASH_HH
+
+/** @file
+# Driver for SPI NOR flash chips
+This supports the common 25-series flash chips with 24 bit addresses: reading
+the JEDEC ID, page programming, sector erase and fast read.
+
+Program and erase operations do not wait for the chip to finish. The chip is
+only asked for its status when busy() is called, so the main loop can do other
+work (such as filling the next page) while the chip is programming.
+
+The data is transferred with Spi::transfer_block(), so it moves at nearly the
+full bus speed. When the transaction queue (SPI_QUEUE_SIZE) is used for other
+devices on the bus, functions that need the bus return false while a
+transaction is running; they can be retried later.
+
+On top of this, there is an append-only log that uses a range of sectors as a
+ring. Data is collected in RAM and programmed a page at a time. A sector is
+erased just before the log enters it, so all sectors wear equally. Every page
+has a commit byte that is programmed after the rest of the page, so a page
+that was cut off by a power failure is ignored.
+
+Example:
+```
+#define SPI_ENABLE_MASTER
+#define SPIFLASH_CS GPIO_MAKE_PIN(PB, 2)
+#define SPIFLASH_LOG_START 0
+#define SPIFLASH_LOG_END 0x100000
+#include <amat.hh>
+
+void setup() {
+	Spi::enable();
+	Spiflash::setup();
+	Spiflash::log_begin();
+}
+
+void loop() {
+	uint16_t value = Adc::single_block();
+	Spiflash::log_append(reinterpret_cast <uint8_t const *>(&value), 2);
+	Spiflash::log_poll();
+}
+```
+
+@author Bas Wijnen <wijnen@debian.org>
+*/
+
+#ifdef DOXYGEN
+/// Chip select pin of the flash chip; defining this enables the driver.
+#define SPIFLASH_CS
+/// Spi clock divider, as for Spi::enable(). Default: 0 (f_osc / 2).
+#define SPIFLASH_DIVIDER 0
+/// Size of a program page. Default: 256.
+/**
+ * This can be set to a smaller power of two to save RAM in the log.
+ */
+#define SPIFLASH_PAGE_SIZE 256
+/// Size of the smallest erasable unit. Default: 4096.
+#define SPIFLASH_SECTOR_SIZE 4096
+/// Size of the stream buffer for stream_start(); defining this enables streaming reads.
+/**
+ * It must be at most 255.
+ */
+#define SPIFLASH_READ_SIZE
+/// First byte of the log; defining this and SPIFLASH_LOG_END enables the log.
+/**
+ * It must be at the start of a sector.
+ */
+#define SPIFLASH_LOG_START
+/// First byte after the log. It must be at the start of a sector.
+#define SPIFLASH_LOG_END
+#endif
+
+#ifdef SPIFLASH_CS
+
+#ifndef SPI_ENABLE_MASTER
+#error "The SPI flash driver requires SPI_ENABLE_MASTER"
+#endif
+#ifdef SPI_TX_SIZE
+#error "The SPI flash driver can not be used together with SPI_TX_SIZE"
+#endif
+
+#ifndef SPIFLASH_DIVIDER
+#define SPIFLASH_DIVIDER 0
+#endif
+
+#ifndef SPIFLASH_PAGE_SIZE
+#define SPIFLASH_PAGE_SIZE 256
+#endif
+
+#ifndef SPIFLASH_SECTOR_SIZE
+#define SPIFLASH_SECTOR_SIZE 4096
+#endif
+
+/// SPI NOR flash
+namespace Spiflash {
+	/// @cond
+	enum _Command {
+		_CMD_WRITE_ENABLE = 0x06,
+		_CMD_READ_STATUS = 0x05,
+		_CMD_PROGRAM = 0x02,
+		_CMD_FAST_READ = 0x0b,
+		_CMD_ERASE_SECTOR = 0x20,
+		_CMD_ERASE_CHIP = 0xc7,
+		_CMD_JEDEC_ID = 0x9f
+	};
+	// Write in progress bit in the status register.
+	uint8_t const _STATUS_WIP = 1;
+
+	// Mode 0, most significant bit first.
+	Spi::Device const _device = {SPIFLASH_CS, SPIFLASH_DIVIDER, true, false, true};
+
+	// Set when a program or erase operation may still be running.
+	static bool _wip;
+
+	static inline void _header(uint8_t *header, uint8_t cmd, uint32_t addr) { // {{{
+		header[0] = cmd;
+		header[1] = (addr >> 16) & 0xff;
+		header[2] = (addr >> 8) & 0xff;
+		header[3] = addr & 0xff;
+	} // }}}
+
+	// Send a single byte command.
+	static inline void _command(uint8_t cmd) { // {{{
+		Spi::select(_device);
+		Spi::transfer_block(&cmd, NULL, 1);
+		Spi::deselect(_device);
+	} // }}}
+
+	// Send a command with an address; the chip is selected afterwards.
+	static inline void _begin(uint8_t cmd, uint32_t addr, bool dummy = false) { // {{{
+		uint8_t header[5];
+		_header(header, cmd, addr);
+		header[4] = 0xff;
+		Spi::select(_device);
+		Spi::transfer_block(header, NULL, dummy ? 5 : 4);
+	} // }}}
+
+	// Take the bus if the chip is ready for a command.
+	static inline bool _start() { // {{{
+		if (_wip)
+			return false;
+		return Spi::acquire();
+	} // }}}
+	/// @endcond
+
+	/// Set up the chip select pin.
+	/**
+	 * Spi::enable() must be called as well.
+	 */
+	static inline void setup() { // {{{
+		Spi::setup_device(_device);
+		_wip = false;
+	} // }}}
+
+	/// Check if the chip is still programming or erasing.
+	/**
+	 * This reads the status register only if an operation was started
+	 * and has not been seen to complete yet, so it is cheap to call from
+	 * the main loop. If the bus is in use by another device, it
+	 * returns true.
+	 */
+	static inline bool busy() { // {{{
+		if (!_wip)
+			return false;
+		if (!Spi::acquire())
+			return true;
+		uint8_t data[2] = {_CMD_READ_STATUS, 0xff};
+		Spi::select(_device);
+		Spi::transfer_block(data, data, 2);
+		Spi::deselect(_device);
+		Spi::release();
+		_wip = data[1] & _STATUS_WIP;
+		return _wip;
+	} // }}}
+
+	/// Read the JEDEC ID.
+	/**
+	 * @return Manufacturer, memory type and capacity in the lower 3 bytes, or 0 if the chip or the bus is busy.
+	 */
+	static inline uint32_t jedec_id() { // {{{
+		if (busy() || !_start())
+			return 0;
+		uint8_t data[4] = {_CMD_JEDEC_ID, 0xff, 0xff, 0xff};
+		Spi::select(_device);
+		Spi::transfer_block(data, data, 4);
+		Spi::deselect(_device);
+		Spi::release();
+		return (uint32_t(data[1]) << 16) | (uint16_t(data[2]) << 8) | data[3];
+	} // }}}
+
+	/// Read data.
+	/**
+	 * This uses the fast read command, which works at all clock speeds.
+	 *
+	 * @return false if the chip or the bus is busy; nothing is read in that case.
+	 */
+	static inline bool read(uint32_t addr, uint8_t *data, uint16_t len) { // {{{
+		if (busy() || !_start())
+			return false;
+		_begin(_CMD_FAST_READ, addr, true);
+		Spi::transfer_block(NULL, data, len);
+		Spi::deselect(_device);
+		Spi::release();
+		return true;
+	} // }}}
+
+	/// Start programming data.
+	/**
+	 * The first 4 bytes of buffer are used for the command and the
+	 * address; the data to program follows them. This avoids copying the
+	 * data. The data must not cross a page boundary.
+	 *
+	 * This does not wait for programming to complete; use busy() to check
+	 * it. Bits can only be programmed from 1 to 0; the area must be erased
+	 * first.
+	 *
+	 * @param addr Address of the first byte.
+	 * @param buffer 4 bytes of room, followed by the data.
+	 * @param len Number of data bytes, at most SPIFLASH_PAGE_SIZE.
+	 * @return false if the chip or the bus is busy; nothing is programmed in that case.
+	 */
+	static inline bool program(uint32_t addr, uint8_t *buffer, uint16_t len) { // {{{
+		if (busy() || !_start())
+			return false;
+		_command(_CMD_WRITE_ENABLE);
+		_header(buffer, _CMD_PROGRAM, addr);
+		Spi::select(_device);
+		Spi::transfer_block(buffer, NULL, len + 4);
+		Spi::deselect(_device);
+		Spi::release();
+		_wip = true;
+		return true;
+	} // }}}
+
+	/// Start erasing a sector.
+	/**
+	 * This does not wait for the erase to complete; use busy() to check
+	 * it.
+	 *
+	 * @return false if the chip or the bus is busy; nothing is erased in that case.
+	 */
+	static inline bool erase_sector(uint32_t addr) { // {{{
+		if (busy() || !_start())
+			return false;
+		_command(_CMD_WRITE_ENABLE);
+		_begin(_CMD_ERASE_SECTOR, addr);
+		Spi::deselect(_device);
+		Spi::release();
+		_wip = true;
+		return true;
+	} // }}}
+
+	/// Start erasing the entire chip.
+	/**
+	 * This can take a long time; use busy() to check for completion.
+	 *
+	 * @return false if the chip or the bus is busy.
+	 */
+	static inline bool erase_chip() { // {{{
+		if (busy() || !_start())
+			return false;
+		_command(_CMD_WRITE_ENABLE);
+		_command(_CMD_ERASE_CHIP);
+		Spi::release();
+		_wip = true;
+		return true;
+	} // }}}
+
+#if defined(SPIFLASH_READ_SIZE) || defined(DOXYGEN)
+	// Streaming read. {{{
+
+	/// Buffer that is filled by stream_poll().
+	STREAM_BUFFER(read_buffer, SPIFLASH_READ_SIZE)
+
+	/// @cond
+	static_assert(SPIFLASH_READ_SIZE > 1 && SPIFLASH_READ_SIZE < 0x100, "SPIFLASH_READ_SIZE must be between 2 and 255");
+	static uint32_t _stream_addr;
+	static uint32_t _stream_left;
+	/// @endcond
+
+	/// Start streaming data from the chip into read_buffer.
+	/**
+	 * The data is read by stream_poll(), which must be called regularly.
+	 * User code takes it out of the buffer with read_buffer_read() and
+	 * read_buffer_pop().
+	 */
+	static inline void stream_start(uint32_t addr, uint32_t len) { // {{{
+		read_buffer_reset();
+		_stream_addr = addr;
+		_stream_left = len;
+	} // }}}
+
+	/// Return the number of bytes that have not been read from the chip yet.
+	static inline uint32_t stream_remaining() { return _stream_left; }
+
+	/// Read as much data as fits in the free part of read_buffer.
+	/**
+	 * Every call reads one contiguous block, so when the free space wraps
+	 * around the end of the buffer, the rest is read by the next call.
+	 */
+	static inline void stream_poll() { // {{{
+		if (_stream_left == 0)
+			return;
+		uint8_t tail = read_buffer_tail;
+		uint8_t len = read_buffer_buffer_available();
+		if (len > SPIFLASH_READ_SIZE - tail)
+			len = SPIFLASH_READ_SIZE - tail;
+		if (len > _stream_left)
+			len = _stream_left;
+		if (len == 0)
+			return;
+		if (!read(_stream_addr, &read_buffer_buffer[tail], len))
+			return;
+		read_buffer_tail = (tail + len) % SPIFLASH_READ_SIZE;
+		_stream_addr += len;
+		_stream_left -= len;
+	} // }}}
+
+	// }}}
+#endif
+
+#if (defined(SPIFLASH_LOG_START) && defined(SPIFLASH_LOG_END)) || defined(DOXYGEN)
+	// Append-only log. {{{
+
+	/// @cond
+	static_assert(SPIFLASH_PAGE_SIZE <= 256 && SPIFLASH_PAGE_SIZE >= 16 && (SPIFLASH_PAGE_SIZE & (SPIFLASH_PAGE_SIZE - 1)) == 0, "SPIFLASH_PAGE_SIZE must be a power of two between 16 and 256");
+	static_assert((uint32_t(SPIFLASH_LOG_START) % SPIFLASH_SECTOR_SIZE) == 0 && (uint32_t(SPIFLASH_LOG_END) % SPIFLASH_SECTOR_SIZE) == 0, "The log must start and end on a sector boundary");
+	static_assert(uint32_t(SPIFLASH_LOG_END) >= uint32_t(SPIFLASH_LOG_START) + 2 * SPIFLASH_SECTOR_SIZE, "The log must be at least 2 sectors");
+
+	// Every page starts with a little endian sequence number, the number
+	// of data bytes in the page and a commit byte. The commit byte is
+	// programmed to 0 in a separate operation, after the rest of the page
+	// is done. The chip may program the bytes of a page in any order, so
+	// only the commit byte shows that a page is complete.
+	uint8_t const _LOG_HEADER = 6;
+	uint8_t const _LOG_LEN = 4;
+	uint8_t const _LOG_COMMIT = 5;
+	// In the buffers, the header is preceded by room for the command.
+	uint8_t const _LOG_OFFSET = 4 + _LOG_HEADER;
+	uint16_t const _LOG_DATA = SPIFLASH_PAGE_SIZE - _LOG_HEADER;
+
+	static uint8_t _log_buffer[2][4 + SPIFLASH_PAGE_SIZE];
+	// Buffer that is being filled and the number of bytes in it.
+	static uint8_t _log_fill;
+	static uint8_t _log_used;
+	// The other buffer is full and waiting to be programmed.
+	static bool _log_pending;
+	// Next page to program and its sequence number.
+	static uint32_t _log_addr;
+	static uint32_t _log_seq;
+	// Set if the sector of _log_addr has been erased.
+	static bool _log_erased;
+	// Set if the page at _log_commit_addr has been programmed, but not its commit byte.
+	static bool _log_commit;
+	static uint32_t _log_commit_addr;
+
+	static inline bool _log_valid(uint8_t const *header) { // {{{
+		return header[_LOG_LEN] <= _LOG_DATA && header[_LOG_COMMIT] != 0xff;
+	} // }}}
+
+	// Check that a page is completely erased. An erased header is not
+	// enough: a power failure may have left some data without a header.
+	static inline bool _log_free(uint32_t addr) { // {{{
+		uint8_t chunk[16];
+		for (uint16_t i = 0; i < SPIFLASH_PAGE_SIZE; i += sizeof(chunk)) {
+			while (!read(addr + i, chunk, sizeof(chunk))) {}
+			for (uint8_t j = 0; j < sizeof(chunk); ++j) {
+				if (chunk[j] != 0xff)
+					return false;
+			}
+		}
+		return true;
+	} // }}}
+	/// @endcond
+
+	/// Return the address of the page after addr in the log.
+	static inline uint32_t log_next(uint32_t addr) { // {{{
+		addr += SPIFLASH_PAGE_SIZE;
+		return addr >= uint32_t(SPIFLASH_LOG_END) ? uint32_t(SPIFLASH_LOG_START) : addr;
+	} // }}}
+
+	/// Return the address of the next page that will be written.
+	/**
+	 * The pages after it (wrapping around at the end of the log) hold the
+	 * oldest data, so reading from here with log_next() until this address
+	 * is reached again gives all data from old to new. Erased pages
+	 * are skipped.
+	 */
+	static inline uint32_t log_end() { return _log_addr; }
+
+	/// Read one page of the log.
+	/**
+	 * @param addr Address of the page.
+	 * @param data Buffer for at least SPIFLASH_PAGE_SIZE - 6 bytes.
+	 * @param len Set to the number of data bytes in the page; 0 if the page is erased or was not completely programmed.
+	 * @return false if the chip or the bus is busy.
+	 */
+	static inline bool log_read(uint32_t addr, uint8_t *data, uint8_t &len) { // {{{
+		uint8_t header[_LOG_HEADER];
+		if (!read(addr, header, _LOG_HEADER))
+			return false;
+		len = _log_valid(header) ? header[_LOG_LEN] : 0;
+		if (len == 0)
+			return true;
+		return read(addr + _LOG_HEADER, data, len);
+	} // }}}
+
+	/// Find the end of the log.
+	/**
+	 * This reads the header of every page, so it takes a while for a
+	 * large log. It must be called once before the log is used. It waits
+	 * until the chip and the bus are available.
+	 */
+	static inline void log_begin() { // {{{
+		bool found = false;
+		uint32_t newest = 0;
+		_log_addr = SPIFLASH_LOG_START;
+		for (uint32_t addr = SPIFLASH_LOG_START; addr < uint32_t(SPIFLASH_LOG_END); addr += SPIFLASH_PAGE_SIZE) {
+			uint8_t header[_LOG_HEADER];
+			while (!read(addr, header, _LOG_HEADER)) {}
+			// A page that was not completely programmed may have any
+			// sequence number; don't use it.
+			if (!_log_valid(header))
+				continue;
+			uint32_t seq = header[0] | (uint16_t(header[1]) << 8) | (uint32_t(header[2]) << 16) | (uint32_t(header[3]) << 24);
+			// Compare with wrap around, in case the counter ever overflows.
+			if (found && int32_t(seq - newest) < 0)
+				continue;
+			found = true;
+			newest = seq;
+			_log_addr = log_next(addr);
+		}
+		_log_seq = found ? newest + 1 : 0;
+		// Programming may have been interrupted after the newest page,
+		// which leaves a page without a commit byte. Such a page is not
+		// free; skip it. A new sector is erased anyway.
+		while (found && _log_addr % SPIFLASH_SECTOR_SIZE != 0 && !_log_free(_log_addr))
+			_log_addr = log_next(_log_addr);
+		// A sector that is partly written is still erased after the last page.
+		_log_erased = found && _log_addr % SPIFLASH_SECTOR_SIZE != 0;
+		_log_fill = 0;
+		_log_used = 0;
+		_log_pending = false;
+		_log_commit = false;
+	} // }}}
+
+	/// Program pending data when the chip is ready.
+	/**
+	 * This must be called regularly from the main loop. It never waits
+	 * for the chip. When a page is done, its commit byte is programmed.
+	 * When the log enters a new sector, that sector is erased first.
+	 */
+	static inline void log_poll() { // {{{
+		if ((!_log_pending && !_log_commit) || busy())
+			return;
+		if (_log_commit) {
+			uint8_t buffer[5];
+			buffer[4] = 0;
+			if (program(_log_commit_addr + _LOG_COMMIT, buffer, 1))
+				_log_commit = false;
+			return;
+		}
+		if (!_log_erased) {
+			if (erase_sector(_log_addr))
+				_log_erased = true;
+			return;
+		}
+		uint8_t *buffer = _log_buffer[_log_fill ^ 1];
+		for (uint8_t i = 0; i < 4; ++i)
+			buffer[4 + i] = (_log_seq >> (8 * i)) & 0xff;
+		buffer[4 + _LOG_COMMIT] = 0xff;
+		if (!program(_log_addr, buffer, _LOG_HEADER + buffer[4 + _LOG_LEN]))
+			return;
+		_log_pending = false;
+		_log_commit = true;
+		_log_commit_addr = _log_addr;
+		++_log_seq;
+		_log_addr = log_next(_log_addr);
+		_log_erased = _log_addr % SPIFLASH_SECTOR_SIZE != 0;
+	} // }}}
+
+	/// Check if flushed data has not been completely programmed yet.
+	/**
+	 * Before power down, call log_flush() and then log_poll() until this
+	 * returns false and busy() returns false.
+	 */
+	static inline bool log_pending() { return _log_pending || _log_commit; }
+
+	/// Move the data that has been appended to the programming queue.
+	/**
+	 * Normally, data is programmed when a page is full. Call this to
+	 * write a partial page, for example before power down. The rest of
+	 * that page is not used.
+	 *
+	 * @return false if the previous page has not been programmed yet; call log_poll() and try again.
+	 */
+	static inline bool log_flush() { // {{{
+		if (_log_used == 0)
+			return true;
+		log_poll();
+		if (_log_pending)
+			return false;
+		_log_buffer[_log_fill][4 + _LOG_LEN] = _log_used;
+		_log_fill ^= 1;
+		_log_used = 0;
+		_log_pending = true;
+		log_poll();
+		return true;
+	} // }}}
+
+	/// Add data to the log.
+	/**
+	 * The data is copied into a page buffer in RAM. While one buffer is
+	 * being programmed, the other one is filled, so the main loop only
+	 * has to wait when the chip falls behind.
+	 *
+	 * @return The number of bytes that were added; if it is less than len, both buffers are full.
+	 */
+	static inline uint16_t log_append(uint8_t const *data, uint16_t len) { // {{{
+		uint16_t done = 0;
+		while (done < len) {
+			if (_log_used == _LOG_DATA && !log_flush())
+				break;
+			uint8_t *target = &_log_buffer[_log_fill][_LOG_OFFSET + _log_used];
+			uint16_t num = len - done;
+			if (num > _LOG_DATA - _log_used)
+				num = _LOG_DATA - _log_used;
+			for (uint16_t i = 0; i < num; ++i)
+				target[i] = data[done + i];
+			_log_used += num;
+			done += num;
+		}
+		if (_log_used == _LOG_DATA)
+			log_flush();
+		return done;
+	} // }}}
+
+	// }}}
+#endif
+}
+
+#endif
+
+#endif
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,395 @@
+// Stepper motors
+
+// Options:
+// STEPPER_AXES
+// STEPPER_COUNTER
+// STEPPER_TICK_RATE
+// STEPPER_QUEUE_SIZE
+// CALL_stepper_done
+
+#ifndef _AVR_STEPPER_HH
+#define _AVR_STEPPER_HH
+
+/** @file
+# Step pulse generator for stepper motor drivers
+This generates step and direction signals for up to 8 axes from the compare
+match interrupts of a 16 bit counter.
+
+Moves are queued from the main loop. Each move is a straight line in which
+all axes finish at the same time. The axis with the most steps determines the
+timing; the other axes follow it with Bresenham's algorithm. The speed follows
+a trapezoidal profile: accelerate to the requested rate, cruise, and
+decelerate to a stop at the end of the move.
+
+The counter runs at a fixed tick rate (STEPPER_TICK_RATE). On every tick, the
+step rate is incremented or decremented by the acceleration and added to a
+phase accumulator; a carry out of the accumulator is a step. This means that
+the interrupt never needs a division and its run time is bounded by the
+number of axes. All divisions are done by move() in the main loop.
+
+The step pulses start at compare match A and end at compare match B, half a
+tick later. The maximum step rate is the tick rate.
+
+Steps are only made on ticks, so the time between two steps is a whole number
+of ticks. At a step rate between T / (n + 1) and T / n, where T is the tick
+rate, the steps come alternately n and n + 1 ticks apart, so that the average
+is the requested rate. Above half the tick rate the intervals are 1 and 2
+ticks: at 30000 steps/s with the default tick rate, 25 µs and 50 µs. Most
+drivers and motors smooth this out; if they do not, raise STEPPER_TICK_RATE
+or keep the cruise speed below half of it.
+
+While a move runs, the interrupt runs on every tick, also at low step rates.
+When the queue is empty, the counter is stopped, and it is started again by
+move().
+
+Example:
+```
+#define STEPPER_AXES 2
+
+#include <amat.hh>
+
+void setup() {
+	Stepper::setup_axis(0, Gpio::make_pin(PD, 2), Gpio::make_pin(PD, 5));
+	Stepper::setup_axis(1, Gpio::make_pin(PD, 3), Gpio::make_pin(PD, 6));
+	sei();
+	int32_t steps[2] = {3200, -1600};
+	// Run at 20000 steps/s, accelerate at 50000 steps/s².
+	Stepper::move(steps, 20000, 50000);
+}
+```
+
+@author Bas Wijnen <wijnen@debian.org>
+*/
+
+#ifdef DOXYGEN
+/// Number of axes; defining this enables the step generator.
+#define STEPPER_AXES
+/// Counter that is used for the step generator. Default: 1. Must be a 16 bit counter.
+/**
+ * The counter runs in CTC mode and both compare match A and B interrupts
+ * are used, so it can not be used for anything else.
+ */
+#define STEPPER_COUNTER 1
+/// Number of step generator ticks per second. Default: 40000. This is also the maximum step rate.
+/**
+ * A higher rate allows faster stepping and gives less jitter, but uses more
+ * processing time while a move is running. The time between steps is
+ * always a whole number of ticks.
+ */
+#define STEPPER_TICK_RATE 40000
+/// Number of moves that can be queued. Default: 4.
+#define STEPPER_QUEUE_SIZE 4
+/// Enable callback stepper_done(), which is called from the interrupt when the last queued move has finished.
+#define CALL_stepper_done
+#endif
+
+#ifdef STEPPER_AXES
+
+#ifndef STEPPER_COUNTER
+#define STEPPER_COUNTER 1
+#endif
+
+#ifndef STEPPER_TICK_RATE
+#define STEPPER_TICK_RATE 40000
+#endif
+
+#ifndef STEPPER_QUEUE_SIZE
+#define STEPPER_QUEUE_SIZE 4
+#endif
+
+/// @cond
+#define _AVR_STEPPER_CAT_(a, b, c) a ## b ## c
+#define _AVR_STEPPER_CAT(a, b, c) _AVR_STEPPER_CAT_(a, b, c)
+#define _AVR_STEPPER_COUNTER(name, suffix) Counter::_AVR_STEPPER_CAT(name, STEPPER_COUNTER, suffix)
+#define _AVR_STEPPER_TOP (F_CPU / STEPPER_TICK_RATE - 1)
+
+#if (STEPPER_COUNTER == 1 && (defined(SYSTEM_CLOCK1_ENABLE_CAPT) || defined(SYSTEM_CLOCK1_ENABLE_COMPA) || defined(CAPTURE1_SIZE) || defined(PWM1_FREQUENCY))) \
+	|| (STEPPER_COUNTER == 3 && (defined(SYSTEM_CLOCK3_ENABLE_CAPT) || defined(SYSTEM_CLOCK3_ENABLE_COMPA) || defined(CAPTURE3_SIZE) || defined(PWM3_FREQUENCY))) \
+	|| (STEPPER_COUNTER == 4 && (defined(SYSTEM_CLOCK4_ENABLE_CAPT) || defined(SYSTEM_CLOCK4_ENABLE_COMPA) || defined(CAPTURE4_SIZE) || defined(PWM4_FREQUENCY))) \
+	|| (STEPPER_COUNTER == 5 && (defined(SYSTEM_CLOCK5_ENABLE_CAPT) || defined(SYSTEM_CLOCK5_ENABLE_COMPA) || defined(CAPTURE5_SIZE) || defined(PWM5_FREQUENCY)))
+#error "The counter for the step generator is already in use"
+#endif
+
+#ifdef CALL_stepper_done
+static void stepper_done();
+#endif
+/// @endcond
+
+/// Step pulse generator
+namespace Stepper {
+	/// @cond
+	static_assert(STEPPER_AXES >= 1 && STEPPER_AXES <= 8, "STEPPER_AXES must be in the range 1 through 8");
+	static_assert(_AVR_STEPPER_TOP >= 1 && _AVR_STEPPER_TOP < 0x10000, "STEPPER_TICK_RATE can not be reached with this clock");
+
+	// All rates are in steps per tick and all accelerations are in steps
+	// per tick², as 0.32 fixed point numbers.
+	struct Move {
+		uint32_t steps[STEPPER_AXES];
+		uint32_t total;		// Number of steps of the axis with the most steps.
+		uint32_t accel_until;	// Step count where acceleration stops.
+		uint32_t decel_from;	// Step count where deceleration starts.
+		uint32_t max_rate;
+		uint32_t min_rate;
+		uint32_t accel;
+		uint8_t dir;		// Bit mask of axes that move in negative direction.
+	};
+
+	static Move queue[STEPPER_QUEUE_SIZE];
+	static volatile uint8_t queue_head = 0;
+	static volatile uint8_t queue_used = 0;
+
+	static volatile uint8_t *step_port[STEPPER_AXES];
+	static uint8_t step_mask[STEPPER_AXES];
+	static volatile uint8_t *dir_port[STEPPER_AXES];
+	static uint8_t dir_mask[STEPPER_AXES];
+	static uint8_t dir_invert = 0;
+
+	static volatile int32_t current_position[STEPPER_AXES];
+
+	// State of the running move; only used by the interrupt.
+	static bool running = false;
+	static uint32_t rate;
+	static uint32_t phase;
+	static uint32_t count;
+	static uint32_t error[STEPPER_AXES];
+
+	static inline uint16_t isqrt(uint32_t value) { // {{{
+		uint32_t ret = 0;
+		uint32_t bit = uint32_t(1) << 30;
+		while (bit > value)
+			bit >>= 2;
+		while (bit != 0) {
+			if (value >= ret + bit) {
+				value -= ret + bit;
+				ret = (ret >> 1) + bit;
+			}
+			else
+				ret >>= 1;
+			bit >>= 2;
+		}
+		return ret;
+	} // }}}
+	/// @endcond
+
+	/// Set the pins for an axis.
+	/**
+	 * Both pins are set to output low. If invert_dir is true, the
+	 * direction pin is high for positive moves; otherwise it is high for
+	 * negative moves.
+	 *
+	 * This must not be called while a move is running.
+	 */
+	static inline void setup_axis(uint8_t axis, uint8_t step_pin, uint8_t dir_pin, bool invert_dir = false) { // {{{
+		Gpio::write(step_pin, false);
+		Gpio::write(dir_pin, false);
+		step_port[axis] = &Gpio::PORT((step_pin >> 3) & 0xf);
+		step_mask[axis] = 1 << (step_pin & 0x7);
+		dir_port[axis] = &Gpio::PORT((dir_pin >> 3) & 0xf);
+		dir_mask[axis] = 1 << (dir_pin & 0x7);
+		if (invert_dir)
+			dir_invert |= 1 << axis;
+		else
+			dir_invert &= ~(1 << axis);
+	} // }}}
+
+	/// Queue a move.
+	/**
+	 * @param steps: Number of steps for every axis; negative values move in
+	 * negative direction.
+	 * @param max_rate: Cruise speed of the axis with the most steps, in
+	 * steps per second. It is limited to STEPPER_TICK_RATE.
+	 * @param accel: Acceleration of the axis with the most steps, in steps
+	 * per second². If it is 0, the move runs at max_rate from start to end.
+	 *
+	 * @return false if the queue was full; in that case nothing is queued.
+	 */
+	static inline bool move(int32_t const *steps, uint32_t max_rate, uint32_t accel) { // {{{
+		if (queue_used >= STEPPER_QUEUE_SIZE)
+			return false;
+		uint8_t index = queue_head + queue_used;
+		if (index >= STEPPER_QUEUE_SIZE)
+			index -= STEPPER_QUEUE_SIZE;
+		Move &m = queue[index];
+		m.total = 0;
+		m.dir = 0;
+		for (uint8_t i = 0; i < STEPPER_AXES; ++i) {
+			if (steps[i] < 0) {
+				m.steps[i] = -steps[i];
+				m.dir |= 1 << i;
+			}
+			else
+				m.steps[i] = steps[i];
+			if (m.steps[i] > m.total)
+				m.total = m.steps[i];
+		}
+		if (m.total == 0)
+			return true;
+		// Convert to 0.32 fixed point per tick. The factors are computed at compile time.
+		if (max_rate >= STEPPER_TICK_RATE)
+			max_rate = STEPPER_TICK_RATE - 1;
+		m.max_rate = (uint64_t(max_rate) * ((uint64_t(1) << 48) / STEPPER_TICK_RATE)) >> 16;
+		uint64_t a = (uint64_t(accel) * ((uint64_t(1) << 48) / (uint64_t(STEPPER_TICK_RATE) * STEPPER_TICK_RATE))) >> 16;
+		m.accel = a > 0x7fffffff ? 0x7fffffff : a;
+		if (m.accel == 0) {
+			m.min_rate = m.max_rate;
+			m.accel_until = 0;
+			m.decel_from = m.total;
+		}
+		else {
+			// Rate after one step from standstill: v² = 2as.
+			m.min_rate = uint32_t(isqrt(m.accel << 1)) << 16;
+			if (m.min_rate > m.max_rate)
+				m.min_rate = m.max_rate;
+			// Steps needed to reach max_rate: s = v² / 2a.
+			uint32_t v = m.max_rate >> 16;
+			uint32_t ramp = (v * v) / (m.accel << 1);
+			if (ramp > m.total / 2)
+				ramp = m.total / 2;
+			m.accel_until = ramp;
+			m.decel_from = m.total - ramp;
+		}
+		uint8_t sreg = SREG;
+		cli();
+		if (queue_used == 0) {
+			// Start the counter; the first tick sets up the move.
+			_AVR_STEPPER_COUNTER(write, ) (0);
+			_AVR_STEPPER_COUNTER(enable, ) (_AVR_STEPPER_COUNTER(s, _div1), _AVR_STEPPER_COUNTER(m, _ctc_ocra));
+		}
+		queue_used = queue_used + 1;
+		_AVR_STEPPER_COUNTER(enable_compa, ) ();
+		_AVR_STEPPER_COUNTER(enable_compb, ) ();
+		SREG = sreg;
+		return true;
+	} // }}}
+
+	/// Number of moves in the queue, including the one that is running.
+	static inline uint8_t queued() { return queue_used; }
+
+	/// Check if there is room in the queue for another move.
+	static inline bool can_move() { return queue_used < STEPPER_QUEUE_SIZE; }
+
+	/// Check if the motors are moving or moves are queued.
+	static inline bool busy() { return queue_used > 0; }
+
+	/// Stop immediately, without deceleration, and discard all queued moves.
+	/**
+	 * Note that a sudden stop at high speed makes the motors lose steps;
+	 * the position is no longer reliable after that.
+	 */
+	static inline void stop() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_AVR_STEPPER_COUNTER(disable_compa, ) ();
+		_AVR_STEPPER_COUNTER(disable_compb, ) ();
+		_AVR_STEPPER_COUNTER(enable, ) (_AVR_STEPPER_COUNTER(s, _off), _AVR_STEPPER_COUNTER(m, _ctc_ocra));
+		// End any step pulse that compare match B will not end now.
+		for (uint8_t i = 0; i < STEPPER_AXES; ++i)
+			*step_port[i] &= ~step_mask[i];
+		running = false;
+		queue_used = 0;
+		SREG = sreg;
+	} // }}}
+
+	/// Get current position of an axis in steps, relative to the last set_position().
+	static inline int32_t position(uint8_t axis) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		int32_t ret = current_position[axis];
+		SREG = sreg;
+		return ret;
+	} // }}}
+
+	/// Set current position of an axis, for example after homing.
+	static inline void set_position(uint8_t axis, int32_t pos) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		current_position[axis] = pos;
+		SREG = sreg;
+	} // }}}
+}
+
+/// @cond
+#define _AVR_SETUP_STEPPER \
+	_AVR_STEPPER_COUNTER(set_ocr, a) (_AVR_STEPPER_TOP); \
+	_AVR_STEPPER_COUNTER(set_ocr, b) (_AVR_STEPPER_TOP / 2); \
+	_AVR_STEPPER_COUNTER(enable, ) (_AVR_STEPPER_COUNTER(s, _off), _AVR_STEPPER_COUNTER(m, _ctc_ocra));
+
+ISR(_AVR_STEPPER_CAT(TIMER, STEPPER_COUNTER, _COMPA_vect)) { // {{{
+	using namespace Stepper;
+	if (!running) {
+		if (queue_used == 0) {
+			// Nothing to do; stop the counter until the next move().
+			_AVR_STEPPER_COUNTER(disable_compa, ) ();
+			_AVR_STEPPER_COUNTER(disable_compb, ) ();
+			_AVR_STEPPER_COUNTER(enable, ) (_AVR_STEPPER_COUNTER(s, _off), _AVR_STEPPER_COUNTER(m, _ctc_ocra));
+#ifdef CALL_stepper_done
+			stepper_done();
+#endif
+			return;
+		}
+		Move const &m = queue[queue_head];
+		uint8_t dir = m.dir ^ dir_invert;
+		for (uint8_t i = 0; i < STEPPER_AXES; ++i) {
+			if (dir & (1 << i))
+				*dir_port[i] |= dir_mask[i];
+			else
+				*dir_port[i] &= ~dir_mask[i];
+			error[i] = m.total >> 1;
+		}
+		// Without acceleration, min_rate is max_rate. Starting at 0
+		// would never step if the ramp is empty.
+		rate = m.min_rate;
+		phase = 0;
+		count = 0;
+		running = true;
+		// Give the driver one tick of setup time after changing direction.
+		return;
+	}
+	Move const &m = queue[queue_head];
+	if (count < m.accel_until) {
+		rate += m.accel;
+		if (rate > m.max_rate)
+			rate = m.max_rate;
+	}
+	else if (count >= m.decel_from) {
+		if (rate > m.min_rate + m.accel)
+			rate -= m.accel;
+		else
+			rate = m.min_rate;
+	}
+	uint32_t old = phase;
+	phase += rate;
+	if (phase >= old)
+		return;
+	++count;
+	for (uint8_t i = 0; i < STEPPER_AXES; ++i) {
+		error[i] += m.steps[i];
+		if (error[i] < m.total)
+			continue;
+		error[i] -= m.total;
+		*step_port[i] |= step_mask[i];
+		if (m.dir & (1 << i))
+			--current_position[i];
+		else
+			++current_position[i];
+	}
+	if (count >= m.total) {
+		running = false;
+		uint8_t head = queue_head + 1;
+		queue_head = head >= STEPPER_QUEUE_SIZE ? 0 : head;
+		queue_used = queue_used - 1;
+	}
+} // }}}
+
+ISR(_AVR_STEPPER_CAT(TIMER, STEPPER_COUNTER, _COMPB_vect)) { // {{{
+	// End all step pulses.
+	for (uint8_t i = 0; i < STEPPER_AXES; ++i)
+		*Stepper::step_port[i] &= ~Stepper::step_mask[i];
+} // }}}
+/// @endcond
+
+#endif
+
+#endif
+
+// vim: set foldmethod=marker :
@@ -7,6 +7,13 @@
 // CALL_twi_partial_slave
 // TWI_MASTER_TX_SIZE
 // TWI_ADDRESS
+// TWI_SLAVE_REGS
+// CALL_twi_regs_written
+// TWI_QUEUE_SIZE
+// CALL_twi_transaction_done
+// TWI_TIMEOUT
+// TWI_RETRIES
+// CALL_twi_error
 
 #ifndef _AVR_TWI_HH
 #define _AVR_TWI_HH
@@ -14,6 +21,32 @@
 /**
  * @file
  * Two wire interface
+ *
+ * For reading and writing registers of devices on the bus, define
+ * TWI_QUEUE_SIZE. Transactions are then queued with read_regs() and
+ * write_regs() and run entirely from the interrupt handler, one after
+ * another, with a repeated start in between.
+ * ```
+ * #define TWI_QUEUE_SIZE 4
+ * #define CALL_twi_transaction_done
+ * #include <amat.hh>
+ *
+ * static uint8_t accel[6];
+ * static Twi::Transaction accel_read;
+ *
+ * void setup() {
+ * 	Twi::enable();
+ * 	sei();
+ * 	// Read 6 registers, starting at 0x3b, from device 0x68.
+ * 	Twi::read_regs(&accel_read, 0x68, 0x3b, accel, 6);
+ * }
+ *
+ * void twi_transaction_done(Twi::Transaction *transaction) {
+ * 	if (transaction->status == Twi::STATUS_DONE) {
+ * 		// Use the data in accel.
+ * 	}
+ * }
+ * ```
 
  * @author Bas Wijnen <wijnen@debian.org>
  */
@@ -36,6 +69,16 @@
  */
 #define TWI_ADDRESS
 
+/// Answer requests as a device with a register map.
+/**
+ * If this is defined, the slave does not use twi_rx(). Instead, the first
+ * byte that a master writes sets the register pointer, further written bytes
+ * are stored in consecutive registers and reads return consecutive
+ * registers. The register map is set with Twi::slave_regs() or
+ * Twi::slave_regs_P().
+ */
+#define TWI_SLAVE_REGS
+
 #endif
 
 #ifdef AVR_TEST_TWI
@@ -62,14 +105,58 @@ namespace Twi {
 static void twi_master_done();
 #endif
 
-#ifdef TWI_ADDRESS
+#if defined(TWI_ADDRESS) && !defined(TWI_SLAVE_REGS)
 /// User code needs to define this if TWI_ADDRESS is defined. It is called when a packet is received for this device.
 /**
- * This function must store the reply in the Twi::rx_reply stream buffer.
+ * The packet is in the Twi::rx stream buffer. This function must store the
+ * reply in the Twi::rx_reply stream buffer. It is sent to the master when it
+ * reads from this device.
  */
 static void twi_rx();
 #endif
 
+#ifdef CALL_twi_regs_written
+/// User code needs to define this if CALL_twi_regs_written is defined. It is called when the master has written to the register map.
+/**
+ * @param first First register that was written.
+ * @param len Number of registers that were written.
+ */
+static void twi_regs_written(uint8_t first, uint8_t len);
+#endif
+
+#ifdef DOXYGEN
+/// Maximum duration of a master transaction, in system clock units.
+/**
+ * If this is defined, Twi::poll() must be called regularly. When a
+ * transaction takes longer than this, the bus is recovered by clocking SCL
+ * until the slave releases SDA, and the transaction is aborted.
+ *
+ * This requires a system clock.
+ */
+#define TWI_TIMEOUT
+#endif
+
+#ifndef TWI_RETRIES
+/// Number of times a master transaction is retried after losing arbitration or a bus error.
+#define TWI_RETRIES 8
+#endif
+
+#ifdef CALL_twi_error
+/// User code needs to define this if CALL_twi_error is defined. It is called when a master transaction is aborted.
+/**
+ * @param error The reason, one of Twi::Error.
+ */
+static void twi_error(uint8_t error);
+#endif
+
+#if defined(TWI_TIMEOUT) && !defined(_AVR_SYSTEM_CLOCK_HAVE_DEFAULT)
+#error "TWI_TIMEOUT requires a system clock"
+#endif
+
+#if defined(TWI_SLAVE_REGS) && !defined(TWI_ADDRESS)
+#error "TWI_SLAVE_REGS requires TWI_ADDRESS"
+#endif
+
 #ifdef CALL_twi_failed
 /// User code needs to defined this if CALL_twi_failed is defined. It is called when a NACK is received on a SLA+W request.
 static void twi_failed();
@@ -87,9 +174,46 @@ static void twi_partial_slave(uint8_t len);
 
 #ifndef TWI_BAUD
 /// Set the Twi baud rate for master operations
+/**
+ * The bit rate register and prescaler are computed at compile time; the
+ * SCL frequency is at most this value. A static_assert fails if it can not
+ * be reached with the current F_CPU.
+ *
+ * Common values are 100000 (standard mode), 400000 (fast mode) and 1000000
+ * (fast mode plus). Note that the datasheets only specify operation up to
+ * 400 kHz. At 16 MHz, 1 MHz is reached with TWBR = 0, at 20 MHz with
+ * TWBR = 2; whether it works depends on the bus capacitance and pullups.
+ */
 #define TWI_BAUD 16384
 #endif
 
+#ifdef DOXYGEN
+/// The value that was selected for TWBR.
+#define TWI_TWBR
+/// The prescaler that was selected: 1, 4, 16 or 64.
+#define TWI_PRESCALER
+/// The SCL frequency that is actually generated, in Hz.
+#define TWI_ACTUAL_BAUD
+#else
+/// @cond
+// SCL = F_CPU / (16 + 2 * TWBR * prescaler)
+// TWBR for a prescaler, rounded up so SCL does not exceed TWI_BAUD.
+#define _AVR_TWI_TWBR(prescaler) ((uint32_t(F_CPU) - 16 * uint32_t(TWI_BAUD) + 2 * (prescaler) * uint32_t(TWI_BAUD) - 1) / (2 * (prescaler) * uint32_t(TWI_BAUD)))
+// Value for TWPS: the smallest prescaler that makes TWBR fit in 8 bits.
+#define _AVR_TWI_TWPS ( \
+	_AVR_TWI_TWBR(1) < 0x100 ? 0 : \
+	_AVR_TWI_TWBR(4) < 0x100 ? 1 : \
+	_AVR_TWI_TWBR(16) < 0x100 ? 2 : 3)
+#define TWI_PRESCALER (1 << (2 * _AVR_TWI_TWPS))
+#define TWI_TWBR _AVR_TWI_TWBR(TWI_PRESCALER)
+#define TWI_ACTUAL_BAUD (uint32_t(F_CPU) / (16 + 2 * uint32_t(TWI_TWBR) * TWI_PRESCALER))
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE) || defined(TWI_ADDRESS)
+static_assert(uint32_t(F_CPU) >= 16 * uint32_t(TWI_BAUD), "TWI_BAUD is too high for F_CPU");
+static_assert(_AVR_TWI_TWBR(64) < 0x100, "TWI_BAUD is too low for F_CPU");
+#endif
+/// @endcond
+#endif
+
 #ifndef TWI_ADDRESS_MASK
 /// Address mask for Twi interface.
 /**
@@ -99,6 +223,28 @@ static void twi_partial_slave(uint8_t len);
 #define TWI_ADDRESS_MASK 0
 #endif
 
+#ifdef DOXYGEN
+/// Number of register transactions that can be queued; defining this enables read_regs() and write_regs().
+/**
+ * This can not be combined with TWI_MASTER_TX_SIZE.
+ */
+#define TWI_QUEUE_SIZE
+#endif
+
+#if defined(TWI_QUEUE_SIZE) && defined(TWI_MASTER_TX_SIZE)
+#error "TWI_QUEUE_SIZE and TWI_MASTER_TX_SIZE can not be used together"
+#endif
+
+#ifdef CALL_twi_transaction_done
+/// @cond
+namespace Twi {
+	struct Transaction;
+}
+/// @endcond
+/// User code needs to define this if CALL_twi_transaction_done is defined. It is called from the interrupt when a queued transaction is finished.
+static void twi_transaction_done(Twi::Transaction *transaction);
+#endif
+
 #ifdef DOXYGEN
 #ifndef TWI_MASTER_TX_SIZE
 /// Set Twi transmit buffer size.
@@ -152,27 +298,36 @@ namespace Twi {
 
 #endif
 
+#ifdef TWI_QUEUE_SIZE
+	static volatile bool _queue_active;
+#endif
+
 #ifdef TWI_ADDRESS
-	STREAM_BUFFER(rx, TWI_SLAVE_RX_SIZE)
-	STREAM_BUFFER(rx_reply, TWI_SLAVE_TX_SIZE)
+#ifdef TWI_SLAVE_REGS
+	static uint8_t *_regs;
+	static uint8_t _regs_size;
+	static uint8_t const *_regs_read_mask;
+	static uint8_t const *_regs_write_mask;
+	static bool _regs_progmem;
+	static volatile uint8_t _regs_pointer;
+	// Set after the register pointer has been received in a write.
+	static bool _regs_have_pointer;
+	static uint8_t _regs_first;
+	static uint8_t _regs_written;
+#else
+	STREAM_BUFFER(rx, TWI_RX_SIZE)
+	STREAM_BUFFER(rx_reply, TWI_REPLY_SIZE)
+	// Position in rx_reply while sending.
+	static uint8_t _reply_pos;
+#endif
 #endif
 /// @endcond
 
 	/// Enable Twi.
 	static inline void enable() { // {{{
-		// SCL = F_CPU / (16 + 2 * TWBR * prescale)
-		// TWBR * prescale = F_CPU / (2 * SCL) - 8
-		uint16_t target_baud = F_CPU / (2L * TWI_BAUD) - 8;
-		uint8_t shift;
-		for (shift = 0; shift < 3; ++shift) {
-			if (target_baud < uint16_t(256) << (2 * shift))
-				break;
-		}
-		TWSR = shift;
-		if (target_baud >= uint16_t(256) << (2 * shift))
-			TWBR = 0xff;
-		else
-			TWBR = target_baud >> (2 * shift);
+		// The values are computed at compile time.
+		TWSR = _AVR_TWI_TWPS;
+		TWBR = TWI_TWBR;
 #ifdef TWI_ADDRESS
 		TWAR = TWI_ADDRESS;
 		TWAMR = TWI_ADDRESS_MASK;
@@ -181,6 +336,9 @@ namespace Twi {
 #endif
 #ifdef TWI_MASTER_TX_SIZE
 		busy = false;
+#endif
+#ifdef TWI_QUEUE_SIZE
+		_queue_active = false;
 #endif
 		// Clear interrupt, enable acknowledge, do not send start or stop, enable Twi, Enable Twi interrupt.
 		TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
@@ -192,7 +350,36 @@ namespace Twi {
 	} // }}}
 	// Master commands.
 
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE) || defined(DOXYGEN)
+	/// Reason for aborting a master transaction.
+	enum Error {
+		/// The transaction took longer than TWI_TIMEOUT; the bus has been recovered.
+		ERROR_TIMEOUT,
+		/// Arbitration was lost more than TWI_RETRIES times.
+		ERROR_ARBITRATION,
+		/// A bus error occurred more than TWI_RETRIES times.
+		ERROR_BUS,
+		/// The transaction timed out and SDA is still held low after recovery.
+		ERROR_STUCK
+	};
+#endif
+
 	/// @cond
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE)
+	// Number of times the current transaction has been retried.
+	static uint8_t _retries;
+#ifdef TWI_TIMEOUT
+	static decltype(Counter::get_time()) _start_time;
+#endif
+
+	static inline void _transaction_begin() { // {{{
+		_retries = 0;
+#ifdef TWI_TIMEOUT
+		_start_time = Counter::get_time();
+#endif
+	} // }}}
+#endif
+
 #ifdef TWI_MASTER_TX_SIZE
 	static inline void try_transmit(bool check_busy) { // {{{
 		// A new packet is available in the master transmit buffer.
@@ -201,21 +388,402 @@ namespace Twi {
 				return;
 			busy = true;
 		}
+		_transaction_begin();
 		target = tx_read(0);
 		len = tx_read(1);
 		TWCR = 0xe5;	// Send start.
 	} // }}}
 #endif
 	/// @endcond
+
+#if defined(TWI_QUEUE_SIZE) || defined(DOXYGEN)
+	// Register transactions. {{{
+
+	/// Result of a queued transaction.
+	enum Status {
+		/// The transaction is queued or running.
+		STATUS_PENDING,
+		/// The transaction was completed.
+		STATUS_DONE,
+		/// The device did not acknowledge its address.
+		STATUS_NACK,
+		/// The device did not acknowledge a data byte.
+		STATUS_DATA_NACK,
+		/// The transaction was aborted with Twi::ERROR_TIMEOUT.
+		STATUS_TIMEOUT,
+		/// The transaction was aborted with Twi::ERROR_ARBITRATION.
+		STATUS_ARBITRATION,
+		/// The transaction was aborted with Twi::ERROR_BUS.
+		STATUS_BUS_ERROR,
+		/// The transaction was aborted with Twi::ERROR_STUCK.
+		STATUS_STUCK
+	};
+
+	/// Register read or write on a device.
+	/**
+	 * This is filled in by read_regs() or write_regs(). It is not copied,
+	 * so it must stay valid until the transaction is finished.
+	 */
+	struct Transaction {
+		/// 7 bit address of the device.
+		uint8_t address;
+		/// First register.
+		uint8_t reg;
+		/// Destination for read data, or source of written data.
+		uint8_t *data;
+		/// Number of registers to transfer.
+		uint8_t len;
+		/// True for a read transaction.
+		bool read;
+		/// Free for use by user code, for example to tell transactions apart in twi_transaction_done().
+		uint8_t id;
+		/// Status of the transaction.
+		volatile uint8_t status;
+	};
+
+/// @cond
+	static Transaction *_queue[TWI_QUEUE_SIZE];
+	static volatile uint8_t _queue_head;
+	static volatile uint8_t _queue_used;
+	// Number of data bytes transferred in the current transaction.
+	static uint8_t _queue_pos;
+	// Set after the register has been sent for a read, so the repeated
+	// start is followed by SLA+R.
+	static bool _queue_rx_phase;
+
+	// Start the current transaction from the beginning.
+	static inline void _queue_restart() { // {{{
+		_queue_pos = 0;
+		_queue_rx_phase = false;
+		TWCR = 0xe5;	// Send (repeated) start.
+	} // }}}
+
+	static inline void _queue_start() { // {{{
+		_queue_active = true;
+		_transaction_begin();
+		_queue_restart();
+	} // }}}
+
+	// Finish the current transaction and start the next one.
+	// If there is no next one, TWCR is set to idle.
+	static inline void _queue_finish(uint8_t status, uint8_t idle = 0xd5) { // {{{
+		Transaction *t = _queue[_queue_head];
+		_queue_head = _queue_head + 1 < TWI_QUEUE_SIZE ? _queue_head + 1 : 0;
+		--_queue_used;
+		t->status = status;
+#ifdef CALL_twi_transaction_done
+		twi_transaction_done(t);
+#endif
+		if (_queue_used > 0)
+			_queue_start();
+		else {
+			_queue_active = false;
+			TWCR = idle;
+		}
+	} // }}}
+
+	static inline bool _queue_add(Transaction *transaction) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		if (_queue_used >= TWI_QUEUE_SIZE) {
+			SREG = sreg;
+			return false;
+		}
+		transaction->status = STATUS_PENDING;
+		uint8_t slot = _queue_head + _queue_used;
+		if (slot >= TWI_QUEUE_SIZE)
+			slot -= TWI_QUEUE_SIZE;
+		_queue[slot] = transaction;
+		++_queue_used;
+		// From the callback, the next transaction is started after it returns.
+		if (!_queue_active && _queue_used == 1)
+			_queue_start();
+		SREG = sreg;
+		return true;
+	} // }}}
+/// @endcond
+
+	/// Queue reading registers from a device.
+	/**
+	 * The register number is written to the device, followed by a
+	 * repeated start and reading len bytes into dst. When the transaction
+	 * is finished, its status is set and twi_transaction_done() is called
+	 * from the interrupt, if CALL_twi_transaction_done is defined.
+	 *
+	 * @param transaction Storage for the transaction.
+	 * @param address 7 bit address of the device.
+	 * @param reg First register to read.
+	 * @param dst Destination for the data.
+	 * @param len Number of bytes to read; at least 1.
+	 * @param id Value for the id member of transaction.
+	 * @return false if the queue is full.
+	 */
+	static inline bool read_regs(Transaction *transaction, uint8_t address, uint8_t reg, uint8_t *dst, uint8_t len, uint8_t id = 0) { // {{{
+		transaction->address = address;
+		transaction->reg = reg;
+		transaction->data = dst;
+		transaction->len = len;
+		transaction->read = true;
+		transaction->id = id;
+		return _queue_add(transaction);
+	} // }}}
+
+	/// Queue writing registers to a device.
+	/**
+	 * The register number is written to the device, followed by len
+	 * bytes from src. Otherwise this works like read_regs().
+	 *
+	 * @return false if the queue is full.
+	 */
+	static inline bool write_regs(Transaction *transaction, uint8_t address, uint8_t reg, uint8_t const *src, uint8_t len, uint8_t id = 0) { // {{{
+		transaction->address = address;
+		transaction->reg = reg;
+		transaction->data = const_cast <uint8_t *>(src);
+		transaction->len = len;
+		transaction->read = false;
+		transaction->id = id;
+		return _queue_add(transaction);
+	} // }}}
+
+	/// Return the number of queued transactions, including the one that is running.
+	static inline uint8_t queue_used() { return _queue_used; }
+
+	// }}}
+#endif
+
+/// @cond
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE)
+	// Error handling. {{{
+
+	// Abort the current master transaction and start the next one.
+	// If there is no next one, TWCR is set to idle.
+	static inline void _abort(uint8_t error, uint8_t idle) { // {{{
+#ifdef CALL_twi_error
+		twi_error(error);
+#endif
+#ifdef TWI_MASTER_TX_SIZE
+		// The packet has already been removed if the reply was being read.
+		if (!(target & 1))
+			tx_pop();
+		busy = false;
+		if (tx_packets_available() > 0)
+			try_transmit();
+		else
+			TWCR = idle;
+#else
+		_queue_finish(STATUS_TIMEOUT + error, idle);
+#endif
+	} // }}}
+
+	// Handle arbitration loss or bus error: retry or abort.
+	static inline void _retry(uint8_t error, uint8_t idle) { // {{{
+		if (++_retries > TWI_RETRIES) {
+			_abort(error, idle);
+			return;
+		}
+#ifdef TWI_MASTER_TX_SIZE
+		TWCR = 0xe5;
+#else
+		_queue_restart();
+#endif
+	} // }}}
+
+	static inline bool _master_active() { // {{{
+#ifdef TWI_MASTER_TX_SIZE
+		return busy;
+#else
+		return _queue_active;
+#endif
+	} // }}}
+
+	// Release the bus by clocking SCL until the slave lets go of SDA, then send a stop.
+	// Twi must be disabled. Return true if SDA is released.
+	static inline bool _bus_clear() { // {{{
+		Gpio::input(PIN_SDA, true);
+		Gpio::input(PIN_SCL, true);
+		for (uint8_t i = 0; i < 9 && !Gpio::read(PIN_SDA); ++i) {
+			Gpio::write(PIN_SCL, false);
+			_delay_us(5);
+			Gpio::input(PIN_SCL, true);
+			_delay_us(5);
+		}
+		Gpio::write(PIN_SCL, false);
+		Gpio::write(PIN_SDA, false);
+		_delay_us(5);
+		Gpio::input(PIN_SCL, true);
+		_delay_us(5);
+		Gpio::input(PIN_SDA, true);
+		_delay_us(5);
+		return Gpio::read(PIN_SDA);
+	} // }}}
+
+	// }}}
+#endif
+/// @endcond
+
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE) || defined(DOXYGEN)
+	/// Recover the bus and abort the current master transaction, if any.
+	/**
+	 * Twi is disabled, SCL is clocked up to 9 times until the slave releases
+	 * SDA and a stop condition is sent. Then Twi is enabled again. A running
+	 * transaction is aborted with Twi::ERROR_TIMEOUT, or Twi::ERROR_STUCK if
+	 * SDA is still low; the next one is started.
+	 *
+	 * @return true if SDA has been released.
+	 */
+	static inline bool recover() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		TWCR = 0;
+		bool released = _bus_clear();
+		TWCR = _BV(TWINT) | _BV(TWEA) | _BV(TWEN) | _BV(TWIE);
+		if (_master_active())
+			_abort(released ? ERROR_TIMEOUT : ERROR_STUCK, 0xc5);
+		SREG = sreg;
+		return released;
+	} // }}}
+#endif
+
+#if defined(TWI_TIMEOUT) || defined(DOXYGEN)
+	/// Check for a master transaction that takes too long.
+	/**
+	 * This must be called regularly, for example from loop(), if
+	 * TWI_TIMEOUT is defined. When the running transaction has taken
+	 * TWI_TIMEOUT or longer, recover() is called.
+	 */
+	static inline void poll() { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		bool expired = _master_active() && decltype(Counter::get_time())(Counter::get_time() - _start_time) >= TWI_TIMEOUT;
+		SREG = sreg;
+		if (expired)
+			recover();
+	} // }}}
+#endif
+
+#if defined(TWI_SLAVE_REGS) || defined(DOXYGEN)
+	// Slave register map. {{{
+
+	/// Use a register map in RAM for slave requests.
+	/**
+	 * The registers are read and written directly by the interrupt
+	 * handler; they are not copied. Reads past the end of the map return
+	 * 0xff, writes past the end are not acknowledged.
+	 *
+	 * @param regs The registers.
+	 * @param size Number of registers.
+	 * @param write_mask Optional array in PROGMEM with size elements; only
+	 * bits that are set in it can be changed by the master.
+	 * @param read_mask Optional array in PROGMEM with size elements; bits
+	 * that are not set in it are read as 0.
+	 */
+	static inline void slave_regs(uint8_t *regs, uint8_t size, uint8_t const *write_mask = NULL, uint8_t const *read_mask = NULL) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_regs = regs;
+		_regs_size = size;
+		_regs_write_mask = write_mask;
+		_regs_read_mask = read_mask;
+		_regs_progmem = false;
+		_regs_pointer = 0;
+		SREG = sreg;
+	} // }}}
+
+	/// Use a read only register map in PROGMEM for slave requests.
+	/**
+	 * Writes from the master only set the register pointer.
+	 */
+	static inline void slave_regs_P(uint8_t const *regs, uint8_t size, uint8_t const *read_mask = NULL) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		_regs = const_cast <uint8_t *>(regs);
+		_regs_size = size;
+		_regs_write_mask = NULL;
+		_regs_read_mask = read_mask;
+		_regs_progmem = true;
+		_regs_pointer = 0;
+		SREG = sreg;
+	} // }}}
+
+	/// Get the register that will be used by the next access of the master.
+	static inline uint8_t slave_pointer() { return _regs_pointer; }
+
+/// @cond
+	static inline uint8_t _regs_get() { // {{{
+		uint8_t p = _regs_pointer;
+		if (p >= _regs_size)
+			return 0xff;
+		_regs_pointer = p + 1;
+		uint8_t value = _regs_progmem ? pgm_read_byte(&_regs[p]) : _regs[p];
+		if (_regs_read_mask)
+			value &= pgm_read_byte(&_regs_read_mask[p]);
+		return value;
+	} // }}}
+
+	// Store a byte from the master; return whether another byte can be accepted.
+	static inline bool _regs_put(uint8_t value) { // {{{
+		if (!_regs_have_pointer) {
+			_regs_have_pointer = true;
+			_regs_pointer = value;
+			_regs_first = value;
+		}
+		else {
+			uint8_t p = _regs_pointer;
+			if (_regs_write_mask) {
+				uint8_t mask = pgm_read_byte(&_regs_write_mask[p]);
+				value = (_regs[p] & ~mask) | (value & mask);
+			}
+			_regs[p] = value;
+			_regs_pointer = p + 1;
+			++_regs_written;
+		}
+		return !_regs_progmem && _regs_pointer < _regs_size;
+	} // }}}
+
+	static inline void _regs_done() { // {{{
+		if (_regs_written > 0) {
+#ifdef CALL_twi_regs_written
+			twi_regs_written(_regs_first, _regs_written);
+#endif
+			_regs_written = 0;
+		}
+	} // }}}
+/// @endcond
+
+	// }}}
+#endif
+
+/// @cond
+#ifdef TWI_ADDRESS
+	// TWCR value for leaving slave mode; if a master transaction lost arbitration, it is retried.
+	static inline uint8_t _slave_done() { // {{{
+#if defined(TWI_MASTER_TX_SIZE)
+		if (busy)
+			return 0xe5;
+#elif defined(TWI_QUEUE_SIZE)
+		if (_queue_active) {
+			_queue_pos = 0;
+			_queue_rx_phase = false;
+			return 0xe5;	// Restart the transaction.
+		}
+#endif
+		return 0xc5;
+	} // }}}
+#endif
+/// @endcond
 }
 
 /// @cond
 // Interrupt handling.
-#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_ADDRESS)
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE) || defined(TWI_ADDRESS)
 ISR(TWI_vect) { // {{{
 	switch(TWSR & 0xf8) {
 		case 0x00:	// Bus error. {{{
 			TWCR = 0xd5;	// Send fake stop to clear error condition; no stop is sent on the bus.
+#if defined(TWI_MASTER_TX_SIZE) || defined(TWI_QUEUE_SIZE)
+			if (Twi::_master_active())
+				Twi::_retry(Twi::ERROR_BUS, 0xd5);
+#endif
 			break;
 		// }}}
 
@@ -290,7 +858,8 @@ ISR(TWI_vect) { // {{{
 
 		case 0x38:	// arbitration lost during transmission of SLA+W, SLA+R, NACK, or data. {{{
 			// Retry sending start. This will happen at some point when the line is available again.
-			TWCR = 0xe5;
+			// The bus is not ours, so do not send a stop when giving up.
+			Twi::_retry(Twi::ERROR_ARBITRATION, 0xc5);
 			break;
 		// }}}
 
@@ -343,88 +912,188 @@ ISR(TWI_vect) { // {{{
 		// }}}
 #endif
 
+#ifdef TWI_QUEUE_SIZE
+			// Master register transactions.
+
+		// 0x08, 0x10: (Repeated) start has been transmitted. {{{
+		case 0x08:	// Start has been transmitted.
+		case 0x10:	// Repeated start has been transmitted.
+		{
+			Twi::Transaction *t = Twi::_queue[Twi::_queue_head];
+			TWDR = (t->address << 1) | (Twi::_queue_rx_phase ? 1 : 0);
+			TWCR = 0xc5;	// Clear start condition.
+			break;
+		}
+		// }}}
+
+		case 0x18:	// SLA+W has been transmitted, ACK has been received. {{{
+			TWDR = Twi::_queue[Twi::_queue_head]->reg;
+			TWCR = 0xc5;
+			break;
+		// }}}
+
+		case 0x28:	// data has been transmitted, ACK has been received. {{{
+		{
+			Twi::Transaction *t = Twi::_queue[Twi::_queue_head];
+			if (t->read) {
+				// Register has been sent; switch to reading.
+				Twi::_queue_rx_phase = true;
+				TWCR = 0xe5;	// Send repeated start.
+				break;
+			}
+			if (Twi::_queue_pos < t->len) {
+				TWDR = t->data[Twi::_queue_pos++];
+				TWCR = 0xc5;
+				break;
+			}
+			Twi::_queue_finish(Twi::STATUS_DONE);
+			break;
+		}
+		// }}}
+
+		case 0x30:	// data has been transmitted, NACK has been received. {{{
+		{
+			// A NACK on the last byte is allowed.
+			Twi::Transaction *t = Twi::_queue[Twi::_queue_head];
+			bool complete = !t->read && Twi::_queue_pos == t->len;
+			Twi::_queue_finish(complete ? Twi::STATUS_DONE : Twi::STATUS_DATA_NACK);
+			break;
+		}
+		// }}}
+
+		case 0x20:	// SLA+W has been transmitted, NACK has been received.
+		case 0x48:	// SLA+R has been transmitted, NACK has been received. {{{
+			Twi::_queue_finish(Twi::STATUS_NACK);
+			break;
+		// }}}
+
+		case 0x38:	// arbitration lost during transmission of SLA+W, SLA+R, NACK, or data. {{{
+			// Retry sending start. This will happen at some point when the line is available again.
+			// The bus is not ours, so do not send a stop when giving up.
+			Twi::_retry(Twi::ERROR_ARBITRATION, 0xc5);
+			break;
+		// }}}
+
+		case 0x40:	// SLA+R has been transmitted, ACK has been received. {{{
+			// NACK the byte if it is the last one.
+			TWCR = Twi::_queue[Twi::_queue_head]->len <= 1 ? 0x85 : 0xc5;
+			break;
+		// }}}
+
+		case 0x50:	// data has been received, ACK has been sent. {{{
+		{
+			Twi::Transaction *t = Twi::_queue[Twi::_queue_head];
+			t->data[Twi::_queue_pos++] = TWDR;
+			TWCR = Twi::_queue_pos + 1 >= t->len ? 0x85 : 0xc5;
+			break;
+		}
+		// }}}
+
+		case 0x58:	// data has been received, NACK has been sent. {{{
+			Twi::_queue[Twi::_queue_head]->data[Twi::_queue_pos++] = TWDR;
+			Twi::_queue_finish(Twi::STATUS_DONE);
+			break;
+		// }}}
+#endif
+
 #ifdef TWI_ADDRESS
 			// Slave receive
 
-		// 0x60, 0x68, 0x70, 0x78: Own SLA+W, general call, or data has been received, ACK has been sent. {{{
+		// 0x60, 0x68, 0x70, 0x78: Own SLA+W or general call has been received, ACK has been sent. {{{
 		case 0x60:	// SLA+W has been received for client address; ACK has been sent.
 		case 0x68:	// Arbitration lost; SLA+W has been received for client address; ACK has been sent.
 		case 0x70:	// SLA+W has been received for general address; ACK has been sent.
 		case 0x78:	// Arbitration lost; SLA+W has been received for general address; ACK has been sent.
+#ifdef TWI_SLAVE_REGS
+			Twi::_regs_have_pointer = false;
+			Twi::_regs_written = 0;
+#else
 			Twi::rx_reset();
+#endif
+			TWCR = 0xc5;
+			break;
 		// }}}
-			// Fall through.
+
 		// 0x80, 0x90: Data has been received, ACK has been sent. {{{
 		case 0x80:	// While receiving client data, data has been received, ACK has been sent.
 		case 0x90:	// While receiving general data, data has been received, ACK has been sent.
-			Twi::rx_read(TWDR);
-			if (Twi::rx_buffer_available() == 1)
-				TWCR = 0x85;
-			else
-				TWCR = 0xc5;
+#ifdef TWI_SLAVE_REGS
+			// NACK the next byte if it cannot be stored.
+			TWCR = Twi::_regs_put(TWDR) ? 0xc5 : 0x85;
+#else
+			Twi::rx_write(TWDR);
+			// NACK the next byte if it fills the buffer.
+			TWCR = Twi::rx_buffer_available() <= 1 ? 0x85 : 0xc5;
+#endif
 			break;
 		// }}}
 
 		// 0x88, 0x98: Data has been received, NACK has been sent. {{{
 		case 0x88:	// While receiving client data, data has been received, NACK has been sent.
 		case 0x98:	// While receiving general data, data has been received, NACK has been sent.
-			Twi::rx_read(TWDR);
+#ifndef TWI_SLAVE_REGS
+			Twi::rx_write(TWDR);
+#endif
+			// For a register map, the byte does not fit and is discarded.
 		// }}}
 			// Fall through.
 		case 0xa0:	// While receiving data, STOP or REPEATED START has been received. {{{
+#ifdef TWI_SLAVE_REGS
+			Twi::_regs_done();
+#else
+			Twi::rx_reply_reset();
 			twi_rx();
-			if (Twi::tx_packets_available() > 0)
-				TWCR = 0xe5;
-			else
-				TWCR = 0xc5;
+#endif
+			TWCR = Twi::_slave_done();
 			break;
 		// }}}
 
 			// Slave send
 
-		// 0xa8, 0xb0: SLA+R has been received, ACK has been sent. {{{
+		// 0xa8, 0xb0, 0xb8: SLA+R has been received or data has been transmitted, ACK has been received. {{{
 		case 0xa8:	// SLA+R has been received for client address; ACK has been sent.
 		case 0xb0:	// Arbitration lost; SLA+R has been received for client address; ACK has been sent.
+#ifndef TWI_SLAVE_REGS
+			Twi::_reply_pos = 0;
+#endif
+			// Fall through.
+		case 0xb8:	// Data has been transmitted in response to SLA+R; ACK has been received.
+#ifdef TWI_SLAVE_REGS
+			TWDR = Twi::_regs_get();
+			TWCR = 0xc5;
+#else
 		{
-			Twi::current = 1;
-			uint8_t used = Twi::rx_buffer_used();
-			TWDR = (used > 0 ? Twi::rx_read(0) : 0xff);
-			uint8_t start = (Twi::tx_packets_available() > 0 ? 0x20 : 0)
-			if (used <= 1)
-				TWCR = 0x85 | start;
-			else
-				TWCR = 0xc5 | start;
-		} // }}}
-
-		case 0xb8:	// Data has been transmitted in response to SLA+R; ACK has been received. {{{
-		{
-			TWDR = Twi::rx_read(Twi::current++);
-			uint8_t start = (Twi::tx_packets_available() > 0 ? 0x20 : 0)
-			if (Twi::current + 1 >= Twi::rx_buffer_used())
-				TWCR = 0x85 | start;
-			else
-				TWCR = 0xc5 | start;
+			uint8_t used = Twi::rx_reply_buffer_used();
+			if (Twi::_reply_pos < used) {
+				TWDR = Twi::rx_reply_read(Twi::_reply_pos++);
+				// Clear TWEA for the last byte.
+				TWCR = Twi::_reply_pos < used ? 0xc5 : 0x85;
+			}
+			else {
+				// No reply available; send 0xff.
+				TWDR = 0xff;
+				TWCR = 0x85;
+			}
 		}
+#endif
+			break;
 		// }}}
 
 		case 0xc0:	// Data has been transmitted in response to SLA+R; NACK has been received. {{{
-		{
-			TWDR = Twi::rx_read(Twi::current++);
-#ifdef CALL_twi_partial_slave
-			if (Twi::current < Twi::rx_buffer_used()) {
-				twi_partial_slave(Twi::current);
+#if !defined(TWI_SLAVE_REGS) && defined(CALL_twi_partial_slave)
+			if (Twi::_reply_pos < Twi::rx_reply_buffer_used()) {
+				twi_partial_slave(Twi::_reply_pos);
 				// Slave cannot do any recovery, so just accept it.
 			}
 #endif
-			uint8_t start = (Twi::tx_packets_available() > 0 ? 0x20 : 0)
-			TWCR = 0xc5 | start;
-		} // }}}
+			TWCR = Twi::_slave_done();
+			break;
+		// }}}
 
 		case 0xc8:	// Last data byte has been transmitted in response to SLA+R; ACK has been received. {{{
-		{
-			uint8_t start = (Twi::tx_packets_available() > 0 ? 0x20 : 0)
-			TWCR = 0xc5 | start;
-		} // }}}
+			TWCR = Twi::_slave_done();
+			break;
+		// }}}
 #endif
 
 		default:
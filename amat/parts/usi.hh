@@ -14,6 +14,12 @@
 // USI_ENABLE_TWI_MASTER
 // USI_ENABLE_TWI_SLAVE
 // USI_ENABLE_UART_TX	Enable 6n1 serial output
+// USI_ENABLE_UART_RX	Enable 8n1 serial input
+// USI_SPI_CS		Chip select pin, only used for SPI master
+// USI_SPI_SS		Slave select pin, required for SPI slave
+// USI_SPI_SS_PCINT	Pin change interrupt of USI_SPI_SS
+// USI_UART_BAUD
+// USI_UART_LATENCY
 // USI_TWI_ADDRESS	Only used for TWI slave
 // USI_TWI_ADDRESS_MASK
 // USI_TX_SIZE
@@ -21,6 +27,10 @@
 // USI_RX_SIZE
 // USI_RX_PACKETS
 // CALL_usi_rx
+// CALL_usi_send_done	Only used for SPI
+// USI_TWI_BAUD		Only used for TWI master
+// USI_TWI_QUEUE_SIZE	Only used for TWI master
+// CALL_usi_transaction_done
 
 /*
    For 3-wire mode (SPI):
@@ -56,9 +66,45 @@ USICLK == 1: counter clock source is software, USITC
 static void usi_rx();
 #endif
 
+#ifdef CALL_usi_send_done
+/// User code needs to define this if CALL_usi_send_done is defined. It is called when the last packet of the SPI send buffer has been sent.
+static void usi_send_done();
+#endif
+
+#ifdef CALL_usi_transaction_done
+/// @cond
+namespace Usi {
+	struct Transaction;
+}
+/// @endcond
+/// User code needs to define this if CALL_usi_transaction_done is defined. It is called from the interrupt when a queued TWI transaction is finished.
+static void usi_transaction_done(Usi::Transaction *transaction);
+#endif
+
 /// Universal Serial Interface
 /**
- * Usi is currently not implemented, so there is also no documentation yet.
+ * With USI_ENABLE_TWI_MASTER, register transactions can be queued with
+ * read_regs() and write_regs(), like with Twi. Counter 0 generates an
+ * interrupt for every SCL edge, at twice USI_TWI_BAUD (default 20000); the
+ * clock stretching of slaves is respected. Each interrupt takes several tens
+ * of clock cycles, so high rates leave little time for the main program.
+ *
+ * With USI_ENABLE_UART_RX, 8n1 serial data at USI_UART_BAUD (default 9600)
+ * is received on DI into the Usi::rx stream buffer, like Usart::rx. This
+ * also uses Counter 0, and it defines ISR(PCINT0_vect). At 8 MHz it works up
+ * to 115200 baud.
+ *
+ * With USI_ENABLE_SPI_MASTER or USI_ENABLE_SPI_SLAVE, packets are sent and
+ * received through send_buffer and receive_buffer, like with Spi. The master
+ * clocks at half the system clock from send_buffer_end() and selects
+ * USI_SPI_CS, if defined, around each packet. The slave is interrupt driven;
+ * the master must select it with USI_SPI_SS a few microseconds before
+ * clocking and give it about 50 clock cycles for every byte. The received
+ * packets end when USI_SPI_SS goes high. USI_TX_SIZE defaults to 32 for the
+ * master; define USI_RX_SIZE (and USI_TX_SIZE for the slave) to get the
+ * buffers.
+ *
+ * The other modes are not fully implemented yet.
  */
 namespace Usi {
 	inline static void disable() { USICR &= ~(3 << USIWM0); }
@@ -66,18 +112,23 @@ namespace Usi {
 		Gpio::write(PIN_USCK, false);
 		Gpio::input(PIN_DI, false);
 		Gpio::write(PIN_DO, false);
-		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | (_BV(USIWM0) | _BV(USICS0));
+		// Clocked by software strobes; see transfer().
+		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | _BV(USIWM0);
 	}
 	inline static void enable_spi_slave() {
 		Gpio::input(PIN_USCK, false);
 		Gpio::input(PIN_DI, false);
 		Gpio::write(PIN_DO, false);
-		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | (_BV(USIWM0) | _BV(USICS1) | _BV(USICS0));
+		// Sample on the rising edge of USCK (SPI mode 0).
+		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | (_BV(USIWM0) | _BV(USICS1));
 	}
 	inline static void enable_twi_master() {
-		Gpio::write(PIN_USCK, false);
-		Gpio::write(PIN_DI, false);
-		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | (_BV(USIWM0) | _BV(USIWM1) | _BV(USICS0));
+		// Release both lines; the data register drives SDA.
+		USIDR = 0xff;
+		Gpio::write(PIN_USCK, true);
+		Gpio::write(PIN_DI, true);
+		// Two wire mode, shift on SCL, count USITC strobes.
+		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | (_BV(USIWM1) | _BV(USICS1) | _BV(USICLK));
 	}
 	inline static void enable_twi_slave() {
 		Gpio::input(PIN_USCK, false);
@@ -88,6 +139,10 @@ namespace Usi {
 		Gpio::write(PIN_DO, true);
 		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE))) | _BV(USICS0);	// Set wire mode to "Outputs"; set to 3-wire mode when sending a byte.
 	}
+	inline static void enable_uart_rx() {
+		Gpio::input(PIN_DI, true);
+		USICR = (USICR & (_BV(USISIE) | _BV(USIOIE)));	// Disabled until a start bit is seen.
+	}
 	inline static void enable_start_condition_int() { USICR |= _BV(USISIE); }
 	inline static void disable_start_condition_int() { USICR &= ~_BV(USISIE); }
 	inline static void enable_overflow_int() { USICR |= _BV(USIOIE); }
@@ -105,14 +160,529 @@ namespace Usi {
 	inline static uint8_t read_data() { return USIBR; }
 	inline static uint8_t read_raw_data() { return USIDR; }
 
+#if defined(USI_ENABLE_SPI_MASTER) || defined(USI_ENABLE_SPI_SLAVE)
+// {{{
+#ifndef USI_TX_PACKETS
+#define USI_TX_PACKETS 2
+#endif
+#ifndef USI_RX_PACKETS
+#define USI_RX_PACKETS 2
+#endif
+#ifdef USI_RX_SIZE
+/// @cond
+#ifdef CALL_usi_rx
+	PACKET_BUFFER_WITH_CBS(receive_buffer, USI_RX_SIZE, USI_RX_PACKETS, usi_rx();,)
+#else
+	PACKET_BUFFER(receive_buffer, USI_RX_SIZE, USI_RX_PACKETS)
+#endif
+/// @endcond
+#endif
+// }}}
+#endif
+
 #ifdef USI_ENABLE_SPI_MASTER
-// TODO {{{
+// {{{
+	// The clock is generated by strobing USITC, so the bus runs at half
+	// the system clock and every packet is sent before send_buffer_end()
+	// returns.
+#ifndef USI_TX_SIZE
+#define USI_TX_SIZE 32
+#endif
+	/// Send and receive one byte; this does not use the buffers.
+	static inline uint8_t transfer(uint8_t data) { // {{{
+		uint8_t const low = _BV(USIWM0) | _BV(USITC);
+		uint8_t const high = low | _BV(USICLK);
+		USIDR = data;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		USICR = low; USICR = high;
+		return USIDR;
+	} // }}}
+/// @cond
+	static inline void _flush();
+	PACKET_BUFFER_WITH_CBS(send_buffer, USI_TX_SIZE, USI_TX_PACKETS, _flush();,)
+	static bool _flushing;
+
+	static inline void _flush() { // {{{
+		// When usi_send_done() ends a new packet, this is called again
+		// and sends it; send_buffer_end() from elsewhere during a
+		// flush is picked up by the loop.
+		if (_flushing)
+			return;
+		_flushing = true;
+		while (send_buffer_first_packet != send_buffer_last_packet) {
+#ifdef USI_SPI_CS
+			Gpio::write(USI_SPI_CS, false);
+#endif
+			while (send_buffer_packet_length() > 0) {
+				uint8_t data = transfer(send_buffer_read());
+				send_buffer_partial_pop(1);
+#ifdef USI_RX_SIZE
+				if (receive_buffer_buffer_available() > 0)
+					receive_buffer_write(data);
+#else
+				(void)data;
+#endif
+			}
+#ifdef USI_SPI_CS
+			Gpio::write(USI_SPI_CS, true);
+#endif
+			send_buffer_pop();
+#ifdef USI_RX_SIZE
+			receive_buffer_end();
+#endif
+		}
+		_flushing = false;
+#ifdef CALL_usi_send_done
+		usi_send_done();
+#endif
+	} // }}}
+/// @endcond
+#ifdef USI_SPI_CS
+#define _AVR_SETUP_USI \
+	Gpio::write(USI_SPI_CS, true); \
+	Usi::enable_spi_master();
+#else
+#define _AVR_SETUP_USI \
+	Usi::enable_spi_master();
+#endif
 // }}}
 #elif defined(USI_ENABLE_SPI_SLAVE)
-// TODO {{{
+// {{{
+	// Every byte is handled by the overflow interrupt, which stores the
+	// received byte and loads the next one to send. Packets are framed by
+	// the slave select pin, which is watched with a pin change interrupt:
+	// while it is low, DO is driven and the current send packet is sent
+	// (0xff when it runs out); when it goes high the received packet is
+	// ended and the send packet is popped, also if it was not sent
+	// completely.
+#if !defined(USI_SPI_SS) || !defined(USI_SPI_SS_PCINT)
+#error "USI_ENABLE_SPI_SLAVE requires USI_SPI_SS (the slave select pin) and USI_SPI_SS_PCINT (its pin change interrupt number)"
+#endif
+/// @cond
+#if USI_SPI_SS_PCINT < 8
+#define _AVR_USI_SS_VECT PCINT0_vect
+#ifdef PCIE0
+#define _AVR_USI_PCIE PCIE0
+#else
+#define _AVR_USI_PCIE PCIE
+#endif
+#else
+#define _AVR_USI_SS_VECT PCINT1_vect
+#define _AVR_USI_PCIE PCIE1
+#endif
+	static volatile bool _selected;
+#ifdef USI_TX_SIZE
+	static volatile bool _sending;
+	static inline void _preload();
+	PACKET_BUFFER_WITH_CBS(send_buffer, USI_TX_SIZE, USI_TX_PACKETS, _preload();,)
+
+	// Load the first byte of the next packet, so it is ready when the master starts clocking.
+	static inline void _preload() { // {{{
+		if (_selected)
+			return;
+		USIDR = send_buffer_first_packet != send_buffer_last_packet && send_buffer_packet_length() > 0 ? send_buffer_read() : 0xff;
+	} // }}}
+#endif
+#ifdef USI_RX_SIZE
+	static bool _received;
+#endif
+/// @endcond
+
+	ISR(_AVR_USI_SS_VECT) {
+		// Other pins in the group trigger this too; only act on changes of slave select.
+		bool selected = !Gpio::read(USI_SPI_SS);
+		if (selected == _selected)
+			return;
+		_selected = selected;
+		if (selected) {
+			Gpio::write(PIN_DO, false);
+#ifdef USI_TX_SIZE
+			// The first byte was preloaded.
+			_sending = send_buffer_first_packet != send_buffer_last_packet && send_buffer_packet_length() > 0;
+			if (_sending)
+				send_buffer_partial_pop(1);
+#endif
+			return;
+		}
+		Gpio::input(PIN_DO, false);
+		// Drop a partially received byte.
+		USISR = _BV(USIOIF);
+#ifdef USI_RX_SIZE
+		if (_received) {
+			_received = false;
+			receive_buffer_end();
+		}
+#endif
+#ifdef USI_TX_SIZE
+		if (_sending) {
+			_sending = false;
+			send_buffer_pop();
+#ifdef CALL_usi_send_done
+			if (send_buffer_first_packet == send_buffer_last_packet)
+				usi_send_done();
+#endif
+		}
+		_preload();
+#else
+		USIDR = 0xff;
+#endif
+	}
+	ISR(USI_OVF_vect) {
+#ifdef USIBR
+		uint8_t data = USIBR;
+#else
+		uint8_t data = USIDR;
+#endif
+#ifdef USI_TX_SIZE
+		if (_sending && send_buffer_packet_length() > 0) {
+			USIDR = send_buffer_read();
+			send_buffer_partial_pop(1);
+		}
+		else
+			USIDR = 0xff;
+#else
+		USIDR = 0xff;
+#endif
+		USISR = _BV(USIOIF);
+#ifdef USI_RX_SIZE
+		if (receive_buffer_buffer_available() > 0) {
+			receive_buffer_write(data);
+			_received = true;
+		}
+#else
+		(void)data;
+#endif
+	}
+#define _AVR_SETUP_USI \
+	Usi::enable_spi_slave(); \
+	Gpio::input(PIN_DO, false); \
+	Gpio::input(USI_SPI_SS, true); \
+	USIDR = 0xff; \
+	USISR = _BV(USIOIF); \
+	Usi::enable_overflow_int(); \
+	_AVR_PCMSK(USI_SPI_SS_PCINT) |= _BV(USI_SPI_SS_PCINT & 7); \
+	PCICR |= _BV(_AVR_USI_PCIE);
 // }}}
 #elif defined(USI_ENABLE_TWI_MASTER)
-// TODO {{{
+// {{{
+	// The SCL clock is generated in software, one edge per Counter 0
+	// compare match interrupt, so the CPU is free between edges.
+#if defined(SYSTEM_CLOCK0_ENABLE) || defined(AVR_TEST_COUNTER0)
+#error "USI_ENABLE_TWI_MASTER uses Counter 0, so it can not be combined with SYSTEM_CLOCK0_ENABLE or AVR_TEST_COUNTER0"
+#endif
+#ifndef USI_TWI_BAUD
+#define USI_TWI_BAUD 20000
+#endif
+#ifndef USI_TWI_QUEUE_SIZE
+#define USI_TWI_QUEUE_SIZE 4
+#endif
+/// @cond
+	// Clock ticks per SCL half period at prescaler 1.
+#define _AVR_USI_TWI_TICKS (uint32_t(F_CPU) / (2 * uint32_t(USI_TWI_BAUD)))
+	// Smallest prescaler that makes OCR0A fit in 8 bits.
+#define _AVR_USI_TWI_DIVIDER ( \
+	_AVR_USI_TWI_TICKS <= 0x100 ? 1 : \
+	_AVR_USI_TWI_TICKS / 8 <= 0x100 ? 8 : \
+	_AVR_USI_TWI_TICKS / 64 <= 0x100 ? 64 : \
+	_AVR_USI_TWI_TICKS / 256 <= 0x100 ? 256 : 1024)
+	// The interrupt handler needs time to run between edges.
+	static_assert(_AVR_USI_TWI_TICKS >= 80, "USI_TWI_BAUD is too high for F_CPU");
+	static_assert(_AVR_USI_TWI_TICKS / 1024 <= 0x100, "USI_TWI_BAUD is too low for F_CPU");
+/// @endcond
+
+	/// Result of a queued TWI transaction.
+	enum Status {
+		/// The transaction is queued or running.
+		STATUS_PENDING,
+		/// The transaction was completed.
+		STATUS_DONE,
+		/// The device did not acknowledge its address.
+		STATUS_NACK,
+		/// The device did not acknowledge a data byte.
+		STATUS_DATA_NACK
+	};
+
+	/// Register read or write on a TWI device.
+	/**
+	 * This is the same as Twi::Transaction; see there.
+	 */
+	struct Transaction {
+		/// 7 bit address of the device.
+		uint8_t address;
+		/// First register.
+		uint8_t reg;
+		/// Destination for read data, or source of written data.
+		uint8_t *data;
+		/// Number of registers to transfer.
+		uint8_t len;
+		/// True for a read transaction.
+		bool read;
+		/// Free for use by user code.
+		uint8_t id;
+		/// Status of the transaction.
+		volatile uint8_t status;
+	};
+
+/// @cond
+	enum TwiPhase {
+		_TWI_IDLE,
+		_TWI_START,	// Release SDA and SCL.
+		_TWI_START_SDA,	// Pull SDA low while SCL is high.
+		_TWI_START_SCL,	// Pull SCL low and send the address.
+		_TWI_SHIFT,	// Clock bits through the shift register.
+		_TWI_STOP,	// Pull SDA low while SCL is low.
+		_TWI_STOP_SCL,	// Release SCL.
+		_TWI_STOP_SDA	// Release SDA while SCL is high.
+	};
+	enum TwiShift {
+		_TWI_SEND,	// Sending a byte.
+		_TWI_ACK_IN,	// Receiving the acknowledge for a sent byte.
+		_TWI_RECV,	// Receiving a byte.
+		_TWI_ACK_OUT	// Sending the acknowledge for a received byte.
+	};
+	static Transaction *_queue[USI_TWI_QUEUE_SIZE];
+	static volatile uint8_t _queue_head;
+	static volatile uint8_t _queue_used;
+	static volatile uint8_t _twi_phase;
+	static uint8_t _twi_shift;
+	// Number of bytes sent since the last (repeated) start.
+	static uint8_t _twi_sent;
+	// Number of data bytes transferred.
+	static uint8_t _twi_pos;
+	// Set when reading after the repeated start.
+	static bool _twi_rx_phase;
+	static uint8_t _twi_status;
+
+	static inline void _twi_count(uint8_t edges) { // {{{
+		// Clear all flags and count the requested number of clock edges.
+		USISR = _BV(USISIF) | _BV(USIOIF) | _BV(USIPF) | _BV(USIDC) | ((16 - edges) << USICNT0);
+	} // }}}
+
+	static inline void _twi_send(uint8_t data) { // {{{
+		USIDR = data;
+		Gpio::write(PIN_DI, true);
+		_twi_count(16);
+		_twi_shift = _TWI_SEND;
+		_twi_phase = _TWI_SHIFT;
+		++_twi_sent;
+	} // }}}
+
+	static inline void _twi_receive() { // {{{
+		Gpio::input(PIN_DI, false);
+		_twi_count(16);
+		_twi_shift = _TWI_RECV;
+		_twi_phase = _TWI_SHIFT;
+	} // }}}
+
+	static inline void _twi_stop(uint8_t status) { // {{{
+		_twi_status = status;
+		_twi_phase = _TWI_STOP;
+	} // }}}
+
+	static inline void _twi_begin() { // {{{
+		_twi_pos = 0;
+		_twi_sent = 0;
+		_twi_rx_phase = false;
+		_twi_phase = _TWI_START;
+		Counter::write0(0);
+		Counter::clear_ints0();
+		Counter::enable0(COUNTER0_DIV_TO_SOURCE(_AVR_USI_TWI_DIVIDER), Counter::m0_ctc);
+	} // }}}
+
+	// The stop condition has been sent; report the result and start the next transaction.
+	static inline void _twi_finish() { // {{{
+		Transaction *t = _queue[_queue_head];
+		_queue_head = _queue_head + 1 < USI_TWI_QUEUE_SIZE ? _queue_head + 1 : 0;
+		--_queue_used;
+		t->status = _twi_status;
+#ifdef CALL_usi_transaction_done
+		usi_transaction_done(t);
+#endif
+		if (_queue_used > 0)
+			_twi_begin();
+		else {
+			Counter::disable0();
+			_twi_phase = _TWI_IDLE;
+		}
+	} // }}}
+
+	// The shift register has finished a byte or an acknowledge bit.
+	static inline void _twi_shifted() { // {{{
+		Transaction *t = _queue[_queue_head];
+		switch (_twi_shift) {
+		case _TWI_SEND:
+			// Release SDA and read the acknowledge.
+			Gpio::input(PIN_DI, false);
+			_twi_count(2);
+			_twi_shift = _TWI_ACK_IN;
+			break;
+		case _TWI_ACK_IN:
+		{
+			bool nack = USIDR & 1;
+			USIDR = 0xff;
+			Gpio::write(PIN_DI, true);
+			if (nack) {
+				if (_twi_sent == 1)
+					_twi_stop(STATUS_NACK);
+				else
+					_twi_stop(!t->read && _twi_pos == t->len ? STATUS_DONE : STATUS_DATA_NACK);
+			}
+			else if (_twi_rx_phase)
+				_twi_receive();
+			else if (_twi_sent == 1)
+				_twi_send(t->reg);
+			else if (t->read) {
+				// Register has been sent; switch to reading.
+				_twi_rx_phase = true;
+				_twi_sent = 0;
+				_twi_phase = _TWI_START;
+			}
+			else if (_twi_pos < t->len)
+				_twi_send(t->data[_twi_pos++]);
+			else
+				_twi_stop(STATUS_DONE);
+			break;
+		}
+		case _TWI_RECV:
+			t->data[_twi_pos++] = USIDR;
+			// Acknowledge all bytes except the last.
+			USIDR = _twi_pos < t->len ? 0x00 : 0xff;
+			Gpio::write(PIN_DI, true);
+			_twi_count(2);
+			_twi_shift = _TWI_ACK_OUT;
+			break;
+		case _TWI_ACK_OUT:
+			USIDR = 0xff;
+			if (_twi_pos < t->len)
+				_twi_receive();
+			else
+				_twi_stop(STATUS_DONE);
+			break;
+		}
+	} // }}}
+
+	static inline void _twi_tick() { // {{{
+		switch (_twi_phase) {
+		case _TWI_START:
+			USIDR = 0xff;
+			Gpio::write(PIN_DI, true);
+			Gpio::write(PIN_USCK, true);
+			_twi_phase = _TWI_START_SDA;
+			break;
+		case _TWI_START_SDA:
+			if (!Gpio::read(PIN_USCK))
+				break;	// Slave is stretching the clock.
+			Gpio::write(PIN_DI, false);
+			_twi_phase = _TWI_START_SCL;
+			break;
+		case _TWI_START_SCL:
+			Gpio::write(PIN_USCK, false);
+			_twi_send((_queue[_queue_head]->address << 1) | (_twi_rx_phase ? 1 : 0));
+			break;
+		case _TWI_SHIFT:
+			if (Gpio::state(PIN_USCK)) {
+				if (!Gpio::read(PIN_USCK))
+					break;	// Slave is stretching the clock.
+				// Falling edge.
+				USICR |= _BV(USITC);
+				if (USISR & _BV(USIOIF))
+					_twi_shifted();
+			}
+			else {
+				// Rising edge.
+				USICR |= _BV(USITC);
+			}
+			break;
+		case _TWI_STOP:
+			USIDR = 0xff;
+			Gpio::write(PIN_DI, false);
+			_twi_phase = _TWI_STOP_SCL;
+			break;
+		case _TWI_STOP_SCL:
+			Gpio::write(PIN_USCK, true);
+			_twi_phase = _TWI_STOP_SDA;
+			break;
+		case _TWI_STOP_SDA:
+			if (!Gpio::read(PIN_USCK))
+				break;	// Slave is stretching the clock.
+			Gpio::write(PIN_DI, true);
+			_twi_finish();
+			break;
+		default:
+			break;
+		}
+	} // }}}
+
+	static inline bool _queue_add(Transaction *transaction) { // {{{
+		uint8_t sreg = SREG;
+		cli();
+		if (_queue_used >= USI_TWI_QUEUE_SIZE) {
+			SREG = sreg;
+			return false;
+		}
+		transaction->status = STATUS_PENDING;
+		uint8_t slot = _queue_head + _queue_used;
+		if (slot >= USI_TWI_QUEUE_SIZE)
+			slot -= USI_TWI_QUEUE_SIZE;
+		_queue[slot] = transaction;
+		++_queue_used;
+		if (_twi_phase == _TWI_IDLE)
+			_twi_begin();
+		SREG = sreg;
+		return true;
+	} // }}}
+/// @endcond
+
+	/// Queue reading registers from a TWI device.
+	/**
+	 * This works like Twi::read_regs(), but uses the USI. When the
+	 * transaction is finished, usi_transaction_done() is called if
+	 * CALL_usi_transaction_done is defined.
+	 *
+	 * @return false if the queue is full.
+	 */
+	static inline bool read_regs(Transaction *transaction, uint8_t address, uint8_t reg, uint8_t *dst, uint8_t len, uint8_t id = 0) { // {{{
+		transaction->address = address;
+		transaction->reg = reg;
+		transaction->data = dst;
+		transaction->len = len;
+		transaction->read = true;
+		transaction->id = id;
+		return _queue_add(transaction);
+	} // }}}
+
+	/// Queue writing registers to a TWI device.
+	/**
+	 * This works like Twi::write_regs(), but uses the USI.
+	 *
+	 * @return false if the queue is full.
+	 */
+	static inline bool write_regs(Transaction *transaction, uint8_t address, uint8_t reg, uint8_t const *src, uint8_t len, uint8_t id = 0) { // {{{
+		transaction->address = address;
+		transaction->reg = reg;
+		transaction->data = const_cast <uint8_t *>(src);
+		transaction->len = len;
+		transaction->read = false;
+		transaction->id = id;
+		return _queue_add(transaction);
+	} // }}}
+
+	/// Return the number of queued transactions, including the one that is running.
+	static inline uint8_t queue_used() { return _queue_used; }
+
+	ISR(TIMER0_COMPA_vect) {
+		_twi_tick();
+	}
+#define _AVR_SETUP_USI \
+	Usi::enable_twi_master(); \
+	Counter::set_ocr0a(_AVR_USI_TWI_TICKS / _AVR_USI_TWI_DIVIDER - 1); \
+	Counter::enable_compa0();
 // }}}
 #elif defined(USI_ENABLE_TWI_SLAVE)
 // {{{
@@ -221,27 +791,144 @@ namespace Usi {
 	Usi::clear_overflow(); \
 	Usi::enable_start_condition_int();
 // }}}
+#elif defined(USI_ENABLE_UART_RX)
+// {{{
+	// A pin change interrupt on DI detects the start bit. Counter 0 is
+	// then set up so that its compare matches are in the middle of the
+	// bits, and these clock the shift register. The start bit and 8 data
+	// bits are shifted in; when the counter overflows, the start bit has
+	// been shifted out and the data is in the register in reverse order.
+#if defined(SYSTEM_CLOCK0_ENABLE) || defined(AVR_TEST_COUNTER0)
+#error "USI_ENABLE_UART_RX uses Counter 0, so it can not be combined with SYSTEM_CLOCK0_ENABLE or AVR_TEST_COUNTER0"
+#endif
+#ifndef USI_UART_BAUD
+#define USI_UART_BAUD 9600
+#endif
+#ifndef USI_UART_LATENCY
+// Clock cycles from the start bit edge until Counter 0 is written in the pin change interrupt.
+#define USI_UART_LATENCY 24
+#endif
+#ifndef USI_RX_SIZE
+#define USI_RX_SIZE 16
+#endif
+/// @cond
+	// Clock ticks per bit at prescaler 1.
+#define _AVR_USI_UART_TICKS (uint32_t(F_CPU) / uint32_t(USI_UART_BAUD))
+	// Smallest prescaler that makes OCR0A fit in 8 bits.
+#define _AVR_USI_UART_DIVIDER ( \
+	_AVR_USI_UART_TICKS <= 0x100 ? 1 : \
+	_AVR_USI_UART_TICKS / 8 <= 0x100 ? 8 : \
+	_AVR_USI_UART_TICKS / 64 <= 0x100 ? 64 : \
+	_AVR_USI_UART_TICKS / 256 <= 0x100 ? 256 : 1024)
+#define _AVR_USI_UART_TOP (_AVR_USI_UART_TICKS / _AVR_USI_UART_DIVIDER - 1)
+	// Counter value after the start bit, so that the first compare match is in its middle.
+#define _AVR_USI_UART_START (_AVR_USI_UART_TOP + 1 - (_AVR_USI_UART_TICKS / 2 - USI_UART_LATENCY) / _AVR_USI_UART_DIVIDER)
+	static_assert(_AVR_USI_UART_TICKS / 2 > USI_UART_LATENCY + 8, "USI_UART_BAUD is too high for F_CPU");
+	static_assert(_AVR_USI_UART_TICKS / 1024 <= 0x100, "USI_UART_BAUD is too low for F_CPU");
+#ifdef PCIE0
+#define _AVR_USI_PCIE PCIE0
+#define _AVR_USI_PCIF PCIF0
+#else
+#define _AVR_USI_PCIE PCIE
+#define _AVR_USI_PCIF PCIF
+#endif
+
+	// Bit reversed nibbles.
+	static uint8_t const _uart_reverse[16] PROGMEM = {
+		0x0, 0x8, 0x4, 0xc, 0x2, 0xa, 0x6, 0xe,
+		0x1, 0x9, 0x5, 0xd, 0x3, 0xb, 0x7, 0xf
+	};
+
+	// Wait for the next start bit.
+	static inline void _uart_listen() { // {{{
+		PCIFR = _BV(_AVR_USI_PCIF);
+		_AVR_PCMSK(_AVR_USI_DI_PCINT) |= _BV(_AVR_USI_DI_PCINT & 7);
+	} // }}}
+
+	// Set when reception stopped because the buffer was full.
+	static volatile bool _uart_paused = false;
+
+	// Called when data is popped from the buffer. While a byte is being
+	// received, the pin change interrupt must stay off, so only restart
+	// listening if it was stopped.
+	static inline void _uart_resume() { // {{{
+		if (!_uart_paused)
+			return;
+		_uart_paused = false;
+		_uart_listen();
+	} // }}}
+
+#ifdef CALL_usi_rx
+	static inline void _uart_received(uint8_t, uint8_t) { usi_rx(); }
+	STREAM_BUFFER_WITH_CBS(rx, USI_RX_SIZE, _uart_received, _uart_resume();)
+#else
+	STREAM_BUFFER_WITH_CBS(rx, USI_RX_SIZE, _AVR_NOP, _uart_resume();)
+#endif
+/// @endcond
+
+	ISR(PCINT0_vect) {
+		// Any change on the port triggers this; only a falling edge on DI is a start bit.
+		if (Gpio::read(PIN_DI))
+			return;
+		Counter::write0(_AVR_USI_UART_START);
+#ifdef PSR10
+		GTCCR = _BV(PSR10);
+#endif
+		_AVR_PCMSK(_AVR_USI_DI_PCINT) &= ~_BV(_AVR_USI_DI_PCINT & 7);
+		// Three wire mode, clocked by Counter 0; overflow after the start bit and 8 data bits.
+		USISR = _BV(USIOIF) | (16 - 9);
+		USICR = _BV(USIOIE) | _BV(USIWM0) | _BV(USICS0);
+	}
+	ISR(USI_OVF_vect) {
+#ifdef USIBR
+		uint8_t raw = USIBR;
+#else
+		uint8_t raw = USIDR;
+#endif
+		USICR = 0;
+		USISR = _BV(USIOIF);
+		uint8_t data = (pgm_read_byte(&_uart_reverse[raw & 0xf]) << 4) | pgm_read_byte(&_uart_reverse[raw >> 4]);
+		// If the buffer is full, listening is resumed when it is read.
+		if (rx_write(data))
+			_uart_listen();
+		else
+			_uart_paused = true;
+	}
+#define _AVR_SETUP_USI \
+	Usi::enable_uart_rx(); \
+	Counter::set_ocr0a(_AVR_USI_UART_TOP); \
+	Counter::enable0(COUNTER0_DIV_TO_SOURCE(_AVR_USI_UART_DIVIDER), Counter::m0_ctc); \
+	PCICR |= _BV(_AVR_USI_PCIE); \
+	Usi::_uart_listen();
+// }}}
 #elif defined(USI_ENABLE_UART_TX)
 // {{{
+#ifndef USI_TX_SIZE
+#define USI_TX_SIZE 16
+#endif
+/// @cond
+	static inline void can_read(uint8_t data, uint8_t len);
 	STREAM_BUFFER_WITH_CBS(tx, USI_TX_SIZE, can_read,)
-	static void try_send(} {
+	static void try_send() {
 		// First make sure no new transmission is started while we set up.
 		USIDR = 0xff;
 
 		// If there is no more data in the buffer, stop the clock and return.
-		if (tx_buffer_available() < 1) {
-			USICR &= ~(_BV(USIWM0));
+		if (tx_buffer_used() < 1) {
+			USICR &= ~(_BV(USIWM0) | _BV(USIOIE));
 			return;
 		}
 		USIDR = ((tx_read() & 0x3f) << 1) ^ 0x7f;
 		TCNT0 = 0;	// Restart bit counter.
-		USISR = 0;	// Restart overflow counter.
-		USICR |= _BV(USIWM0);	// Set 3-wire mode.
+		USISR = _BV(USIOIF);	// Restart overflow counter.
+		USICR |= _BV(USIWM0) | _BV(USIOIE);	// Set 3-wire mode.
 		// All done; remove byte from buffer.
 		tx_pop();
 	}
-	static void can_read(uint8_t data, uint8_t len) {
+	static inline void can_read(uint8_t data, uint8_t len) {
 		// Data is available in the buffer.
+		(void)&data;
+		(void)&len;
 
 		// If a byte is being sent, the next will follow automatically; nothing to do here.
 		if (USICR & _BV(USIWM0))
@@ -250,6 +937,7 @@ namespace Usi {
 		// Attempt to send another byte.
 		try_send();
 	}
+/// @endcond
 	ISR(USI_OVF_vect) {
 		// Counter overflow on USI timer: data has been sent.
 		// Try sending another byte.
@@ -0,0 +1,13 @@
+// Replacement of <avr/interrupt.h> for host tests.
+// Interrupt handlers are plain functions that the test calls.
+
+#pragma once
+
+#define ISR(vector, ...) extern "C" void vector(void); extern "C" void vector(void)
+#define EMPTY_INTERRUPT(vector) extern "C" void vector(void) {}
+#define ISR_NOBLOCK
+#define ISR_BLOCK
+#define ISR_NAKED
+
+static inline void cli() { SREG &= ~_BV(SREG_I); }
+static inline void sei() { SREG |= _BV(SREG_I); }
@@ -0,0 +1,23 @@
+// Replacement of <avr/io.h> for host tests.
+// Registers are bytes in Host::regs; SPDR and EECR are connected to the
+// simulated devices in host.hh.
+
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+namespace Host {
+	static inline volatile uint8_t *reg(uint16_t addr);
+}
+#define _R(addr) (*Host::reg(addr))
+
+#include "iom328p.h"
+#include "../host.hh"
+
+#undef SPDR
+#define SPDR (Host::spdr)
+#undef EECR
+#define EECR (Host::eecr)
@@ -0,0 +1,451 @@
+// Register definitions of the atmega328p for host tests.
+// The addresses only need to be unique; they are not the ones of the real chip.
+
+#pragma once
+
+#define PINB _R(0x20)
+#define DDRB _R(0x21)
+#define PORTB _R(0x22)
+#define PINC _R(0x23)
+#define DDRC _R(0x24)
+#define PORTC _R(0x25)
+#define PIND _R(0x26)
+#define DDRD _R(0x27)
+#define PORTD _R(0x28)
+#define TIFR0 _R(0x29)
+#define TOV0 0
+#define OCF0A 1
+#define OCF0B 2
+#define TIFR1 _R(0x2a)
+#define TOV1 0
+#define OCF1A 1
+#define OCF1B 2
+#define ICF1 5
+#define TIFR2 _R(0x2b)
+#define TOV2 0
+#define OCF2A 1
+#define OCF2B 2
+#define PCIFR _R(0x2c)
+#define PCIF0 0
+#define PCIF1 1
+#define PCIF2 2
+#define EIFR _R(0x2d)
+#define INTF0 0
+#define INTF1 1
+#define EIMSK _R(0x2e)
+#define INT0 0
+#define INT1 1
+#define GPIOR0 _R(0x2f)
+#define EECR _R(0x30)
+#define EERE 0
+#define EEPE 1
+#define EEMPE 2
+#define EERIE 3
+#define EEPM0 4
+#define EEPM1 5
+#define EEDR _R(0x31)
+#define EEARL _R(0x32)
+#define EEARH _R(0x33)
+#define GTCCR _R(0x34)
+#define PSRSYNC 0
+#define PSRASY 1
+#define TSM 7
+#define TCCR0A _R(0x35)
+#define WGM00 0
+#define WGM01 1
+#define COM0B0 4
+#define COM0B1 5
+#define COM0A0 6
+#define COM0A1 7
+#define TCCR0B _R(0x36)
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM02 3
+#define FOC0B 6
+#define FOC0A 7
+#define TCNT0 _R(0x37)
+#define OCR0A _R(0x38)
+#define OCR0B _R(0x39)
+#define GPIOR1 _R(0x3a)
+#define GPIOR2 _R(0x3b)
+#define SPCR _R(0x3c)
+#define SPR0 0
+#define SPR1 1
+#define CPHA 2
+#define CPOL 3
+#define MSTR 4
+#define DORD 5
+#define SPE 6
+#define SPIE 7
+#define SPSR _R(0x3d)
+#define SPI2X 0
+#define WCOL 6
+#define SPIF 7
+#define SPDR _R(0x3e)
+#define ACSR _R(0x3f)
+#define ACIS0 0
+#define ACIS1 1
+#define ACIC 2
+#define ACIE 3
+#define ACI 4
+#define ACO 5
+#define ACBG 6
+#define ACD 7
+#define SMCR _R(0x40)
+#define SE 0
+#define SM0 1
+#define SM1 2
+#define SM2 3
+#define MCUSR _R(0x41)
+#define PORF 0
+#define EXTRF 1
+#define BORF 2
+#define WDRF 3
+#define MCUCR _R(0x42)
+#define IVCE 0
+#define IVSEL 1
+#define PUD 4
+#define BODSE 5
+#define BODS 6
+#define SPMCSR _R(0x43)
+#define SPMEN 0
+#define PGERS 1
+#define PGWRT 2
+#define BLBSET 3
+#define RWWSRE 4
+#define SIGRD 5
+#define RWWSB 6
+#define SPMIE 7
+#define WDTCSR _R(0x44)
+#define WDP0 0
+#define WDP1 1
+#define WDP2 2
+#define WDE 3
+#define WDCE 4
+#define WDP3 5
+#define WDIE 6
+#define WDIF 7
+#define CLKPR _R(0x45)
+#define CLKPS0 0
+#define CLKPS1 1
+#define CLKPS2 2
+#define CLKPS3 3
+#define CLKPCE 7
+#define PRR _R(0x46)
+#define PRADC 0
+#define PRUSART0 1
+#define PRSPI 2
+#define PRTIM1 3
+#define PRTIM0 5
+#define PRTIM2 6
+#define PRTWI 7
+#define OSCCAL _R(0x47)
+#define PCICR _R(0x48)
+#define PCIE0 0
+#define PCIE1 1
+#define PCIE2 2
+#define EICRA _R(0x49)
+#define ISC00 0
+#define ISC01 1
+#define ISC10 2
+#define ISC11 3
+#define PCMSK0 _R(0x4a)
+#define PCMSK1 _R(0x4b)
+#define PCMSK2 _R(0x4c)
+#define TIMSK0 _R(0x4d)
+#define TOIE0 0
+#define OCIE0A 1
+#define OCIE0B 2
+#define TIMSK1 _R(0x4e)
+#define TOIE1 0
+#define OCIE1A 1
+#define OCIE1B 2
+#define ICIE1 5
+#define TIMSK2 _R(0x4f)
+#define TOIE2 0
+#define OCIE2A 1
+#define OCIE2B 2
+#define ADCL _R(0x50)
+#define ADCH _R(0x51)
+#define ADCSRA _R(0x52)
+#define ADPS0 0
+#define ADPS1 1
+#define ADPS2 2
+#define ADIE 3
+#define ADIF 4
+#define ADATE 5
+#define ADSC 6
+#define ADEN 7
+#define ADCSRB _R(0x53)
+#define ADTS0 0
+#define ADTS1 1
+#define ADTS2 2
+#define ACME 6
+#define ADMUX _R(0x54)
+#define MUX0 0
+#define MUX1 1
+#define MUX2 2
+#define MUX3 3
+#define ADLAR 5
+#define REFS0 6
+#define REFS1 7
+#define DIDR0 _R(0x55)
+#define ADC0D 0
+#define ADC1D 1
+#define ADC2D 2
+#define ADC3D 3
+#define ADC4D 4
+#define ADC5D 5
+#define DIDR1 _R(0x56)
+#define AIN0D 0
+#define AIN1D 1
+#define TCCR1A _R(0x57)
+#define WGM10 0
+#define WGM11 1
+#define COM1B0 4
+#define COM1B1 5
+#define COM1A0 6
+#define COM1A1 7
+#define TCCR1B _R(0x58)
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM12 3
+#define WGM13 4
+#define ICES1 6
+#define ICNC1 7
+#define TCCR1C _R(0x59)
+#define FOC1B 6
+#define FOC1A 7
+#define TCNT1L _R(0x5a)
+#define TCNT1H _R(0x5b)
+#define ICR1L _R(0x5c)
+#define ICR1H _R(0x5d)
+#define OCR1AL _R(0x5e)
+#define OCR1AH _R(0x5f)
+#define OCR1BL _R(0x60)
+#define OCR1BH _R(0x61)
+#define TCCR2A _R(0x62)
+#define WGM20 0
+#define WGM21 1
+#define COM2B0 4
+#define COM2B1 5
+#define COM2A0 6
+#define COM2A1 7
+#define TCCR2B _R(0x63)
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM22 3
+#define FOC2B 6
+#define FOC2A 7
+#define TCNT2 _R(0x64)
+#define OCR2A _R(0x65)
+#define OCR2B _R(0x66)
+#define ASSR _R(0x67)
+#define TCR2BUB 0
+#define TCR2AUB 1
+#define OCR2BUB 2
+#define OCR2AUB 3
+#define TCN2UB 4
+#define AS2 5
+#define EXCLK 6
+#define TWBR _R(0x68)
+#define TWSR _R(0x69)
+#define TWPS0 0
+#define TWPS1 1
+#define TWAR _R(0x6a)
+#define TWGCE 0
+#define TWDR _R(0x6b)
+#define TWCR _R(0x6c)
+#define TWIE 0
+#define TWEN 2
+#define TWWC 3
+#define TWSTO 4
+#define TWSTA 5
+#define TWEA 6
+#define TWINT 7
+#define TWAMR _R(0x6d)
+#define UCSR0A _R(0x6e)
+#define MPCM0 0
+#define U2X0 1
+#define UPE0 2
+#define DOR0 3
+#define FE0 4
+#define UDRE0 5
+#define TXC0 6
+#define RXC0 7
+#define UCSR0B _R(0x6f)
+#define TXB80 0
+#define RXB80 1
+#define UCSZ02 2
+#define TXEN0 3
+#define RXEN0 4
+#define UDRIE0 5
+#define TXCIE0 6
+#define RXCIE0 7
+#define UCSR0C _R(0x70)
+#define UCPOL0 0
+#define UCSZ00 1
+#define UCSZ01 2
+#define USBS0 3
+#define UPM00 4
+#define UPM01 5
+#define UMSEL00 6
+#define UMSEL01 7
+#define UBRR0L _R(0x71)
+#define UBRR0H _R(0x72)
+#define UDR0 _R(0x73)
+#define TCNT1 (*(volatile uint16_t *)&TCNT1L)
+#define ICR1 (*(volatile uint16_t *)&ICR1L)
+#define OCR1A (*(volatile uint16_t *)&OCR1AL)
+#define OCR1B (*(volatile uint16_t *)&OCR1BL)
+#define ADC (*(volatile uint16_t *)&ADCL)
+#define ADCW (*(volatile uint16_t *)&ADCL)
+#define EEAR (*(volatile uint16_t *)&EEARL)
+#define UBRR0 (*(volatile uint16_t *)&UBRR0L)
+#define SELFPRGEN SPMEN
+#define MUX4 4
+#define INT0_vect __vector_1
+#define INT1_vect __vector_2
+#define PCINT0_vect __vector_3
+#define PCINT1_vect __vector_4
+#define PCINT2_vect __vector_5
+#define WDT_vect __vector_6
+#define TIMER2_COMPA_vect __vector_7
+#define TIMER2_COMPB_vect __vector_8
+#define TIMER2_OVF_vect __vector_9
+#define TIMER1_CAPT_vect __vector_10
+#define TIMER1_COMPA_vect __vector_11
+#define TIMER1_COMPB_vect __vector_12
+#define TIMER1_OVF_vect __vector_13
+#define TIMER0_COMPA_vect __vector_14
+#define TIMER0_COMPB_vect __vector_15
+#define TIMER0_OVF_vect __vector_16
+#define SPI_STC_vect __vector_17
+#define USART_RX_vect __vector_18
+#define USART_UDRE_vect __vector_19
+#define USART_TX_vect __vector_20
+#define ADC_vect __vector_21
+#define EE_READY_vect __vector_22
+#define ANALOG_COMP_vect __vector_23
+#define TWI_vect __vector_24
+#define SPM_READY_vect __vector_25
+#define SIGNATURE_0 0x1e
+#define SIGNATURE_1 0x95
+#define SIGNATURE_2 0x0f
+#define PORTB0 0
+#define PB0 0
+#define PINB0 0
+#define DDB0 0
+#define PORTB1 1
+#define PB1 1
+#define PINB1 1
+#define DDB1 1
+#define PORTB2 2
+#define PB2 2
+#define PINB2 2
+#define DDB2 2
+#define PORTB3 3
+#define PB3 3
+#define PINB3 3
+#define DDB3 3
+#define PORTB4 4
+#define PB4 4
+#define PINB4 4
+#define DDB4 4
+#define PORTB5 5
+#define PB5 5
+#define PINB5 5
+#define DDB5 5
+#define PORTB6 6
+#define PB6 6
+#define PINB6 6
+#define DDB6 6
+#define PORTB7 7
+#define PB7 7
+#define PINB7 7
+#define DDB7 7
+#define PORTC0 0
+#define PC0 0
+#define PINC0 0
+#define DDC0 0
+#define PORTC1 1
+#define PC1 1
+#define PINC1 1
+#define DDC1 1
+#define PORTC2 2
+#define PC2 2
+#define PINC2 2
+#define DDC2 2
+#define PORTC3 3
+#define PC3 3
+#define PINC3 3
+#define DDC3 3
+#define PORTC4 4
+#define PC4 4
+#define PINC4 4
+#define DDC4 4
+#define PORTC5 5
+#define PC5 5
+#define PINC5 5
+#define DDC5 5
+#define PORTC6 6
+#define PC6 6
+#define PINC6 6
+#define DDC6 6
+#define PORTC7 7
+#define PC7 7
+#define PINC7 7
+#define DDC7 7
+#define PORTD0 0
+#define PD0 0
+#define PIND0 0
+#define DDD0 0
+#define PORTD1 1
+#define PD1 1
+#define PIND1 1
+#define DDD1 1
+#define PORTD2 2
+#define PD2 2
+#define PIND2 2
+#define DDD2 2
+#define PORTD3 3
+#define PD3 3
+#define PIND3 3
+#define DDD3 3
+#define PORTD4 4
+#define PD4 4
+#define PIND4 4
+#define DDD4 4
+#define PORTD5 5
+#define PD5 5
+#define PIND5 5
+#define DDD5 5
+#define PORTD6 6
+#define PD6 6
+#define PIND6 6
+#define DDD6 6
+#define PORTD7 7
+#define PD7 7
+#define PIND7 7
+#define DDD7 7
+#define _SFR_IO_ADDR(x) 0
+#define _SFR_MEM_ADDR(x) 0
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_ADC 2
+#define SLEEP_MODE_PWR_DOWN 4
+#define SLEEP_MODE_PWR_SAVE 6
+#define SLEEP_MODE_STANDBY 12
+#define SLEEP_MODE_EXT_STANDBY 14
+#define PCINT0 0
+#define SREG _R(0x80)
+#define SREG_I 7
+#define SPL _R(0x81)
+#define SPH _R(0x82)
+#define SP (*(volatile uint16_t *)&SPL)
+#define RAMEND 0x8ff
+#define E2END 0x3ff
+#define FLASHEND 0x7fff
+#define SPM_PAGESIZE 128
@@ -0,0 +1,270 @@
+// Simulated hardware for host tests.
+
+// This is included by the replacement <avr/io.h>, after the register
+// definitions. It provides the register file, a SPI bus with simulated
+// devices and the EEPROM.
+
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace Host {
+	// Register file.
+	static volatile uint8_t regs[0x100];
+
+	static inline void poll();
+	static inline void spi_finish();
+
+	static inline volatile uint8_t *reg(uint16_t addr) { // {{{
+		// Every register access is a chance to notice chip select changes
+		// and to run the EEPROM.
+		poll();
+		// A byte on the SPI bus is done when the program looks at SPSR.
+		if (addr == 0x3d)
+			spi_finish();
+		return &regs[addr];
+	} // }}}
+
+	// SPI bus. {{{
+
+	// A device on the SPI bus. Chip select changes are noticed on the
+	// next register access, or when poll() is called.
+	struct SpiDevice {
+		volatile uint8_t *cs_port;
+		uint8_t cs_mask;
+		bool selected;
+		SpiDevice *next;
+		virtual ~SpiDevice() {}
+		// Called when the chip select pin changes.
+		virtual void select(bool active) { (void)active; }
+		// Called for every byte while the device is selected. The return value is the byte that the device sends.
+		virtual uint8_t transfer(uint8_t data) = 0;
+	};
+
+	static SpiDevice *spi_devices;
+
+	// Number of bytes that were sent over the bus; this is used as the clock for the devices.
+	static unsigned long spi_bytes;
+	// Number of clock cycles that the bytes took on the bus, at the clock selected by SPR1:0 and SPI2X.
+	static unsigned long long spi_cycles;
+
+	// Connect a device with its chip select pin on bit of port, for example attach(flash, PORTB, 2).
+	static inline void attach(SpiDevice &device, volatile uint8_t &port, uint8_t bit) { // {{{
+		device.cs_port = &port;
+		device.cs_mask = _BV(bit);
+		device.selected = false;
+		device.next = spi_devices;
+		spi_devices = &device;
+	} // }}}
+
+	// Data register; writing it transfers a byte to all selected devices.
+	// As on the chip, the receive buffer keeps the previous byte until the
+	// transfer is done, which is when the program reads SPSR. Writing while
+	// a transfer is running sets WCOL and is ignored.
+	struct Spdr { // {{{
+		uint8_t data;
+		uint8_t shift;
+		bool busy;
+		operator uint8_t() {
+			poll();
+			regs[0x3d] &= ~(_BV(SPIF) | _BV(WCOL));
+			return data;
+		}
+		Spdr &operator=(uint8_t value) {
+			poll();
+			regs[0x3d] &= ~(_BV(SPIF) | _BV(WCOL));
+			if (busy) {
+				regs[0x3d] |= _BV(WCOL);
+				return *this;
+			}
+			// The data line is pulled up when no device drives it.
+			shift = 0xff;
+			for (SpiDevice *d = spi_devices; d; d = d->next) {
+				if (d->selected)
+					shift &= d->transfer(value);
+			}
+			busy = true;
+			++spi_bytes;
+			static uint8_t const divider[4] = {4, 16, 64, 128};
+			spi_cycles += 8 * divider[(regs[0x3c] >> SPR0) & 3] >> (regs[0x3d] & _BV(SPI2X) ? 1 : 0);
+			return *this;
+		}
+	}; // }}}
+	static Spdr spdr;
+
+	static inline void spi_finish() { // {{{
+		if (!spdr.busy)
+			return;
+		spdr.busy = false;
+		spdr.data = spdr.shift;
+		regs[0x3d] |= _BV(SPIF);
+	} // }}}
+
+	// }}}
+
+	// EEPROM. {{{
+
+	// Thrown when the power fails.
+	struct PowerCut {};
+
+	static uint8_t eeprom[E2END + 1];
+	// Number of programming operations on every byte.
+	static unsigned long eeprom_wear[E2END + 1];
+	static unsigned long eeprom_writes;
+	// Number of programming operations that complete before the power
+	// fails, or -1 for never. The failing operation leaves its byte
+	// unchanged or erased and throws PowerCut.
+	static long eeprom_budget = -1;
+	// Handler for EE_READY_vect. It is called on a register access when
+	// interrupts are enabled, EERIE is set and the EEPROM is ready.
+	static void (*eeprom_ready)();
+	// Number of register accesses that programming takes.
+	static unsigned long eeprom_program_time;
+	// Longest run of EECR reads outside the interrupt handler that found
+	// the EEPROM busy while interrupts were disabled.
+	static unsigned long eeprom_blocked_max;
+
+	// Control register. Programming completes eeprom_program_time
+	// register accesses after it was started.
+	struct Eecr { // {{{
+		uint8_t value;
+		uint16_t addr;
+		uint8_t data;
+		bool in_isr;
+		// Set while the register itself is used.
+		bool in_op;
+		// Register accesses until programming is done.
+		unsigned long busy;
+		unsigned long blocked;
+		// Finish programming.
+		void complete() {
+			if (!(value & _BV(EEPE)))
+				return;
+			if (busy > 0) {
+				--busy;
+				return;
+			}
+			value &= ~_BV(EEPE);
+			uint8_t mode = (value >> EEPM0) & 3;
+			uint8_t result = mode == 1 ? 0xff : mode == 2 ? eeprom[addr] & data : data;
+			if (eeprom_budget == 0) {
+				if (mode != 2 && rand() & 1)
+					eeprom[addr] = 0xff;
+				throw PowerCut();
+			}
+			if (eeprom_budget > 0)
+				--eeprom_budget;
+			eeprom[addr] = result;
+			++eeprom_wear[addr];
+			++eeprom_writes;
+		}
+		// Level triggered interrupt.
+		void interrupt() {
+			if (in_isr || in_op || !eeprom_ready || !(SREG & _BV(SREG_I)) || (value & (_BV(EERIE) | _BV(EEPE))) != _BV(EERIE))
+				return;
+			in_isr = true;
+			eeprom_ready();
+			in_isr = false;
+		}
+		void tick() {
+			if (in_op)
+				return;
+			in_op = true;
+			bool ready = !(value & _BV(EEPE));
+			complete();
+			in_op = false;
+			// The interrupt is taken after the access that saw programming finish.
+			if (ready)
+				interrupt();
+		}
+		operator uint8_t() {
+			tick();
+			if ((value & _BV(EEPE)) && !in_isr && !(SREG & _BV(SREG_I))) {
+				if (++blocked > eeprom_blocked_max)
+					eeprom_blocked_max = blocked;
+			}
+			else
+				blocked = 0;
+			return value;
+		}
+		Eecr &operator=(uint8_t v) {
+			tick();
+			in_op = true;
+			uint16_t a = EEARL | EEARH << 8;
+			if ((v & _BV(EEPE)) && (value & (_BV(EEMPE) | _BV(EEPE))) == _BV(EEMPE)) {
+				addr = a & E2END;
+				data = EEDR;
+				value = (v & ~_BV(EEMPE)) | _BV(EEPE);
+				busy = eeprom_program_time;
+			}
+			else {
+				if (v & _BV(EERE))
+					EEDR = eeprom[a & E2END];
+				// Programming can not be stopped.
+				value = (v & ~(_BV(EERE) | _BV(EEPE))) | (value & _BV(EEPE));
+			}
+			in_op = false;
+			interrupt();
+			return *this;
+		}
+		Eecr &operator|=(uint8_t v) { return *this = uint8_t(*this) | v; }
+		Eecr &operator&=(uint8_t v) { return *this = uint8_t(*this) & v; }
+	}; // }}}
+	static Eecr eecr;
+
+	// Reset the EEPROM controller, as after a power cycle.
+	static inline void eeprom_reset() { // {{{
+		eecr.value = 0;
+		eecr.in_isr = false;
+		eecr.in_op = false;
+		eecr.busy = 0;
+		eecr.blocked = 0;
+	} // }}}
+
+	// }}}
+
+	static inline void poll() { // {{{
+		// Don't recurse through the register accesses below.
+		static bool polling;
+		if (polling)
+			return;
+		struct Guard {
+			~Guard() { polling = false; }
+		} guard;
+		polling = true;
+		for (SpiDevice *d = spi_devices; d; d = d->next) {
+			// A pin is only driven low if it is an output; the data direction register is just before the port register.
+			bool active = (d->cs_port[-1] & d->cs_mask) && !(*d->cs_port & d->cs_mask);
+			if (active == d->selected)
+				continue;
+			d->selected = active;
+			d->select(active);
+		}
+		eecr.tick();
+	} // }}}
+
+	// Test results. {{{
+
+	static unsigned failures;
+
+	// Report a failed check and continue.
+	static inline void check(bool ok, char const *what, int line) { // {{{
+		if (ok)
+			return;
+		fprintf(stderr, "line %d: check failed: %s\n", line, what);
+		++failures;
+	} // }}}
+#define CHECK(expr) Host::check(expr, #expr, __LINE__)
+
+	// Return the exit code for main().
+	static inline int result(char const *name) { // {{{
+		printf("%s: %s\n", name, failures ? "FAIL" : "ok");
+		return failures ? 1 : 0;
+	} // }}}
+
+	// }}}
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,6 @@
+// Replacement of <util/delay.h> for host tests.
+
+#pragma once
+
+static inline void _delay_us(double) {}
+static inline void _delay_ms(double) {}
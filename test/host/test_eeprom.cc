@@ -0,0 +1,166 @@
+// Host test for the EEPROM key/value store.
+
+#define NO_main
+#define EEPROM_KV_SIZE 64
+#define EEPROM_KV_START 16
+#define EEPROM_KV_KEYS 4
+#define EEPROM_BUFFER_SIZE 8
+#define EEPROM_READ_SIZE 16
+
+#include <amat.hh>
+
+void setup() {}
+
+// Restart after a power failure: the queue in RAM is lost and the store is scanned again.
+static void reboot() { // {{{
+	Host::eeprom_reset();
+	Eeprom::writing = false;
+	Eeprom::buffer_reset();
+	Eeprom::kv_init();
+	// A power failure may have happened while interrupts were disabled.
+	if (Host::eeprom_ready)
+		sei();
+} // }}}
+
+static bool outside_written() { // {{{
+	for (uint16_t i = 0; i <= E2END; ++i) {
+		if (Host::eeprom_wear[i] != 0 && (i < EEPROM_KV_START || i >= EEPROM_KV_START + EEPROM_KV_SIZE))
+			return true;
+	}
+	return false;
+} // }}}
+
+// Check data read from the block after the store.
+static bool same(uint8_t const *data, uint16_t len) { // {{{
+	for (uint16_t i = 0; i < len; ++i) {
+		if (data[i] != uint8_t(i * 3))
+			return false;
+	}
+	return true;
+} // }}}
+
+// Update a counter with power failures at random moments; return the number of rounds that lost data.
+static unsigned power_cuts(unsigned rounds) { // {{{
+	unsigned bad = 0;
+	for (unsigned round = 0; round < rounds; ++round) {
+		uint32_t before = 0;
+		Eeprom::kv_read(0, &before, 4);
+		uint32_t next = before + 1;
+		Host::eeprom_budget = rand() % 40;
+		bool cut = false;
+		try {
+			Eeprom::kv_write(0, &next, 4);
+			if (rand() % 3 == 0)
+				Eeprom::kv_write(2, &next, 2);
+			Eeprom::buffer_flush();
+		}
+		catch (Host::PowerCut &) {
+			cut = true;
+		}
+		Host::eeprom_budget = -1;
+		reboot();
+		uint32_t after = 0;
+		uint8_t name[5] = {0};
+		uint8_t len = Eeprom::kv_read(0, &after, 4);
+		Eeprom::kv_read(1, name, 5);
+		if (len != 4 || (after != before && after != next) || (!cut && after != next) || memcmp(name, "abcde", 5) != 0)
+			++bad;
+	}
+	return bad;
+} // }}}
+
+int main() {
+	srand(1);
+	memset(Host::eeprom, 0x5a, sizeof(Host::eeprom));
+	// A store without valid data is erased.
+	reboot();
+	uint32_t counter = 0;
+	CHECK(Eeprom::kv_read(0, &counter, 4) == 0);
+	CHECK(Host::eeprom[EEPROM_KV_START] == 0 && Host::eeprom[EEPROM_KV_START + 1] == 0xff);
+
+	// Many updates of one key compact the store often; the other key survives.
+	CHECK(Eeprom::kv_write(1, "abcde", 5));
+	for (counter = 1; counter <= 2000; ++counter)
+		CHECK(Eeprom::kv_write(0, &counter, 4));
+	uint32_t value = 0;
+	uint8_t name[5] = {0};
+	CHECK(Eeprom::kv_read(0, &value, 4) == 4 && value == 2000);
+	CHECK(Eeprom::kv_read(1, name, 5) == 5 && memcmp(name, "abcde", 5) == 0);
+	CHECK(!outside_written());
+	// With 7 bytes per record and 32 bytes per half, compaction happens at least every 4 writes.
+	CHECK(Eeprom::_kv_seq != 0);
+	unsigned long max_wear = 0;
+	for (uint16_t i = 0; i <= E2END; ++i) {
+		if (Host::eeprom_wear[i] > max_wear)
+			max_wear = Host::eeprom_wear[i];
+	}
+	CHECK(max_wear < 2000);
+
+	// Values survive a reboot, and removed keys stay removed.
+	CHECK(Eeprom::kv_write(3, "x", 1));
+	CHECK(Eeprom::kv_remove(3));
+	Eeprom::buffer_flush();
+	reboot();
+	value = 0;
+	CHECK(Eeprom::kv_read(0, &value, 4) == 4 && value == 2000);
+	CHECK(Eeprom::kv_read(1, name, 5) == 5 && memcmp(name, "abcde", 5) == 0);
+	CHECK(Eeprom::kv_read(3, name, 5) == 0);
+	CHECK(!Eeprom::kv_write(4, "x", 1));
+	CHECK(!Eeprom::kv_write(0, name, EEPROM_KV_SIZE / 2 - 4));
+
+	// Power failures with polled writes.
+	CHECK(power_cuts(3000) == 0);
+
+	// Power failures with writes from the interrupt handler.
+	Host::eeprom_ready = Eeprom::EE_READY_vect;
+	sei();
+	CHECK(power_cuts(1000) == 0);
+
+	// The same when programming takes a while; buffer_flush() waits for the last byte.
+	Host::eeprom_program_time = 20;
+	CHECK(power_cuts(500) == 0);
+	Host::eeprom_program_time = 0;
+	CHECK(!outside_written());
+
+	// Block reads.
+	uint16_t const block = EEPROM_KV_START + EEPROM_KV_SIZE;
+	for (uint16_t i = 0; i < 200; ++i)
+		Host::eeprom[block + i] = i * 3;
+	uint8_t data[200];
+	Eeprom::read_block(block, data, 200);
+	CHECK(same(data, 200));
+
+	// While the queue writes from the interrupt handler, and programming takes a while, the reads wait with interrupts enabled.
+	Host::eeprom_program_time = 100;
+	counter = 12345;
+	CHECK(Eeprom::kv_write(0, &counter, 4));
+	CHECK(Eeprom::writing);
+	Host::eeprom_blocked_max = 0;
+	memset(data, 0, sizeof(data));
+	Eeprom::read_block(block, data, 200);
+	CHECK(same(data, 200));
+	CHECK(Host::eeprom_blocked_max <= 1);
+
+	// The same for streaming reads.
+	CHECK(Eeprom::kv_write(2, &counter, 2));
+	CHECK(Eeprom::writing);
+	Host::eeprom_blocked_max = 0;
+	memset(data, 0, sizeof(data));
+	Eeprom::stream_start(block, 200);
+	uint16_t got = 0;
+	while (got < 200 && (Eeprom::stream_remaining() > 0 || Eeprom::read_buffer_buffer_used() > 0)) {
+		uint8_t n = Eeprom::read_buffer_buffer_used();
+		Eeprom::read_buffer_move(&data[got], n);
+		got += n;
+	}
+	CHECK(got == 200 && same(data, 200));
+	CHECK(Host::eeprom_blocked_max <= 1);
+	Eeprom::buffer_flush();
+	Host::eeprom_program_time = 0;
+	reboot();
+	CHECK(Eeprom::kv_read(0, &value, 4) == 4 && value == 12345);
+
+	return Host::result("eeprom");
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,32 @@
+// Host test for the PWM service on counter 1.
+
+#define NO_main
+// At 16 MHz, the smallest prescaler for 50 Hz in phase and frequency correct mode is 8; a larger one is requested.
+#define PWM1_FREQUENCY 50
+#define PWM1_RESOLUTION 10
+#define PWM1_DIVIDER 64
+
+#include <amat.hh>
+
+void setup() {}
+
+int main() {
+	static_assert(PWM1_TOP == 2500, "TOP must follow the requested prescaler");
+	static_assert(PWM1_ACTUAL_FREQUENCY == 50, "frequency must be exact");
+	_AVR_SETUP_COUNTER1
+
+	// Phase and frequency correct mode with ICR1 as TOP, prescaler 64.
+	CHECK(ICR1 == 2500);
+	CHECK((TCCR1B & (_BV(CS12) | _BV(CS11) | _BV(CS10))) == (_BV(CS11) | _BV(CS10)));
+	CHECK((TCCR1B & (_BV(WGM13) | _BV(WGM12))) == _BV(WGM13));
+	CHECK((TCCR1A & (_BV(WGM11) | _BV(WGM10))) == 0);
+
+	Counter::pwm_set1a(0);
+	CHECK(OCR1A == 0);
+	Counter::pwm_set1a(PWM1_MAX / 2);
+	CHECK(OCR1A == 1250);
+	Counter::pwm_set1a(PWM1_MAX);
+	CHECK(OCR1A == 2500);
+
+	return Host::result("pwm");
+}
@@ -0,0 +1,302 @@
+// Host test for the SD card driver.
+
+#define NO_main
+#define SPI_ENABLE_MASTER
+#define SDCARD_CS GPIO_MAKE_PIN(PB, 2)
+
+#include <amat.hh>
+
+void setup() {}
+
+// Simulated SDHC card. {{{
+struct Card : Host::SpiDevice {
+	static uint16_t const BLOCKS = 64;
+	uint8_t mem[BLOCKS][512];
+	enum State { IDLE, READING, WRITE_SINGLE, WRITING, RECEIVING } state;
+	bool multiple;
+	bool idle;
+	bool app;
+	uint32_t block;
+	// Command frame that is being received.
+	uint8_t frame[6];
+	uint8_t frame_pos;
+	// Bytes to send.
+	uint8_t out[1024];
+	unsigned out_head;
+	unsigned out_len;
+	// Bytes during which the card holds the data line low.
+	unsigned long busy;
+	uint8_t data[514];
+	unsigned data_pos;
+	// Timing, in bytes.
+	unsigned long read_delay;
+	unsigned long write_busy;
+	// Number of ACMD41 commands before the card leaves the idle state.
+	unsigned long init_left;
+	unsigned long init_attempts;
+	// Data sent while the card is busy, wrong data tokens and unexpected commands.
+	unsigned errors;
+
+	Card() : state(IDLE), idle(true), frame_pos(0), out_head(0), out_len(0), busy(0), read_delay(10), write_busy(100), init_left(20), init_attempts(0), errors(0) {}
+
+	void send(uint8_t byte) {
+		out[(out_head + out_len++) % sizeof(out)] = byte;
+	}
+
+	void send_block(uint8_t const *buffer, unsigned len) {
+		for (unsigned long i = 0; i < read_delay && out_len < sizeof(out) - len - 3; ++i)
+			send(0xff);
+		// A delay that does not fit in the queue is a timeout.
+		if (read_delay > sizeof(out) - len - 3)
+			return;
+		send(0xfe);
+		for (unsigned i = 0; i < len; ++i)
+			send(buffer[i]);
+		send(0x12);
+		send(0x34);
+	}
+
+	uint8_t r1() {
+		return idle ? 1 : 0;
+	}
+
+	void command() {
+		uint8_t cmd = frame[0] & 0x3f;
+		uint32_t arg = uint32_t(frame[1]) << 24 | uint32_t(frame[2]) << 16 | frame[3] << 8 | frame[4];
+		bool is_app = app;
+		app = false;
+		if (state == READING) {
+			if (cmd != 12) {
+				++errors;
+				return;
+			}
+			// Abort the transfer; a stuff byte comes before the response.
+			out_len = 0;
+			send(0x7f);
+			send(r1());
+			busy = 20;
+			state = IDLE;
+			return;
+		}
+		send(0xff);
+		switch (cmd) {
+		case 0:
+			idle = true;
+			send(r1());
+			break;
+		case 8:
+			send(r1());
+			send(0);
+			send(0);
+			send(1);
+			send(0xaa);
+			break;
+		case 55:
+			app = true;
+			send(r1());
+			break;
+		case 41:
+			if (!is_app)
+				++errors;
+			++init_attempts;
+			if (init_left > 0 && --init_left == 0)
+				idle = false;
+			send(r1());
+			break;
+		case 58:
+			send(r1());
+			send(0xc0);
+			send(0xff);
+			send(0x80);
+			send(0);
+			break;
+		case 9: {
+			send(r1());
+			uint8_t csd[16] = {0x40};
+			send_block(csd, 16);
+			break;
+		}
+		case 17:
+			send(r1());
+			send_block(mem[arg % BLOCKS], 512);
+			break;
+		case 18:
+			send(r1());
+			block = arg;
+			state = READING;
+			break;
+		case 24:
+		case 25:
+			send(r1());
+			block = arg;
+			state = cmd == 24 ? WRITE_SINGLE : WRITING;
+			break;
+		default:
+			send(r1() | 4);
+			break;
+		}
+	}
+
+	// Handle a byte from the host.
+	void receive(uint8_t in) {
+		if (busy > 0) {
+			if (in != 0xff)
+				++errors;
+			return;
+		}
+		if (state == RECEIVING) {
+			data[data_pos++] = in;
+			if (data_pos < sizeof(data))
+				return;
+			memcpy(mem[block++ % BLOCKS], data, 512);
+			// Data accepted.
+			send(0xe5);
+			busy = write_busy;
+			state = multiple ? WRITING : IDLE;
+			return;
+		}
+		if (state == WRITE_SINGLE || state == WRITING) {
+			if (in == 0xff)
+				return;
+			if (state == WRITING && in == 0xfd) {
+				send(0xff);
+				busy = write_busy;
+				state = IDLE;
+				return;
+			}
+			if (in != (state == WRITING ? 0xfc : 0xfe)) {
+				++errors;
+				return;
+			}
+			multiple = state == WRITING;
+			data_pos = 0;
+			state = RECEIVING;
+			return;
+		}
+		if (frame_pos == 0 && (in & 0xc0) != 0x40)
+			return;
+		frame[frame_pos++] = in;
+		if (frame_pos < 6)
+			return;
+		frame_pos = 0;
+		command();
+	}
+
+	void select(bool active) {
+		frame_pos = 0;
+	}
+
+	uint8_t transfer(uint8_t in) {
+		uint8_t ret = 0xff;
+		if (out_len > 0) {
+			ret = out[out_head];
+			out_head = (out_head + 1) % sizeof(out);
+			--out_len;
+		}
+		else if (busy > 0) {
+			--busy;
+			ret = 0;
+		}
+		else if (state == READING) {
+			send_block(mem[block++ % BLOCKS], 512);
+			if (out_len > 0)
+				return transfer(in);
+		}
+		receive(in);
+		return ret;
+	}
+};
+// }}}
+
+static Card card;
+static uint8_t block[512];
+
+static void fill(uint8_t seed) { // {{{
+	for (uint16_t i = 0; i < 512; ++i)
+		block[i] = seed + i * 7;
+} // }}}
+
+static bool same(uint8_t const *data, uint8_t seed) { // {{{
+	for (uint16_t i = 0; i < 512; ++i) {
+		if (data[i] != uint8_t(seed + i * 7))
+			return false;
+	}
+	return true;
+} // }}}
+
+// Time on the bus since start.
+static double elapsed_ms(unsigned long long start) { // {{{
+	return (Host::spi_cycles - start) * 1000. / F_CPU;
+} // }}}
+
+int main() {
+	Host::attach(card, PORTB, 2);
+	Spi::enable();
+	CHECK(Sdcard::init());
+	CHECK(Sdcard::type() == Sdcard::TYPE_SDHC);
+	CHECK(card.init_attempts == 20);
+	CHECK(Sdcard::blocks() == 1024);
+
+	// Single block transfers.
+	fill(1);
+	CHECK(Sdcard::write(3, block));
+	CHECK(same(card.mem[3], 1));
+	CHECK(Sdcard::read(3, block));
+	CHECK(same(block, 1));
+
+	// Multi-block write; the card is busy for a while after every block.
+	card.write_busy = 5000;
+	CHECK(Sdcard::write_start(10));
+	for (uint8_t i = 0; i < 5; ++i) {
+		fill(10 + i);
+		CHECK(Sdcard::write_next(block));
+		CHECK(Sdcard::busy());
+	}
+	CHECK(Sdcard::write_stop());
+	CHECK(!Sdcard::busy());
+	for (uint8_t i = 0; i < 5; ++i)
+		CHECK(same(card.mem[10 + i], 10 + i));
+	CHECK(card.errors == 0);
+
+	// Multi-block read, with a delay before every data token.
+	card.read_delay = 300;
+	CHECK(Sdcard::read_start(10));
+	for (uint8_t i = 0; i < 5; ++i) {
+		memset(block, 0, sizeof(block));
+		CHECK(Sdcard::read_next(block));
+		CHECK(same(block, 10 + i));
+	}
+	CHECK(Sdcard::read_stop());
+	CHECK(card.errors == 0);
+	CHECK(Sdcard::read(13, block) && same(block, 13));
+
+	// A card that stays busy times out after 500 ms.
+	card.write_busy = 100000000;
+	CHECK(Sdcard::write_start(20));
+	CHECK(Sdcard::write_next(block));
+	unsigned long long start = Host::spi_cycles;
+	CHECK(!Sdcard::write_next(block));
+	CHECK(elapsed_ms(start) >= 500 && elapsed_ms(start) < 510);
+	card.busy = 0;
+	card.write_busy = 100;
+	CHECK(Sdcard::write_stop());
+
+	// A data token that never comes times out after 200 ms.
+	card.read_delay = 100000000;
+	start = Host::spi_cycles;
+	CHECK(!Sdcard::read(3, block));
+	CHECK(elapsed_ms(start) >= 200 && elapsed_ms(start) < 210);
+	CHECK(card.errors == 0);
+
+	// A card that never leaves the idle state gives up after a second, at the initialization clock of f_osc / 128.
+	card.init_left = 0;
+	card.init_attempts = 0;
+	card.idle = true;
+	start = Host::spi_cycles;
+	CHECK(!Sdcard::init());
+	CHECK(elapsed_ms(start) >= 1000 && elapsed_ms(start) < 1500);
+
+	return Host::result("sdcard");
+}
+
+// vim: set foldmethod=marker :
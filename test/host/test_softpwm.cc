@@ -0,0 +1,102 @@
+// Host test for software PWM.
+
+#define NO_main
+#define SOFTPWM_CHANNELS 3
+
+#include <amat.hh>
+
+void setup() {}
+
+static uint8_t const pins[SOFTPWM_CHANNELS] = {GPIO_MAKE_PIN(PD, 2), GPIO_MAKE_PIN(PD, 3), GPIO_MAKE_PIN(PB, 1)};
+
+static bool high(uint8_t channel) { // {{{
+	return Gpio::PORT((pins[channel] >> 3) & 0xf) & (1 << (pins[channel] & 7));
+} // }}}
+
+// Run the interrupt at the next compare match.
+static void event() { // {{{
+	TCNT1 = OCR1A;
+	TIMER1_COMPA_vect();
+} // }}}
+
+// Run the interrupt for the start of a period; return its time.
+static uint16_t start() { // {{{
+	uint16_t t = OCR1A;
+	event();
+	return t;
+} // }}}
+
+// Run the interrupt until the start of the next period. Store the time that every channel was high in width.
+static void finish(uint16_t begin, uint16_t *width) { // {{{
+	for (uint8_t c = 0; c < SOFTPWM_CHANNELS; ++c)
+		width[c] = high(c) ? 0xffff : 0;
+	while (uint16_t(OCR1A - begin) != SoftPwm::period_ticks) {
+		uint16_t t = OCR1A;
+		event();
+		for (uint8_t c = 0; c < SOFTPWM_CHANNELS; ++c) {
+			if (width[c] == 0xffff && !high(c))
+				width[c] = t - begin;
+		}
+	}
+	for (uint8_t c = 0; c < SOFTPWM_CHANNELS; ++c) {
+		if (width[c] == 0xffff)
+			width[c] = SoftPwm::period_ticks;
+	}
+} // }}}
+
+static void period(uint16_t *width) { // {{{
+	uint16_t begin = start();
+	finish(begin, width);
+} // }}}
+
+int main() {
+	for (uint8_t c = 0; c < SOFTPWM_CHANNELS; ++c)
+		SoftPwm::setup_channel(c, pins[c]);
+	// At 16 MHz, a period is 40000 ticks of 0.5 µs.
+	CHECK(SoftPwm::period_ticks == 40000);
+	// Channels 0 and 1 share a port and an edge.
+	SoftPwm::set(0, 1000, false);
+	SoftPwm::set(1, 1000, false);
+	SoftPwm::set(2, 1500, false);
+	CHECK(SoftPwm::need_commit());
+	CHECK(SoftPwm::commit());
+	CHECK(!SoftPwm::need_commit());
+	TCNT1 = 0;
+	_AVR_SETUP_SOFTPWM
+
+	// The interrupt takes the committed frame at the start of the first period.
+	uint16_t width[SOFTPWM_CHANNELS];
+	period(width);
+	CHECK(width[0] == 2000 && width[1] == 2000 && width[2] == 3000);
+	CHECK(SoftPwm::frame[SoftPwm::front].num_edges == 2);
+	CHECK(!SoftPwm::pending);
+
+	// A commit during a period does not change that period, and does not touch the frame that is in use.
+	uint16_t begin = start();
+	SoftPwm::Frame active = SoftPwm::frame[SoftPwm::front];
+	CHECK(SoftPwm::set(0, 600));
+	CHECK(memcmp(&active, &SoftPwm::frame[SoftPwm::front], sizeof(active)) == 0);
+	// A second commit must wait until the interrupt took the first one.
+	CHECK(!SoftPwm::set(2, 0));
+	CHECK(SoftPwm::need_commit());
+	finish(begin, width);
+	CHECK(width[0] == 2000 && width[1] == 2000 && width[2] == 3000);
+	period(width);
+	CHECK(width[0] == 1200 && width[1] == 2000 && width[2] == 3000);
+	CHECK(SoftPwm::commit());
+	period(width);
+	CHECK(width[0] == 1200 && width[1] == 2000 && width[2] == 0);
+
+	// A pulse that ends close to the end of the period stays high.
+	CHECK(SoftPwm::set(1, 20000));
+	period(width);
+	CHECK(width[0] == 1200 && width[1] == 40000 && width[2] == 0);
+	CHECK(high(1));
+	CHECK(SoftPwm::set(1, 0));
+	period(width);
+	CHECK(width[0] == 1200 && width[1] == 0 && width[2] == 0);
+
+	return Host::result("softpwm");
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,97 @@
+// Host test for the polled SPI block transfer.
+
+#define NO_main
+#define SPI_ENABLE_MASTER
+
+#include <amat.hh>
+
+void setup() {}
+
+// A device that answers every byte with the byte it received before, plus its position. {{{
+struct Echo : Host::SpiDevice {
+	uint8_t last;
+	unsigned pos;
+	uint8_t got[64];
+
+	void select(bool active) {
+		last = 0x55;
+		pos = 0;
+	}
+
+	uint8_t transfer(uint8_t data) {
+		uint8_t ret = last + pos;
+		if (pos < sizeof(got))
+			got[pos] = data;
+		++pos;
+		last = data;
+		return ret;
+	}
+};
+// }}}
+
+static Echo echo;
+static Spi::Device const device = {GPIO_MAKE_PIN(PB, 2), 0, true, false, true};
+
+static void transfer(uint8_t const *tx, uint8_t *rx, uint16_t len) { // {{{
+	Spi::select(device);
+	Spi::transfer_block(tx, rx, len);
+	Spi::deselect(device);
+	Host::poll();
+} // }}}
+
+int main() {
+	Host::attach(echo, PORTB, 2);
+	Spi::enable();
+	Spi::setup_device(device);
+
+	for (uint16_t len = 1; len <= 40; len += 13) {
+		uint8_t tx[40];
+		uint8_t rx[40];
+		for (uint16_t i = 0; i < len; ++i)
+			tx[i] = 3 * i + 1;
+		unsigned long bytes = Host::spi_bytes;
+
+		// Send and receive; every byte must be received in order, while the next one is sent.
+		memset(rx, 0, sizeof(rx));
+		transfer(tx, rx, len);
+		for (uint16_t i = 0; i < len; ++i) {
+			CHECK(echo.got[i] == tx[i]);
+			CHECK(rx[i] == uint8_t((i == 0 ? 0x55 : tx[i - 1]) + i));
+		}
+
+		// Send only.
+		memset(echo.got, 0, sizeof(echo.got));
+		transfer(tx, NULL, len);
+		for (uint16_t i = 0; i < len; ++i)
+			CHECK(echo.got[i] == tx[i]);
+
+		// Receive only; 0xff is sent.
+		memset(rx, 0, sizeof(rx));
+		transfer(NULL, rx, len);
+		for (uint16_t i = 0; i < len; ++i) {
+			CHECK(echo.got[i] == 0xff);
+			CHECK(rx[i] == uint8_t((i == 0 ? 0x55 : 0xff) + i));
+		}
+
+		// Neither.
+		memset(echo.got, 0, sizeof(echo.got));
+		transfer(NULL, NULL, len);
+		for (uint16_t i = 0; i < len; ++i)
+			CHECK(echo.got[i] == 0xff);
+
+		CHECK(Host::spi_bytes - bytes == 4 * len);
+		CHECK(!(SPSR & _BV(WCOL)));
+	}
+	// The SPI interrupt is enabled again, and interrupts are as they were.
+	CHECK(SPCR & _BV(SPIE));
+	CHECK(!(SREG & _BV(SREG_I)));
+	uint8_t buffer[4] = {1, 2, 3, 4};
+	sei();
+	transfer(buffer, buffer, sizeof(buffer));
+	CHECK(SREG & _BV(SREG_I));
+	cli();
+
+	return Host::result("spi");
+}
+
+// vim: set foldmethod=marker :
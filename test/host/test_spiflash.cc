@@ -0,0 +1,252 @@
+// Host test for the SPI flash log.
+
+#define NO_main
+#define SPI_ENABLE_MASTER
+#define SPIFLASH_CS GPIO_MAKE_PIN(PB, 2)
+#define SPIFLASH_LOG_START 0x1000
+#define SPIFLASH_LOG_END 0x5000
+
+#include <amat.hh>
+
+void setup() {}
+
+// Simulated 64 kB flash chip. {{{
+struct Flash : Host::SpiDevice {
+	static uint32_t const SIZE = 0x10000;
+	uint8_t mem[SIZE];
+	uint8_t op;
+	uint32_t addr;
+	unsigned pos;
+	uint8_t page[256];
+	unsigned page_len;
+	bool wel;
+	// Number of status reads that still report busy.
+	unsigned busy;
+	unsigned erases[SIZE / 4096];
+	// Commands while busy, programming or erasing without write enable, and programming bits that are not erased.
+	unsigned errors;
+	// Number of bytes of the next program operation that are programmed before the power fails, or -1.
+	int cut;
+	// Program the bytes of a page from the last to the first.
+	bool reverse;
+	bool dead;
+
+	Flash() : pos(0), wel(false), busy(0), errors(0), cut(-1), reverse(false), dead(false) {
+		memset(mem, 0xff, sizeof(mem));
+		memset(erases, 0, sizeof(erases));
+	}
+
+	void select(bool active) {
+		if (active || dead || pos == 0) {
+			pos = 0;
+			return;
+		}
+		// Write enable, program and erase take effect when chip select goes high.
+		switch (op) {
+		case 0x06:
+			wel = true;
+			break;
+		case 0x02:
+			if (!wel)
+				++errors;
+			for (unsigned n = 0; n < page_len; ++n) {
+				if (int(n) == cut) {
+					dead = true;
+					break;
+				}
+				unsigned i = reverse ? page_len - 1 - n : n;
+				uint32_t a = (addr & ~0xff) | ((addr + i) & 0xff);
+				if ((mem[a] & page[i]) != page[i])
+					++errors;
+				mem[a] &= page[i];
+			}
+			wel = false;
+			busy = 3;
+			break;
+		case 0x20:
+			if (!wel)
+				++errors;
+			memset(&mem[addr & ~0xfff], 0xff, 4096);
+			++erases[addr >> 12];
+			wel = false;
+			busy = 20;
+			break;
+		}
+		pos = 0;
+	}
+
+	uint8_t transfer(uint8_t data) {
+		if (dead)
+			return 0xff;
+		uint8_t ret = 0xff;
+		unsigned p = pos++;
+		if (p == 0) {
+			op = data;
+			addr = 0;
+			page_len = 0;
+			if (busy && op != 0x05)
+				++errors;
+			return ret;
+		}
+		switch (op) {
+		case 0x05:
+			ret = busy ? 1 : 0;
+			if (busy)
+				--busy;
+			break;
+		case 0x9f:
+			ret = p == 1 ? 0xef : p == 2 ? 0x40 : 0x10;
+			break;
+		case 0x02:
+		case 0x0b:
+		case 0x20:
+			if (p < 4)
+				addr = (addr << 8 | data) % SIZE;
+			else if (op == 0x02 && page_len < 256)
+				page[page_len++] = data;
+			else if (op == 0x0b && p >= 5)
+				ret = mem[(addr + p - 5) % SIZE];
+			break;
+		}
+		return ret;
+	}
+};
+// }}}
+
+static Flash flash;
+static unsigned const page_data = SPIFLASH_PAGE_SIZE - 6;
+
+static void reboot() { // {{{
+	Host::poll();
+	flash.dead = false;
+	flash.busy = 0;
+	flash.wel = false;
+	flash.pos = 0;
+	Spiflash::setup();
+	Spiflash::log_begin();
+} // }}}
+
+// Append count bytes of a counter that starts at first; return the next value.
+static uint8_t append(uint8_t first, unsigned count) { // {{{
+	for (unsigned i = 0; i < count && !flash.dead; ++i) {
+		uint8_t value = first + i;
+		while (Spiflash::log_append(&value, 1) != 1 && !flash.dead)
+			Spiflash::log_poll();
+		Spiflash::log_poll();
+	}
+	return first + count;
+} // }}}
+
+static void flush() { // {{{
+	while (!Spiflash::log_flush())
+		Spiflash::log_poll();
+	while (Spiflash::log_pending() || Spiflash::busy())
+		Spiflash::log_poll();
+} // }}}
+
+// Read the log from old to new; return the number of bytes and the number of places where the counter jumps.
+static unsigned check_log(uint8_t expect_last, unsigned &jumps) { // {{{
+	unsigned total = 0;
+	jumps = 0;
+	uint8_t last = 0;
+	uint32_t addr = Spiflash::log_end();
+	do {
+		uint8_t data[256];
+		uint8_t len = 0;
+		CHECK(Spiflash::log_read(addr, data, len));
+		for (uint8_t i = 0; i < len; ++i) {
+			if (total > 0 && data[i] != uint8_t(last + 1))
+				++jumps;
+			last = data[i];
+			++total;
+		}
+		addr = Spiflash::log_next(addr);
+	} while (addr != Spiflash::log_end());
+	CHECK(total > 0 && last == expect_last);
+	return total;
+} // }}}
+
+// Let the power fail while a page is programmed, or while its commit byte is programmed; then reboot.
+// The torn page must be skipped; it is not programmed again before its sector is erased.
+static uint8_t tear(uint8_t next, int cut, bool reverse, bool commit) { // {{{
+	unsigned jumps;
+	check_log(next - 1, jumps);
+	unsigned before = jumps;
+	uint32_t end = Spiflash::log_end();
+	flash.reverse = reverse;
+	if (!commit)
+		flash.cut = cut;
+	next = append(next, page_data);
+	if (commit) {
+		while (Spiflash::_log_pending || !Spiflash::_log_commit)
+			Spiflash::log_poll();
+		flash.cut = cut;
+	}
+	while (!flash.dead && Spiflash::log_pending())
+		Spiflash::log_poll();
+	Host::poll();
+	CHECK(flash.dead);
+	flash.cut = -1;
+	flash.reverse = false;
+	reboot();
+	// A torn page at the start of a sector is used again after the sector is erased.
+	CHECK(Spiflash::log_end() == (end % SPIFLASH_SECTOR_SIZE == 0 ? end : Spiflash::log_next(end)));
+	uint8_t len = 0;
+	uint8_t buffer[256];
+	CHECK(Spiflash::log_read(end, buffer, len) && len == 0);
+	next = append(next, 2 * page_data);
+	flush();
+	check_log(next - 1, jumps);
+	CHECK(jumps == before + 1 && flash.errors == 0);
+	return next;
+} // }}}
+
+int main() {
+	Host::attach(flash, PORTB, 2);
+	Spi::enable();
+	reboot();
+	CHECK(Spiflash::jedec_id() == 0xef4010);
+	CHECK(Spiflash::log_end() == SPIFLASH_LOG_START);
+
+	// Fill the log more than twice; every sector is erased just before it is used.
+	unsigned const pages = (SPIFLASH_LOG_END - SPIFLASH_LOG_START) / SPIFLASH_PAGE_SIZE;
+	uint8_t next = append(0, 2 * pages * page_data + 1000);
+	flush();
+	CHECK(flash.errors == 0);
+	CHECK(flash.erases[0] == 0 && flash.erases[5] == 0);
+	for (uint8_t s = 1; s < 5; ++s)
+		CHECK(flash.erases[s] >= 2 && flash.erases[s] <= 3);
+	unsigned jumps;
+	// The sector after the end has just been erased, so 3 sectors of data remain.
+	unsigned total = check_log(next - 1, jumps);
+	CHECK(jumps == 0);
+	CHECK(total >= 3 * 16 * page_data);
+
+	// After a reboot, the log continues where it was.
+	uint32_t end = Spiflash::log_end();
+	reboot();
+	CHECK(Spiflash::log_end() == end);
+	next = append(next, 3 * page_data);
+	flush();
+	check_log(next - 1, jumps);
+	CHECK(jumps == 0 && flash.errors == 0);
+
+	// The power fails after the sequence number of a page was programmed, but before its length.
+	next = tear(next, 4, false, false);
+	// The header is complete, but the data is not.
+	next = tear(next, 100, false, false);
+	// Only the end of the data was programmed; the header is still erased.
+	next = tear(next, 50, true, false);
+	// The page is complete, but its commit byte is not.
+	next = tear(next, 0, false, true);
+
+	// The log wraps around again over the torn page.
+	next = append(next, pages * page_data);
+	flush();
+	check_log(next - 1, jumps);
+	CHECK(jumps == 0 && flash.errors == 0);
+
+	return Host::result("spiflash");
+}
+
+// vim: set foldmethod=marker :
@@ -0,0 +1,102 @@
+// Host test for the step generator.
+
+#define NO_main
+#define STEPPER_AXES 2
+
+#include <amat.hh>
+
+void setup() {}
+
+// Run the step generator until the queue is empty, at most limit ticks.
+// Return the number of ticks, or 0 if it did not finish.
+static unsigned long run(unsigned long limit, unsigned long *pulses) { // {{{
+	unsigned long ticks = 0;
+	pulses[0] = pulses[1] = 0;
+	while (Stepper::busy() || (TIMSK1 & _BV(OCIE1A))) {
+		if (ticks >= limit)
+			return 0;
+		TIMER1_COMPA_vect();
+		if (PORTD & _BV(2))
+			++pulses[0];
+		if (PORTD & _BV(3))
+			++pulses[1];
+		TIMER1_COMPB_vect();
+		++ticks;
+	}
+	return ticks;
+} // }}}
+
+int main() {
+	Stepper::setup_axis(0, Gpio::make_pin(PD, 2), Gpio::make_pin(PD, 5));
+	Stepper::setup_axis(1, Gpio::make_pin(PD, 3), Gpio::make_pin(PD, 6));
+	unsigned long pulses[2];
+
+	// Accelerate to 20000 steps/s at 50000 steps/s²: the ramps meet halfway, after about 0.253 s.
+	int32_t diagonal[2] = {3200, -1600};
+	CHECK(Stepper::move(diagonal, 20000, 50000));
+	unsigned long ticks = run(100000, pulses);
+	CHECK(ticks > 20240 * 95 / 100 && ticks < 20240 * 105 / 100);
+	CHECK(pulses[0] == 3200 && pulses[1] == 1600);
+	CHECK(Stepper::position(0) == 3200 && Stepper::position(1) == -1600);
+
+	// Single steps have no ramp.
+	for (uint8_t i = 0; i < 3; ++i) {
+		int32_t single[2] = {1, 0};
+		CHECK(Stepper::move(single, 20000, 50000));
+	}
+	CHECK(run(10000, pulses) != 0);
+	CHECK(pulses[0] == 3 && pulses[1] == 0);
+
+	// Low speed with high acceleration reaches full speed in the first step.
+	int32_t slow[2] = {-10, 10};
+	CHECK(Stepper::move(slow, 100, 1000000));
+	ticks = run(100000, pulses);
+	CHECK(ticks > 3900 && ticks < 4100);
+	CHECK(pulses[0] == 10 && pulses[1] == 10);
+
+	// Without acceleration, the move runs at full speed.
+	int32_t constant[2] = {0, 400};
+	CHECK(Stepper::move(constant, 4000, 0));
+	ticks = run(100000, pulses);
+	CHECK(ticks > 3900 && ticks < 4100);
+	CHECK(pulses[1] == 400);
+	CHECK(Stepper::position(0) == 3193 && Stepper::position(1) == -1190);
+
+	// The counter is stopped when the queue is empty, and started by move().
+	CHECK((TCCR1B & 7) == 0);
+	int32_t fast[2] = {300, 0};
+	CHECK(Stepper::move(fast, 30000, 0));
+	CHECK((TCCR1B & 7) == Counter::s1_div1);
+	// At 30000 steps/s, the steps are 1 or 2 ticks apart, 4 steps every 3 ticks on average.
+	unsigned long last = 0, shortest = ~0ul, longest = 0;
+	for (ticks = 1; Stepper::busy() || (TIMSK1 & _BV(OCIE1A)); ++ticks) {
+		TIMER1_COMPA_vect();
+		if (PORTD & _BV(2)) {
+			if (last != 0) {
+				shortest = ticks - last < shortest ? ticks - last : shortest;
+				longest = ticks - last > longest ? ticks - last : longest;
+			}
+			last = ticks;
+		}
+		TIMER1_COMPB_vect();
+	}
+	CHECK(shortest == 1 && longest == 2);
+	CHECK(ticks > 400 && ticks < 405);
+	CHECK((TCCR1B & 7) == 0);
+
+	// Stopping disables both interrupts and ends the step pulse.
+	int32_t far[2] = {100000, 100000};
+	CHECK(Stepper::move(far, 20000, 0));
+	for (uint8_t i = 0; i < 10; ++i)
+		TIMER1_COMPA_vect();
+	CHECK((PORTD & (_BV(2) | _BV(3))) != 0);
+	Stepper::stop();
+	CHECK(!Stepper::busy());
+	CHECK(!(TIMSK1 & (_BV(OCIE1A) | _BV(OCIE1B))));
+	CHECK(!(PORTD & (_BV(2) | _BV(3))));
+	CHECK((TCCR1B & 7) == 0);
+
+	return Host::result("stepper");
+}
+
+// vim: set foldmethod=marker :